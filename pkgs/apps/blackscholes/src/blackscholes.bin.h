@@ -0,0 +1,60 @@
+//Copyright (c) 2009 Princeton University
+//Columnar binary input format for the blackscholes benchmark
+//
+//A binary option file starts with a BinOptionHeader followed by one column
+//per option field. Every column starts at a multiple of BSBIN_ALIGN bytes
+//from the beginning of the file so that it can be memory-mapped and used
+//in place as one of the SoA arrays of the benchmark. Values are stored in
+//host byte order.
+
+#ifndef BLACKSCHOLES_BIN_H
+#define BLACKSCHOLES_BIN_H
+
+#define BSBIN_MAGIC   "BSOPTBIN"
+#define BSBIN_VERSION 1
+#define BSBIN_ALIGN   4096
+
+//Columns in file order. BSBIN_OTYPE holds ints (1=PUT, 0=CALL), all other
+//columns hold floating point values of BinOptionHeader.fpsize bytes.
+enum {
+  BSBIN_SPTPRICE = 0,
+  BSBIN_STRIKE,
+  BSBIN_RATE,
+  BSBIN_VOLATILITY,
+  BSBIN_OTIME,
+  BSBIN_OTYPE,
+  BSBIN_REFVAL,
+  BSBIN_NCOLUMNS
+};
+
+typedef struct BinOptionHeader_ {
+  char magic[8];                      //BSBIN_MAGIC, not null-terminated
+  int version;                        //BSBIN_VERSION
+  int fpsize;                         //size of a floating point value in bytes
+  long long numOptions;
+  long long offset[BSBIN_NCOLUMNS];   //file offset of each column
+} BinOptionHeader;
+
+//Size in bytes of column c of the file described by hdr
+static inline long long BinOptionColumnSize(const BinOptionHeader *hdr, int c) {
+  return hdr->numOptions * (c == BSBIN_OTYPE ? (long long)sizeof(int) : (long long)hdr->fpsize);
+}
+
+//Fill in the header for a file with numOptions options
+static inline void BinOptionLayout(BinOptionHeader *hdr, long long numOptions, int fpsize) {
+  long long pos = BSBIN_ALIGN;
+  long long len;
+  int c;
+
+  memcpy(hdr->magic, BSBIN_MAGIC, sizeof(hdr->magic));
+  hdr->version = BSBIN_VERSION;
+  hdr->fpsize = fpsize;
+  hdr->numOptions = numOptions;
+  for(c=0; c<BSBIN_NCOLUMNS; c++) {
+    hdr->offset[c] = pos;
+    len = BinOptionColumnSize(hdr, c);
+    pos += (len + BSBIN_ALIGN - 1) / BSBIN_ALIGN * BSBIN_ALIGN;
+  }
+}
+
+#endif //BLACKSCHOLES_BIN_H
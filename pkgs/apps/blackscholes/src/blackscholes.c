@@ -12,6 +12,17 @@
 #include <math.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "blackscholes.bin.h"
+
 #ifdef ENABLE_PARSEC_HOOKS
 #include <hooks.h>
 #endif
@@ -22,6 +33,11 @@
 #define __thread __threadp
 MAIN_ENV
 #undef __thread
+
+// Dynamic load balancing with NUMA-aware work stealing, see bs_thread
+#if !defined(WIN32) && defined(__GNUC__)
+#define ENABLE_WORK_STEALING
+#endif
 #endif
 
 // Multi-threaded OpenMP header
@@ -64,8 +80,18 @@ typedef struct OptionData_ {
         fptype DGrefval;   // DerivaGem Reference Value
 } OptionData;
 
-OptionData *data;
+OptionData *data = NULL;
 fptype *prices;
+#ifdef ENABLE_GREEKS
+// Greeks of the options: five columns of greekStride values each
+fptype *greeks;
+int greekStride;
+fptype *deltas;
+fptype *gammas;
+fptype *vegas;
+fptype *thetas;
+fptype *rhos;
+#endif
 int numOptions;
 
 int    * otype;
@@ -74,8 +100,14 @@ fptype * strike;
 fptype * rate;
 fptype * volatility;
 fptype * otime;
+fptype * refval;
 int numError = 0;
+#if defined(ENABLE_GREEKS) && defined(ERR_CHK)
+int numIVError = 0;
+#endif
 int nThreads;
+int numRuns = NUM_RUNS;
+int optionBase = 0;
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -85,7 +117,9 @@ int nThreads;
 // See Hull, Section 11.8, P.243-244
 #define inv_sqrt_2xPI 0.39894228040143270286
 
-fptype CNDF ( fptype InputX ) 
+// Also returns the normal density n(InputX) in PdfX, which the
+// approximation computes on the way
+static inline fptype CNDFPdf ( fptype InputX, fptype *PdfX )
 {
     int sign;
 
@@ -112,6 +146,7 @@ fptype CNDF ( fptype InputX )
     expValues = exp(-0.5f * InputX * InputX);
     xNPrimeofX = expValues;
     xNPrimeofX = xNPrimeofX * inv_sqrt_2xPI;
+    *PdfX = xNPrimeofX;
 
     xK2 = 0.2316419 * xInput;
     xK2 = 1.0 + xK2;
@@ -143,6 +178,13 @@ fptype CNDF ( fptype InputX )
     return OutputX;
 } 
 
+fptype CNDF ( fptype InputX ) 
+{
+    fptype PdfX;
+
+    return CNDFPdf( InputX, &PdfX );
+}
+
 //////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////
@@ -217,6 +259,192 @@ fptype BlkSchlsEqEuroNoDiv( fptype sptprice,
     return OptionPrice;
 }
 
+#ifdef ENABLE_GREEKS
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+// Price and sensitivities of a European option without dividends in a single pass.
+// d1, d2, N(d1), N(d2), the normal density n(d1) and the discounted strike are shared
+// by all outputs, n(d1) comes out of the evaluation of N(d1). Vega and rho are per unit of
+// volatility and rate, theta is per year.
+static inline void BlkSchlsGreeks( fptype sptprice, fptype strike, fptype rate,
+                                   fptype volatility, fptype time, int otype,
+                                   fptype *OptionPrice, fptype *delta, fptype *gamma,
+                                   fptype *vega, fptype *theta, fptype *rho )
+{
+    fptype xSqrtTime;
+    fptype xLogTerm;
+    fptype xPowerTerm;
+    fptype xDen;
+    fptype xD1;
+    fptype xD2;
+    fptype NofXd1;
+    fptype NofXd2;
+    fptype PdfXd1;
+    fptype FutureValueX;
+    fptype xDecay;
+
+    xSqrtTime = sqrt(time);
+    xLogTerm = log( sptprice / strike );
+    xPowerTerm = volatility * volatility * 0.5;
+    xDen = volatility * xSqrtTime;
+    xD1 = ((rate + xPowerTerm) * time + xLogTerm) / xDen;
+    xD2 = xD1 - xDen;
+
+    NofXd1 = CNDFPdf( xD1, &PdfXd1 );
+    NofXd2 = CNDF( xD2 );
+
+    FutureValueX = strike * ( exp( -(rate)*(time) ) );
+    xDecay = -(sptprice * PdfXd1 * volatility) / (2.0f * xSqrtTime);
+
+    // Put values follow from put-call parity: N(-x) = 1 - N(x)
+    if (otype != 0) {
+        NofXd1 = NofXd1 - 1.0f;
+        NofXd2 = NofXd2 - 1.0f;
+    }
+    *OptionPrice = (sptprice * NofXd1) - (FutureValueX * NofXd2);
+    *delta = NofXd1;
+    *gamma = PdfXd1 / (sptprice * xDen);
+    *vega  = sptprice * PdfXd1 * xSqrtTime;
+    *theta = xDecay - rate * FutureValueX * NofXd2;
+    *rho   = time * FutureValueX * NofXd2;
+}
+
+// Batch interface: price and Greeks of numOptions options stored as SoA arrays
+void BlkSchlsGreeksEuroNoDiv( int numOptions, fptype *sptprice, fptype *strike,
+                              fptype *rate, fptype *volatility, fptype *time,
+                              int *otype, fptype *OptionPrice, fptype *delta,
+                              fptype *gamma, fptype *vega, fptype *theta, fptype *rho )
+{
+    int i;
+
+    for (i=0; i<numOptions; i++) {
+        BlkSchlsGreeks( sptprice[i], strike[i], rate[i], volatility[i], time[i],
+                        otype[i], &OptionPrice[i], &delta[i], &gamma[i], &vega[i],
+                        &theta[i], &rho[i] );
+    }
+}
+
+// Implied volatility solver
+//
+// Options are solved in blocks of IV_BLOCK that iterate in lockstep. Each
+// iteration evaluates price and vega of the whole block with
+// BlkSchlsPriceVegaBlock and then updates every lane under a mask, so both
+// loops are straight-line code over SoA arrays that the compiler can
+// vectorize (GCC needs -fno-trapping-math to if-convert the update and a
+// vector libm, e.g. -ffast-math with glibc, for the price). Every option
+// keeps a bracket [lo, hi] around its root. A Newton step is taken when it
+// stays inside the bracket, otherwise the bracket is bisected, so the
+// iteration cannot diverge where vega is small. Options whose price is
+// outside the no-arbitrage bounds get a volatility of -1.
+#define IV_BLOCK    64
+#define IV_MAX_ITER 64
+#define IV_VOL_MIN  1e-4
+#define IV_VOL_MAX  8.0
+
+// Price and vega of n options, the only outputs the solver needs
+static inline void BlkSchlsPriceVegaBlock( int n, const fptype *sptprice,
+                                           const fptype *strike, const fptype *rate,
+                                           const fptype *volatility, const fptype *time,
+                                           const int *otype, fptype *OptionPrice,
+                                           fptype *vega )
+{
+    int i;
+    fptype xSqrtTime;
+    fptype xPowerTerm;
+    fptype xDen;
+    fptype xD1;
+    fptype NofXd1;
+    fptype NofXd2;
+    fptype PdfXd1;
+    fptype FutureValueX;
+    fptype put;
+
+    for (i=0; i<n; i++) {
+        xSqrtTime = sqrt(time[i]);
+        xPowerTerm = volatility[i] * volatility[i] * 0.5;
+        xDen = volatility[i] * xSqrtTime;
+        xD1 = ((rate[i] + xPowerTerm) * time[i] + log( sptprice[i] / strike[i] )) / xDen;
+
+        NofXd1 = CNDFPdf( xD1, &PdfXd1 );
+        NofXd2 = CNDF( xD1 - xDen );
+        FutureValueX = strike[i] * ( exp( -(rate[i])*(time[i]) ) );
+
+        // put-call parity without a branch on the option type
+        put = (fptype)(otype[i] != 0);
+        OptionPrice[i] = (sptprice[i] * (NofXd1 - put)) - (FutureValueX * (NofXd2 - put));
+        vega[i] = sptprice[i] * PdfXd1 * xSqrtTime;
+    }
+}
+
+int BlkSchlsImpliedVol( int numOptions, fptype *OptionPrice, fptype *sptprice,
+                        fptype *strike, fptype *rate, fptype *time, int *otype,
+                        fptype *volatility, fptype tolerance )
+{
+    int b, i, n, it;
+    int active;
+    int live;
+    int numFailed = 0;
+    fptype sigma[IV_BLOCK], lo[IV_BLOCK], hi[IV_BLOCK];
+    fptype price[IV_BLOCK], vega[IV_BLOCK];
+    fptype diff, step, next;
+    fptype sig, l, h;
+    fptype df, lower, upper;
+    int bad[IV_BLOCK], done[IV_BLOCK];
+
+    for (b=0; b<numOptions; b += IV_BLOCK) {
+        n = (numOptions - b < IV_BLOCK) ? numOptions - b : IV_BLOCK;
+
+        for (i=0; i<n; i++) {
+            // no-arbitrage bounds of the price
+            df = exp(-rate[b+i] * time[b+i]);
+            lower = (otype[b+i] == 0) ? sptprice[b+i] - strike[b+i] * df
+                                      : strike[b+i] * df - sptprice[b+i];
+            upper = (otype[b+i] == 0) ? sptprice[b+i] : strike[b+i] * df;
+            bad[i] = !(OptionPrice[b+i] > lower && OptionPrice[b+i] < upper);
+            done[i] = bad[i];
+            sigma[i] = 0.3f;
+            lo[i] = IV_VOL_MIN;
+            hi[i] = IV_VOL_MAX;
+        }
+
+        for (it=0; it<IV_MAX_ITER; it++) {
+            // finished lanes are evaluated too but their state is left alone
+            BlkSchlsPriceVegaBlock( n, &sptprice[b], &strike[b], &rate[b], sigma,
+                                    &time[b], &otype[b], price, vega );
+            active = 0;
+            for (i=0; i<n; i++) {
+                diff = price[i] - OptionPrice[b+i];
+                live = (!done[i]) & (!(fabs(diff) <= tolerance));
+                done[i] = !live;
+                // price is increasing in volatility
+                sig = sigma[i];
+                h = (live & (diff > 0)) ? sig : hi[i];
+                l = (live & !(diff > 0)) ? sig : lo[i];
+                // sig is now an end of the bracket, so a step that is not
+                // finite because vega is 0 falls back to bisection as well
+                step = diff / vega[i];
+                next = sig - step;
+                next = ((next > l) & (next < h)) ? next : 0.5f * (l + h);
+                sigma[i] = live ? next : sig;
+                hi[i] = h;
+                lo[i] = l;
+                active += live;
+            }
+            if (active == 0) break;
+        }
+
+        for (i=0; i<n; i++) {
+            volatility[b+i] = bad[i] ? -1.0f : sigma[i];
+            numFailed += (!done[i]) | bad[i];
+        }
+    }
+
+    return numFailed;
+}
+#endif //ENABLE_GREEKS
+
 #ifdef ENABLE_TBB
 struct mainWork {
   mainWork() {}
@@ -232,16 +460,23 @@ struct mainWork {
        * Black & Scholes's equation.
        */
 
+#ifdef ENABLE_GREEKS
+      BlkSchlsGreeks( sptprice[i], strike[i], rate[i], volatility[i], otime[i],
+                      otype[i], &price, &deltas[i], &gammas[i], &vegas[i],
+                      &thetas[i], &rhos[i] );
+      prices[i] = price;
+#else
       price = BlkSchlsEqEuroNoDiv( sptprice[i], strike[i],
                                    rate[i], volatility[i], otime[i], 
                                    otype[i], 0);
       prices[i] = price;
+#endif
 
 #ifdef ERR_CHK 
-      fptype priceDelta = data[i].DGrefval - price;
+      fptype priceDelta = refval[i] - price;
       if( fabs(priceDelta) >= 1e-5 ){
         fprintf(stderr,"Error on %d. Computed=%.5f, Ref=%.5f, Delta=%.5f\n",
-               i, price, data[i].DGrefval, priceDelta);
+               optionBase + i, price, refval[i], priceDelta);
         numError ++;
       }
 #endif
@@ -251,6 +486,151 @@ struct mainWork {
 
 #endif // ENABLE_TBB
 
+//Copy options [start, end) of a text input file into the SoA arrays
+void TransposeOptions(int start, int end)
+{
+    int i;
+
+    for (i=start; i<end; i++) {
+        otype[i]      = (data[i].OptionType == 'P') ? 1 : 0;
+        sptprice[i]   = data[i].s;
+        strike[i]     = data[i].strike;
+        rate[i]       = data[i].r;
+        volatility[i] = data[i].v;    
+        otime[i]      = data[i].t;
+        refval[i]     = data[i].DGrefval;
+    }
+}
+
+#ifdef ENABLE_WORK_STEALING
+//////////////////////////////////////////////////////////////////////////////////////
+// Work stealing for the pthreads version
+//
+// Thread tid owns the block of options [tid*n/nThreads, (tid+1)*n/nThreads).
+// The block is first touched by its owner (see touch_thread) so that its
+// pages are allocated on the owner's NUMA node, and threads are pinned so
+// that they stay there. Each block is consumed in chunks of STEAL_CHUNK
+// options through an atomic cursor. A thread that has finished its own
+// block steals chunks from the blocks of threads on the same socket first
+// and from remote sockets last.
+//////////////////////////////////////////////////////////////////////////////////////
+#define STEAL_CHUNK 1024
+
+typedef struct WorkQueue_ {
+    int start;
+    int end;
+    int socket;
+    // Cursor per run parity: the owner resets the cursor of the next run
+    // before the barrier that ends the current run
+    volatile int next[2];
+} __attribute__((aligned(64))) WorkQueue;
+
+WorkQueue * queues = NULL;
+BARDEC(runBarrier)
+
+// CPUs the process may run on, ordered by socket
+int numCpus = 0;
+int * cpuOrder = NULL;
+int * cpuSocket = NULL;
+
+// Read the socket of every CPU in the affinity mask of the process
+void InitTopology()
+{
+    cpu_set_t set;
+    int cpu, i, j, t;
+    int socket;
+    char path[128];
+    FILE *f;
+
+    if(sched_getaffinity(0, sizeof(set), &set) != 0) {
+      return;
+    }
+    cpuOrder = (int *) malloc(CPU_SETSIZE * sizeof(int));
+    cpuSocket = (int *) malloc(CPU_SETSIZE * sizeof(int));
+    for(cpu=0; cpu<CPU_SETSIZE; cpu++) {
+      cpuSocket[cpu] = 0;
+      if(!CPU_ISSET(cpu, &set)) continue;
+      sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+      f = fopen(path, "r");
+      if(f != NULL) {
+        if(fscanf(f, "%d", &socket) == 1 && socket >= 0) cpuSocket[cpu] = socket;
+        fclose(f);
+      }
+      cpuOrder[numCpus++] = cpu;
+    }
+    // stable insertion sort by socket
+    for(i=1; i<numCpus; i++) {
+      t = cpuOrder[i];
+      for(j=i; j>0 && cpuSocket[cpuOrder[j-1]] > cpuSocket[t]; j--) {
+        cpuOrder[j] = cpuOrder[j-1];
+      }
+      cpuOrder[j] = t;
+    }
+}
+
+int ThreadCpu(int tid)
+{
+    return cpuOrder[tid % numCpus];
+}
+
+void PinThread(int tid)
+{
+    cpu_set_t set;
+
+    if(numCpus == 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(ThreadCpu(tid), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Set up the blocks of all threads for numOptions options
+void InitQueues()
+{
+    int t;
+
+    if(queues == NULL) {
+      if(posix_memalign((void **)&queues, 64, MAX_THREADS * sizeof(WorkQueue)) != 0) {
+        printf("ERROR: Unable to allocate work queues.\n");
+        exit(1);
+      }
+    }
+    for(t=0; t<nThreads; t++) {
+      queues[t].start = (int)((long long)t * numOptions / nThreads);
+      queues[t].end = (int)((long long)(t + 1) * numOptions / nThreads);
+      queues[t].socket = (numCpus > 0) ? cpuSocket[ThreadCpu(t)] : 0;
+      queues[t].next[0] = queues[t].start;
+      queues[t].next[1] = queues[t].start;
+    }
+}
+
+// Grab the next chunk of run parity p for thread tid. Returns the first
+// option of the chunk and stores its end in *end, or returns -1 once all
+// blocks are exhausted.
+int NextChunk(int tid, int p, int *end)
+{
+    int pass, k, v;
+    int begin;
+    WorkQueue *q;
+
+    // pass 0: own block, pass 1: same socket, pass 2: remote sockets
+    for(pass=0; pass<3; pass++) {
+      for(k=0; k<nThreads; k++) {
+        v = (tid + k) % nThreads;
+        if((pass == 0) != (v == tid)) continue;
+        if(pass > 0 && (pass == 1) != (queues[v].socket == queues[tid].socket)) continue;
+        q = &queues[v];
+        if(q->next[p] >= q->end) continue;
+        begin = __sync_fetch_and_add(&q->next[p], STEAL_CHUNK);
+        if(begin < q->end) {
+          *end = (begin + STEAL_CHUNK < q->end) ? begin + STEAL_CHUNK : q->end;
+          return begin;
+        }
+      }
+    }
+    return -1;
+}
+#endif //ENABLE_WORK_STEALING
+
 //////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////
@@ -262,7 +642,7 @@ int bs_thread(void *tid_ptr) {
     tbb::affinity_partitioner a;
 
     mainWork doall;
-    for (j=0; j<NUM_RUNS; j++) {
+    for (j=0; j<numRuns; j++) {
       tbb::parallel_for(tbb::blocked_range<int>(0, numOptions), doall, a);
     }
 
@@ -278,98 +658,103 @@ int bs_thread(void *tid_ptr) {
     int i, j;
     fptype price;
     fptype priceDelta;
+#ifdef ENABLE_WORK_STEALING
     int tid = *(int *)tid_ptr;
-    int start = tid * (numOptions / nThreads);
-    int end = start + (numOptions / nThreads);
+    int begin, end;
 
-    for (j=0; j<NUM_RUNS; j++) {
+    PinThread(tid);
+#elif !defined(ENABLE_OPENMP)
+    int tid = *(int *)tid_ptr;
+    int start = (int)((long long)tid * numOptions / nThreads);
+    int end = (int)((long long)(tid + 1) * numOptions / nThreads);
+#endif
+
+    for (j=0; j<numRuns; j++) {
 #ifdef ENABLE_OPENMP
 #pragma omp parallel for private(i, price, priceDelta)
         for (i=0; i<numOptions; i++) {
+#elif defined(ENABLE_WORK_STEALING)
+        while ((begin = NextChunk(tid, j & 1, &end)) >= 0)
+        for (i=begin; i<end; i++) {
 #else  //ENABLE_OPENMP
         for (i=start; i<end; i++) {
 #endif //ENABLE_OPENMP
             /* Calling main function to calculate option value based on 
              * Black & Scholes's equation.
              */
+#ifdef ENABLE_GREEKS
+            BlkSchlsGreeks( sptprice[i], strike[i], rate[i], volatility[i], otime[i],
+                            otype[i], &price, &deltas[i], &gammas[i], &vegas[i],
+                            &thetas[i], &rhos[i] );
+            prices[i] = price;
+#else
             price = BlkSchlsEqEuroNoDiv( sptprice[i], strike[i],
                                          rate[i], volatility[i], otime[i], 
                                          otype[i], 0);
             prices[i] = price;
+#endif
 
 #ifdef ERR_CHK
-            priceDelta = data[i].DGrefval - price;
+            priceDelta = refval[i] - price;
             if( fabs(priceDelta) >= 1e-4 ){
                 printf("Error on %d. Computed=%.5f, Ref=%.5f, Delta=%.5f\n",
-                       i, price, data[i].DGrefval, priceDelta);
+                       optionBase + i, price, refval[i], priceDelta);
                 numError ++;
             }
 #endif
         }
+#ifdef ENABLE_WORK_STEALING
+        queues[tid].next[(j + 1) & 1] = queues[tid].start;
+        BARRIER(runBarrier);
+#endif
     }
 
     return 0;
 }
+
+#ifdef ENABLE_WORK_STEALING
+// Copy the options of the calling thread's block into the SoA arrays and
+// clear its prices, so that the pages are first touched by their owner
+int touch_thread(void *tid_ptr) {
+    int tid = *(int *)tid_ptr;
+    int start = (int)((long long)tid * numOptions / nThreads);
+    int end = (int)((long long)(tid + 1) * numOptions / nThreads);
+
+    PinThread(tid);
+    if(data != NULL) {
+      TransposeOptions(start, end);
+    }
+    memset(&prices[start], 0, (end - start) * sizeof(fptype));
+#ifdef ENABLE_GREEKS
+    for(int g=0; g<5; g++) {
+      memset(&greeks[g * greekStride + start], 0, (end - start) * sizeof(fptype));
+    }
+#endif
+    return 0;
+}
+#endif //ENABLE_WORK_STEALING
 #endif //ENABLE_TBB
 
-int main (int argc, char **argv)
+//Allocation holding the SoA arrays of a text input file
+fptype * buffer;
+int * buffer2;
+
+//Parse a text input file into data and allocate the SoA arrays. The
+//options are copied into the SoA arrays by TransposeOptions.
+void ReadTextInput(FILE *file, char *inputFile)
 {
-    FILE *file;
-    int i;
     int loopnum;
-    fptype * buffer;
-    int * buffer2;
     int rv;
 
-#ifdef PARSEC_VERSION
-#define __PARSEC_STRING(x) #x
-#define __PARSEC_XSTRING(x) __PARSEC_STRING(x)
-        printf("PARSEC Benchmark Suite Version " __PARSEC_XSTRING(PARSEC_VERSION)"\n");
-	fflush(NULL);
-#else
-        printf("PARSEC Benchmark Suite\n");
-	fflush(NULL);
-#endif //PARSEC_VERSION
-#ifdef ENABLE_PARSEC_HOOKS
-   __parsec_bench_begin(__parsec_blackscholes);
-#endif
-
-   if (argc != 4)
-        {
-                printf("Usage:\n\t%s <nthreads> <inputFile> <outputFile>\n", argv[0]);
-                exit(1);
-        }
-    nThreads = atoi(argv[1]);
-    char *inputFile = argv[2];
-    char *outputFile = argv[3];
-
-    //Read input data from file
-    file = fopen(inputFile, "r");
-    if(file == NULL) {
-      printf("ERROR: Unable to open file `%s'.\n", inputFile);
-      exit(1);
-    }
     rv = fscanf(file, "%i", &numOptions);
     if(rv != 1) {
       printf("ERROR: Unable to read from file `%s'.\n", inputFile);
       fclose(file);
       exit(1);
     }
-    if(nThreads > numOptions) {
-      printf("WARNING: Not enough work, reducing number of threads to match number of options.\n");
-      nThreads = numOptions;
-    }
-
-#if !defined(ENABLE_THREADS) && !defined(ENABLE_OPENMP) && !defined(ENABLE_TBB)
-    if(nThreads != 1) {
-        printf("Error: <nthreads> must be 1 (serial version)\n");
-        exit(1);
-    }
-#endif
 
     // alloc spaces for the option data
     data = (OptionData*)malloc(numOptions*sizeof(OptionData));
-    prices = (fptype*)malloc(numOptions*sizeof(fptype));
     for ( loopnum = 0; loopnum < numOptions; ++ loopnum )
     {
         rv = fscanf(file, "%f %f %f %f %f %f %c %f %f", &data[loopnum].s, &data[loopnum].strike, &data[loopnum].r, &data[loopnum].divq, &data[loopnum].v, &data[loopnum].t, &data[loopnum].OptionType, &data[loopnum].divs, &data[loopnum].DGrefval);
@@ -385,41 +770,181 @@ int main (int argc, char **argv)
       exit(1);
     }
 
-#ifdef ENABLE_THREADS
-    MAIN_INITENV(,8000000,nThreads);
-#endif
-    printf("Num of Options: %d\n", numOptions);
-    printf("Num of Runs: %d\n", NUM_RUNS);
-
 #define PAD 256
 #define LINESIZE 64
 
-    buffer = (fptype *) malloc(5 * numOptions * sizeof(fptype) + PAD);
+    buffer = (fptype *) malloc(6 * numOptions * sizeof(fptype) + PAD);
     sptprice = (fptype *) (((unsigned long long)buffer + PAD) & ~(LINESIZE - 1));
     strike = sptprice + numOptions;
     rate = strike + numOptions;
     volatility = rate + numOptions;
     otime = volatility + numOptions;
+    refval = otime + numOptions;
 
     buffer2 = (int *) malloc(numOptions * sizeof(fptype) + PAD);
     otype = (int *) (((unsigned long long)buffer2 + PAD) & ~(LINESIZE - 1));
 
-    for (i=0; i<numOptions; i++) {
-        otype[i]      = (data[i].OptionType == 'P') ? 1 : 0;
-        sptprice[i]   = data[i].s;
-        strike[i]     = data[i].strike;
-        rate[i]       = data[i].r;
-        volatility[i] = data[i].v;    
-        otime[i]      = data[i].t;
+}
+
+#ifndef WIN32
+//Memory-mapped binary input file, if any
+void * mapBase = NULL;
+size_t mapSize = 0;
+
+//Read and validate the header of a binary input file
+void ReadBinaryHeader(int fd, char *inputFile, BinOptionHeader *hdr)
+{
+    struct stat st;
+    int c;
+
+    if(pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) || fstat(fd, &st) != 0) {
+      printf("ERROR: Unable to read from file `%s'.\n", inputFile);
+      close(fd);
+      exit(1);
+    }
+    if(hdr->version != BSBIN_VERSION || hdr->fpsize != sizeof(fptype)) {
+      printf("ERROR: File `%s' has version %d with %d-byte values, expected version %d with %d-byte values.\n",
+             inputFile, hdr->version, hdr->fpsize, BSBIN_VERSION, (int)sizeof(fptype));
+      close(fd);
+      exit(1);
+    }
+    if(hdr->numOptions < 1 || hdr->numOptions > 0x7fffffff) {
+      printf("ERROR: File `%s' is truncated or corrupt.\n", inputFile);
+      close(fd);
+      exit(1);
     }
+    //Every column must be aligned, start after the header and end within
+    //the file, otherwise touching the mapping past EOF raises SIGBUS
+    for(c=0; c<BSBIN_NCOLUMNS; c++) {
+      if(hdr->offset[c] % BSBIN_ALIGN != 0 ||
+         hdr->offset[c] < (long long)sizeof(*hdr) ||
+         hdr->offset[c] > (long long)st.st_size - BinOptionColumnSize(hdr, c)) {
+        printf("ERROR: File `%s' is truncated or corrupt.\n", inputFile);
+        close(fd);
+        exit(1);
+      }
+    }
+}
 
-    printf("Size of data: %lu\n", numOptions * (sizeof(OptionData) + sizeof(int)));
+//Map a columnar binary input file (see blackscholes.bin.h) and point the
+//SoA arrays directly at its columns. The columns are page-aligned in the
+//file, so no parsing or copying is required.
+void MapBinaryInput(char *inputFile)
+{
+    BinOptionHeader hdr;
+    struct stat st;
+    int fd;
 
-#ifdef ENABLE_PARSEC_HOOKS
-    __parsec_roi_begin();
-#endif
+    fd = open(inputFile, O_RDONLY);
+    if(fd < 0) {
+      printf("ERROR: Unable to open file `%s'.\n", inputFile);
+      exit(1);
+    }
+    ReadBinaryHeader(fd, inputFile, &hdr);
+    if(fstat(fd, &st) != 0) {
+      printf("ERROR: Unable to read from file `%s'.\n", inputFile);
+      close(fd);
+      exit(1);
+    }
+
+    mapSize = st.st_size;
+    mapBase = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapBase == MAP_FAILED) {
+      printf("ERROR: Unable to map file `%s'.\n", inputFile);
+      exit(1);
+    }
+
+    numOptions = (int)hdr.numOptions;
+    sptprice   = (fptype *)((char *)mapBase + hdr.offset[BSBIN_SPTPRICE]);
+    strike     = (fptype *)((char *)mapBase + hdr.offset[BSBIN_STRIKE]);
+    rate       = (fptype *)((char *)mapBase + hdr.offset[BSBIN_RATE]);
+    volatility = (fptype *)((char *)mapBase + hdr.offset[BSBIN_VOLATILITY]);
+    otime      = (fptype *)((char *)mapBase + hdr.offset[BSBIN_OTIME]);
+    otype      = (int *)((char *)mapBase + hdr.offset[BSBIN_OTYPE]);
+    refval     = (fptype *)((char *)mapBase + hdr.offset[BSBIN_REFVAL]);
+}
+#endif //WIN32
+
+#ifdef ENABLE_GREEKS
+//Point the Greek columns into g, five columns of stride values each
+void SetGreeks(fptype *g, int stride)
+{
+    greeks = g;
+    greekStride = stride;
+    deltas = g;
+    gammas = g + stride;
+    vegas = g + 2 * stride;
+    thetas = g + 3 * stride;
+    rhos = g + 4 * stride;
+}
+
+#ifdef ERR_CHK
+//Recover the volatility of every option from its computed price. Options
+//with a small vega are skipped, their volatility is ill-conditioned.
+void CheckImpliedVol()
+{
+    int i;
+    fptype *ivol = (fptype *) malloc(numOptions * sizeof(fptype));
+
+    BlkSchlsImpliedVol(numOptions, prices, sptprice, strike, rate, otime, otype, ivol, 1e-5);
+    for(i=0; i<numOptions; i++) {
+      if(vegas[i] > 1.0 && fabs(ivol[i] - volatility[i]) >= 1e-3) {
+        printf("IV error on %d. Computed=%.5f, Ref=%.5f\n", optionBase + i, ivol[i], volatility[i]);
+        numIVError ++;
+      }
+    }
+    free(ivol);
+}
+#endif //ERR_CHK
+#endif //ENABLE_GREEKS
+
+//Write n prices to the output file, followed by their Greeks if g is not
+//NULL. g holds five columns of stride values each.
+void WritePrices(FILE *file, char *outputFile, fptype *p, fptype *g, int stride, int n)
+{
+    int i;
+    int rv;
+
+    for(i=0; i<n; i++) {
+      if(g != NULL) {
+        rv = fprintf(file, "%.18f %.18f %.18f %.18f %.18f %.18f\n", p[i], g[i],
+                     g[stride + i], g[2 * stride + i], g[3 * stride + i], g[4 * stride + i]);
+      } else {
+        rv = fprintf(file, "%.18f\n", p[i]);
+      }
+      if(rv < 0) {
+        printf("ERROR: Unable to write to file `%s'.\n", outputFile);
+        fclose(file);
+        exit(1);
+      }
+    }
+}
+
+#ifdef ENABLE_WORK_STEALING
+//Let every thread first touch its own block of options
+void FirstTouch()
+{
+    int i;
+    int *tids;
+    tids = (int *) malloc (nThreads * sizeof(int));
+
+    MAIN_INITENV(,8000000,nThreads);
+    for(i=0; i<nThreads; i++) {
+        tids[i]=i;
+        CREATE_WITH_ARG(touch_thread, &tids[i]);
+    }
+    WAIT_FOR_END(nThreads);
+    free(tids);
+}
+#endif //ENABLE_WORK_STEALING
 
+//Price numOptions options from the SoA arrays with the selected back end
+void PriceOptions()
+{
 #ifdef ENABLE_THREADS
+    int i;
+
 #ifdef WIN32
     HANDLE *threads;
     int *nums;
@@ -437,12 +962,22 @@ int main (int argc, char **argv)
     int *tids;
     tids = (int *) malloc (nThreads * sizeof(int));
 
+    //reset the thread table so that the back end can be launched repeatedly
+    MAIN_INITENV(,8000000,nThreads);
+#ifdef ENABLE_WORK_STEALING
+    InitQueues();
+    BARINIT(runBarrier);
+#endif
+
     for(i=0; i<nThreads; i++) {
         tids[i]=i;
         CREATE_WITH_ARG(bs_thread, &tids[i]);
     }
     WAIT_FOR_END(nThreads);
     free(tids);
+#ifdef ENABLE_WORK_STEALING
+    pthread_barrier_destroy(&runBarrier);
+#endif
 #endif //WIN32
 #else //ENABLE_THREADS
 #ifdef ENABLE_OPENMP
@@ -464,42 +999,431 @@ int main (int argc, char **argv)
 #endif //ENABLE_TBB
 #endif //ENABLE_OPENMP
 #endif //ENABLE_THREADS
+}
 
-#ifdef ENABLE_PARSEC_HOOKS
-    __parsec_roi_end();
+#ifndef WIN32
+//Streaming mode
+//
+//The input is processed in chunks of a fixed number of options. While the
+//back end prices one chunk, a helper thread writes out the prices of the
+//previous chunk and reads the next one into the same buffer. Memory use
+//is bounded by two chunks, independent of the size of the input.
+
+typedef struct OptionChunk_ {
+    int base;              //index of the first option in the chunk
+    int count;             //number of options in the chunk
+    fptype * buffer;
+    int * buffer2;
+    fptype * sptprice;
+    fptype * strike;
+    fptype * rate;
+    fptype * volatility;
+    fptype * otime;
+    fptype * refval;
+    fptype * prices;
+    fptype * greeks;       //five columns of chunk size values, or NULL
+    int * otype;
+} OptionChunk;
+
+typedef struct StreamJob_ {
+    OptionChunk * write;   //chunk to write out first, may be NULL
+    OptionChunk * read;    //chunk to fill afterwards
+} StreamJob;
+
+//Input and output of the streaming mode
+FILE * streamIn = NULL;    //text input
+int streamFd = -1;         //binary input
+BinOptionHeader streamHdr;
+int streamTotal;           //number of options in the input
+int streamNext = 0;        //index of the next option to read
+int streamChunkSize;
+FILE * streamOut = NULL;
+char * streamOutName;
+
+//Open the input file of the streaming mode and read the number of options
+void OpenOptionStream(char *inputFile)
+{
+    char magic[sizeof(BSBIN_MAGIC) - 1];
+    int rv;
+
+    streamIn = fopen(inputFile, "rb");
+    if(streamIn == NULL) {
+      printf("ERROR: Unable to open file `%s'.\n", inputFile);
+      exit(1);
+    }
+    if(fread(magic, sizeof(magic), 1, streamIn) == 1 &&
+       memcmp(magic, BSBIN_MAGIC, sizeof(magic)) == 0) {
+      fclose(streamIn);
+      streamIn = NULL;
+      streamFd = open(inputFile, O_RDONLY);
+      if(streamFd < 0) {
+        printf("ERROR: Unable to open file `%s'.\n", inputFile);
+        exit(1);
+      }
+      ReadBinaryHeader(streamFd, inputFile, &streamHdr);
+      streamTotal = (int)streamHdr.numOptions;
+    } else {
+      rewind(streamIn);
+      rv = fscanf(streamIn, "%i", &streamTotal);
+      if(rv != 1 || streamTotal < 1) {
+        printf("ERROR: Unable to read from file `%s'.\n", inputFile);
+        fclose(streamIn);
+        exit(1);
+      }
+    }
+}
+
+void AllocChunk(OptionChunk *c, int size)
+{
+    c->buffer = (fptype *) malloc(7 * size * sizeof(fptype) + PAD);
+    c->sptprice = (fptype *) (((unsigned long long)c->buffer + PAD) & ~(LINESIZE - 1));
+    c->strike = c->sptprice + size;
+    c->rate = c->strike + size;
+    c->volatility = c->rate + size;
+    c->otime = c->volatility + size;
+    c->refval = c->otime + size;
+    c->prices = c->refval + size;
+    c->greeks = NULL;
+#ifdef ENABLE_GREEKS
+    c->greeks = (fptype *) malloc(5 * size * sizeof(fptype));
 #endif
 
-    //Write prices to output file
-    file = fopen(outputFile, "w");
-    if(file == NULL) {
+    c->buffer2 = (int *) malloc(size * sizeof(int) + PAD);
+    c->otype = (int *) (((unsigned long long)c->buffer2 + PAD) & ~(LINESIZE - 1));
+    c->base = 0;
+    c->count = 0;
+}
+
+//Read up to streamChunkSize options into chunk c
+void ReadChunk(OptionChunk *c)
+{
+    int i;
+    int rv;
+
+    c->base = streamNext;
+    c->count = streamTotal - streamNext;
+    if(c->count > streamChunkSize) c->count = streamChunkSize;
+
+    if(streamFd >= 0) {
+      fptype *col[BSBIN_NCOLUMNS];
+      size_t len;
+      off_t off;
+      ssize_t n;
+      int k;
+
+      col[BSBIN_SPTPRICE] = c->sptprice;
+      col[BSBIN_STRIKE] = c->strike;
+      col[BSBIN_RATE] = c->rate;
+      col[BSBIN_VOLATILITY] = c->volatility;
+      col[BSBIN_OTIME] = c->otime;
+      col[BSBIN_OTYPE] = (fptype *)c->otype;
+      col[BSBIN_REFVAL] = c->refval;
+      for(k=0; k<BSBIN_NCOLUMNS; k++) {
+        size_t size = (k == BSBIN_OTYPE) ? sizeof(int) : sizeof(fptype);
+        char *dst = (char *)col[k];
+        len = c->count * size;
+        off = streamHdr.offset[k] + (off_t)c->base * size;
+        while(len > 0) {
+          n = pread(streamFd, dst, len, off);
+          if(n <= 0) {
+            printf("ERROR: Unable to read from input file.\n");
+            exit(1);
+          }
+          dst += n;
+          off += n;
+          len -= n;
+        }
+      }
+    } else {
+      fptype divq, divs;
+      char type;
+
+      for(i=0; i<c->count; i++) {
+        rv = fscanf(streamIn, "%f %f %f %f %f %f %c %f %f", &c->sptprice[i], &c->strike[i], &c->rate[i], &divq, &c->volatility[i], &c->otime[i], &type, &divs, &c->refval[i]);
+        if(rv != 9) {
+          printf("ERROR: Unable to read from input file.\n");
+          exit(1);
+        }
+        c->otype[i] = (type == 'P') ? 1 : 0;
+      }
+    }
+    streamNext += c->count;
+}
+
+void *StreamIO(void *arg)
+{
+    StreamJob *job = (StreamJob *)arg;
+
+    if(job->write != NULL) {
+      WritePrices(streamOut, streamOutName, job->write->prices, job->write->greeks,
+                  streamChunkSize, job->write->count);
+    }
+    ReadChunk(job->read);
+    return NULL;
+}
+
+//Read, price and write the whole input one chunk at a time
+void StreamOptions(char *outputFile, int chunkSize)
+{
+    OptionChunk chunk[2];
+    StreamJob job;
+    pthread_t io;
+    int k;
+    int rv;
+
+    streamChunkSize = chunkSize;
+    streamOutName = outputFile;
+    streamOut = fopen(outputFile, "w");
+    if(streamOut == NULL) {
       printf("ERROR: Unable to open file `%s'.\n", outputFile);
       exit(1);
     }
-    rv = fprintf(file, "%i\n", numOptions);
+    rv = fprintf(streamOut, "%i\n", streamTotal);
     if(rv < 0) {
       printf("ERROR: Unable to write to file `%s'.\n", outputFile);
-      fclose(file);
+      fclose(streamOut);
       exit(1);
     }
-    for(i=0; i<numOptions; i++) {
-      rv = fprintf(file, "%.18f\n", prices[i]);
-      if(rv < 0) {
-        printf("ERROR: Unable to write to file `%s'.\n", outputFile);
-        fclose(file);
+
+    AllocChunk(&chunk[0], chunkSize);
+    AllocChunk(&chunk[1], chunkSize);
+    ReadChunk(&chunk[0]);
+
+    for(k=0; chunk[k%2].count > 0; k++) {
+      OptionChunk *cur = &chunk[k%2];
+
+      //write out chunk k-1 and read chunk k+1 while chunk k is priced
+      job.write = (k > 0) ? &chunk[(k+1)%2] : NULL;
+      job.read = &chunk[(k+1)%2];
+      if(pthread_create(&io, NULL, StreamIO, &job) != 0) {
+        printf("ERROR: Unable to create I/O thread.\n");
         exit(1);
       }
+
+      sptprice   = cur->sptprice;
+      strike     = cur->strike;
+      rate       = cur->rate;
+      volatility = cur->volatility;
+      otime      = cur->otime;
+      otype      = cur->otype;
+      refval     = cur->refval;
+      prices     = cur->prices;
+      numOptions = cur->count;
+      optionBase = cur->base;
+#ifdef ENABLE_GREEKS
+      SetGreeks(cur->greeks, chunkSize);
+#endif
+      PriceOptions();
+#if defined(ENABLE_GREEKS) && defined(ERR_CHK)
+      CheckImpliedVol();
+#endif
+
+      pthread_join(io, NULL);
     }
-    rv = fclose(file);
+    if(k > 0) {
+      WritePrices(streamOut, outputFile, chunk[(k+1)%2].prices, chunk[(k+1)%2].greeks,
+                  chunkSize, chunk[(k+1)%2].count);
+    }
+
+    rv = fclose(streamOut);
     if(rv != 0) {
       printf("ERROR: Unable to close file `%s'.\n", outputFile);
       exit(1);
     }
+    if(streamIn != NULL) fclose(streamIn);
+    if(streamFd >= 0) close(streamFd);
+    free(chunk[0].buffer);
+    free(chunk[0].buffer2);
+    free(chunk[0].greeks);
+    free(chunk[1].buffer);
+    free(chunk[1].buffer2);
+    free(chunk[1].greeks);
+    numOptions = streamTotal;
+}
+#endif //WIN32
+
+int main (int argc, char **argv)
+{
+    FILE *file;
+    int rv;
+    int binary;
+
+#ifdef PARSEC_VERSION
+#define __PARSEC_STRING(x) #x
+#define __PARSEC_XSTRING(x) __PARSEC_STRING(x)
+        printf("PARSEC Benchmark Suite Version " __PARSEC_XSTRING(PARSEC_VERSION)"\n");
+	fflush(NULL);
+#else
+        printf("PARSEC Benchmark Suite\n");
+	fflush(NULL);
+#endif //PARSEC_VERSION
+#ifdef ENABLE_PARSEC_HOOKS
+   __parsec_bench_begin(__parsec_blackscholes);
+#endif
+
+   if (argc != 4 && argc != 5)
+        {
+                printf("Usage:\n\t%s <nthreads> <inputFile> <outputFile> [chunkSize]\n", argv[0]);
+                printf("If chunkSize is given, the input is read, priced and written in chunks\n"
+                       "of chunkSize options and every option is priced once.\n");
+                exit(1);
+        }
+    nThreads = atoi(argv[1]);
+    char *inputFile = argv[2];
+    char *outputFile = argv[3];
+    int chunkSize = 0;
+    if(argc == 5) {
+      chunkSize = atoi(argv[4]);
+      if(chunkSize < 1) {
+        printf("ERROR: Chunk size must at least be 1.\n");
+        exit(1);
+      }
+#ifdef WIN32
+      printf("ERROR: Streaming mode is not supported on this platform.\n");
+      exit(1);
+#endif
+    }
+
+    binary = 0;
+    if(chunkSize > 0) {
+#ifndef WIN32
+      //the input is read by StreamOptions
+      OpenOptionStream(inputFile);
+      numOptions = streamTotal;
+      numRuns = 1;
+#endif
+    } else {
+      //Read input data from file
+      file = fopen(inputFile, "rb");
+      if(file == NULL) {
+        printf("ERROR: Unable to open file `%s'.\n", inputFile);
+        exit(1);
+      }
+      char magic[sizeof(BSBIN_MAGIC) - 1];
+      binary = fread(magic, sizeof(magic), 1, file) == 1 &&
+               memcmp(magic, BSBIN_MAGIC, sizeof(magic)) == 0;
+      if(binary) {
+        fclose(file);
+#ifdef WIN32
+        printf("ERROR: Binary input files are not supported on this platform.\n");
+        exit(1);
+#else
+        MapBinaryInput(inputFile);
+#endif
+      } else {
+        rewind(file);
+        ReadTextInput(file, inputFile);
+      }
+      prices = (fptype*)malloc(numOptions*sizeof(fptype));
+#ifdef ENABLE_GREEKS
+      SetGreeks((fptype*)malloc(5*numOptions*sizeof(fptype)), numOptions);
+#endif
+    }
+    if(nThreads > numOptions) {
+      printf("WARNING: Not enough work, reducing number of threads to match number of options.\n");
+      nThreads = numOptions;
+    }
+
+#if !defined(ENABLE_THREADS) && !defined(ENABLE_OPENMP) && !defined(ENABLE_TBB)
+    if(nThreads != 1) {
+        printf("Error: <nthreads> must be 1 (serial version)\n");
+        exit(1);
+    }
+#endif
+
+#ifdef ENABLE_THREADS
+    MAIN_INITENV(,8000000,nThreads);
+#endif
+#ifdef ENABLE_WORK_STEALING
+    InitTopology();
+#endif
+    if(chunkSize == 0) {
+#ifdef ENABLE_WORK_STEALING
+      FirstTouch();
+#else
+      if(data != NULL) TransposeOptions(0, numOptions);
+#endif
+      free(data);
+      data = NULL;
+    }
+    printf("Num of Options: %d\n", numOptions);
+    printf("Num of Runs: %d\n", numRuns);
+
+    if(chunkSize > 0) {
+      printf("Chunk size: %d\n", chunkSize);
+      printf("Size of data: %lu\n", 2 * chunkSize * (8 * sizeof(fptype)));
+    } else {
+      printf("Size of data: %lu\n", numOptions * (sizeof(OptionData) + sizeof(int)));
+    }
+
+#ifdef ENABLE_PARSEC_HOOKS
+    __parsec_roi_begin();
+#endif
+
+#ifndef WIN32
+    if(chunkSize > 0) {
+      StreamOptions(outputFile, chunkSize);
+    } else
+#endif
+    {
+      PriceOptions();
+    }
+
+#ifdef ENABLE_PARSEC_HOOKS
+    __parsec_roi_end();
+#endif
+
+#if defined(ENABLE_GREEKS) && defined(ERR_CHK)
+    if(chunkSize == 0) {
+      CheckImpliedVol();
+    }
+#endif
+
+    if(chunkSize == 0) {
+      //Write prices to output file
+      file = fopen(outputFile, "w");
+      if(file == NULL) {
+        printf("ERROR: Unable to open file `%s'.\n", outputFile);
+        exit(1);
+      }
+      rv = fprintf(file, "%i\n", numOptions);
+      if(rv < 0) {
+        printf("ERROR: Unable to write to file `%s'.\n", outputFile);
+        fclose(file);
+        exit(1);
+      }
+#ifdef ENABLE_GREEKS
+      WritePrices(file, outputFile, prices, greeks, greekStride, numOptions);
+#else
+      WritePrices(file, outputFile, prices, NULL, 0, numOptions);
+#endif
+      rv = fclose(file);
+      if(rv != 0) {
+        printf("ERROR: Unable to close file `%s'.\n", outputFile);
+        exit(1);
+      }
+
+      free(prices);
+#ifdef ENABLE_GREEKS
+      free(greeks);
+#endif
+#ifndef WIN32
+      if(binary) {
+        munmap(mapBase, mapSize);
+      } else
+#endif
+      {
+        free(buffer);
+        free(buffer2);
+      }
+    }
 
 #ifdef ERR_CHK
     printf("Num Errors: %d\n", numError);
+#ifdef ENABLE_GREEKS
+    printf("Num IV Errors: %d\n", numIVError);
+#endif
 #endif
-    free(data);
-    free(prices);
 
 #ifdef ENABLE_PARSEC_HOOKS
     __parsec_bench_end();
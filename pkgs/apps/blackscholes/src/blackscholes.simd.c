@@ -18,6 +18,14 @@
 #include <xmmintrin.h>
 #endif
 
+// The AVX2 and AVX-512 kernels are compiled with per-function target
+// attributes and selected at runtime, so the rest of the program keeps
+// building for the baseline SSE3 target.
+#if defined(__GNUC__) && !defined(__ICC) && (defined(__x86_64__) || defined(__i386__))
+#define ENABLE_WIDE_SIMD
+#include <immintrin.h>
+#endif
+
 #ifdef ENABLE_PARSEC_HOOKS
 #include <hooks.h>
 #endif
@@ -70,6 +78,7 @@ using namespace tbb;
 #define SIMD_WIDTH 2
 #define _MMR      __m128d
 #define _MM_LOAD  _mm_load_pd
+#define _MM_LOADU _mm_loadu_pd
 #define _MM_STORE _mm_store_pd
 #define _MM_MUL   _mm_mul_pd
 #define _MM_ADD   _mm_add_pd
@@ -78,6 +87,7 @@ using namespace tbb;
 #define _MM_SQRT  _mm_sqrt_pd
 #define _MM_SET(A)  _mm_set_pd(A,A)
 #define _MM_SETR  _mm_set_pd
+#define FPFMT     "%lf"
 #endif
 
 #if (NCO==4)
@@ -85,6 +95,7 @@ using namespace tbb;
 #define SIMD_WIDTH 4
 #define _MMR      __m128
 #define _MM_LOAD  _mm_load_ps
+#define _MM_LOADU _mm_loadu_ps
 #define _MM_STORE _mm_store_ps
 #define _MM_MUL   _mm_mul_ps
 #define _MM_ADD   _mm_add_ps
@@ -93,6 +104,7 @@ using namespace tbb;
 #define _MM_SQRT  _mm_sqrt_ps
 #define _MM_SET(A)  _mm_set_ps(A,A,A,A)
 #define _MM_SETR  _mm_set_ps
+#define FPFMT     "%f"
 #endif
 
 #define NUM_RUNS 100
@@ -244,11 +256,11 @@ void BlkSchlsEqEuroNoDiv (fptype * OptionPrice, int numOptions, fptype * sptpric
     _MM_ALIGN16 fptype NegNofXd1[SIMD_WIDTH];
     _MM_ALIGN16 fptype NegNofXd2[SIMD_WIDTH];    
 
-    xStockPrice = _MM_LOAD(sptprice);
-    xStrikePrice = _MM_LOAD(strike);
-    xRiskFreeRate = _MM_LOAD(rate);
-    xVolatility = _MM_LOAD(volatility);
-    xTime = _MM_LOAD(time);
+    xStockPrice = _MM_LOADU(sptprice);
+    xStrikePrice = _MM_LOADU(strike);
+    xRiskFreeRate = _MM_LOADU(rate);
+    xVolatility = _MM_LOADU(volatility);
+    xTime = _MM_LOADU(time);
 
     xSqrtTime = _MM_SQRT(xTime);
 
@@ -297,38 +309,341 @@ void BlkSchlsEqEuroNoDiv (fptype * OptionPrice, int numOptions, fptype * sptpric
 
 }
 
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////
+// Price numOptions consecutive options with the SSE kernel, NCO at a time.
+// A trailing partial packet is padded with copies of its first option.
+void BlkSchlsEqEuroNoDivSSE (fptype * OptionPrice, int numOptions, fptype * sptprice,
+                             fptype * strike, fptype * rate, fptype * volatility,
+                             fptype * time, int * otype)
+{
+    int i, k, n;
+    _MM_ALIGN16 fptype price[NCO];
+    fptype s[NCO], x[NCO], r[NCO], v[NCO], t[NCO];
+    int type[NCO];
+
+    for (i=0; i<numOptions; i += NCO) {
+        n = numOptions - i;
+        if (n >= NCO) {
+            BlkSchlsEqEuroNoDiv(price, NCO, &(sptprice[i]), &(strike[i]),
+                                &(rate[i]), &(volatility[i]), &(time[i]), &(otype[i]), 0);
+            n = NCO;
+        } else {
+            for (k=0; k<NCO; k++) {
+                s[k]    = sptprice[i + (k < n ? k : 0)];
+                x[k]    = strike[i + (k < n ? k : 0)];
+                r[k]    = rate[i + (k < n ? k : 0)];
+                v[k]    = volatility[i + (k < n ? k : 0)];
+                t[k]    = time[i + (k < n ? k : 0)];
+                type[k] = otype[i + (k < n ? k : 0)];
+            }
+            BlkSchlsEqEuroNoDiv(price, NCO, s, x, r, v, t, type, 0);
+        }
+        for (k=0; k<n; k++) {
+            OptionPrice[i+k] = price[k];
+        }
+    }
+}
+
+#ifdef ENABLE_WIDE_SIMD
+//////////////////////////////////////////////////////////////////////////////////////
+// AVX2 kernel: 8 floats / 4 doubles per vector
+//////////////////////////////////////////////////////////////////////////////////////
+#define W_NAME(f)           f##_avx2
+#define W_TARGET            __attribute__((target("avx2,fma")))
+#define W_TMASK             __m256i
+
+#if (NCO==4)
+#define W_WIDTH             8
+#define W_REG               __m256
+#define W_MASK              __m256
+#define W_SET(A)            _mm256_set1_ps(A)
+#define W_ADD               _mm256_add_ps
+#define W_SUB               _mm256_sub_ps
+#define W_MUL               _mm256_mul_ps
+#define W_DIV               _mm256_div_ps
+#define W_SQRT              _mm256_sqrt_ps
+#define W_MIN               _mm256_min_ps
+#define W_MAX               _mm256_max_ps
+#define W_FMADD             _mm256_fmadd_ps
+#define W_FNMADD            _mm256_fnmadd_ps
+#define W_ROUND(A)          _mm256_round_ps(A, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define W_ABS(A)            _mm256_andnot_ps(_mm256_set1_ps(-0.0f), A)
+#define W_CMPLT(A,B)        _mm256_cmp_ps(A, B, _CMP_LT_OQ)
+#define W_CMPGT(A,B)        _mm256_cmp_ps(A, B, _CMP_GT_OQ)
+#define W_BLEND(M,A,B)      _mm256_blendv_ps(A, B, M)
+#define W_LOADU             _mm256_loadu_ps
+#define W_STOREU            _mm256_storeu_ps
+#define W_TAILMASK(N)       _mm256_cmpgt_epi32(_mm256_set1_epi32(N), _mm256_setr_epi32(0,1,2,3,4,5,6,7))
+#define W_MASKLOAD(P,T)     _mm256_maskload_ps(P, T)
+#define W_MASKSTORE(P,T,V)  _mm256_maskstore_ps(P, T, V)
+#define W_PUTMASK(P)        _mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(P))), \
+                                          _mm256_setzero_ps(), _CMP_NEQ_UQ)
+#define W_PUTMASK_TAIL(P,T) _mm256_cmp_ps(_mm256_cvtepi32_ps(_mm256_maskload_epi32(P, T)), \
+                                          _mm256_setzero_ps(), _CMP_NEQ_UQ)
+
+// x * 2^n for integral n
+W_TARGET static inline __m256 ldexp_avx2(__m256 x, __m256 n)
+{
+    __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+    return _mm256_mul_ps(x, _mm256_castsi256_ps(_mm256_slli_epi32(e, 23)));
+}
+
+// x = m * 2^e with m in [1,2), x positive and normal
+W_TARGET static inline void frexp_avx2(__m256 x, __m256 *m, __m256 *e)
+{
+    __m256i bits = _mm256_castps_si256(x);
+    *e = _mm256_cvtepi32_ps(_mm256_srli_epi32(bits, 23));
+    *e = _mm256_sub_ps(*e, _mm256_set1_ps(127.0f));
+    bits = _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff));
+    *m = _mm256_castsi256_ps(_mm256_or_si256(bits, _mm256_set1_epi32(0x3f800000)));
+}
+#endif //NCO==4
+
+#if (NCO==2)
+#define W_WIDTH             4
+#define W_REG               __m256d
+#define W_MASK              __m256d
+#define W_SET(A)            _mm256_set1_pd(A)
+#define W_ADD               _mm256_add_pd
+#define W_SUB               _mm256_sub_pd
+#define W_MUL               _mm256_mul_pd
+#define W_DIV               _mm256_div_pd
+#define W_SQRT              _mm256_sqrt_pd
+#define W_MIN               _mm256_min_pd
+#define W_MAX               _mm256_max_pd
+#define W_FMADD             _mm256_fmadd_pd
+#define W_FNMADD            _mm256_fnmadd_pd
+#define W_ROUND(A)          _mm256_round_pd(A, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define W_ABS(A)            _mm256_andnot_pd(_mm256_set1_pd(-0.0), A)
+#define W_CMPLT(A,B)        _mm256_cmp_pd(A, B, _CMP_LT_OQ)
+#define W_CMPGT(A,B)        _mm256_cmp_pd(A, B, _CMP_GT_OQ)
+#define W_BLEND(M,A,B)      _mm256_blendv_pd(A, B, M)
+#define W_LOADU             _mm256_loadu_pd
+#define W_STOREU            _mm256_storeu_pd
+#define W_TAILMASK(N)       _mm256_cmpgt_epi64(_mm256_set1_epi64x(N), _mm256_setr_epi64x(0,1,2,3))
+#define W_MASKLOAD(P,T)     _mm256_maskload_pd(P, T)
+#define W_MASKSTORE(P,T,V)  _mm256_maskstore_pd(P, T, V)
+#define W_PUTMASK(P)        _mm256_cmp_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(P))), \
+                                          _mm256_setzero_pd(), _CMP_NEQ_UQ)
+// The 64-bit tail mask is narrowed to 32-bit lanes for the option type load
+#define W_PUTMASK_TAIL(P,T) _mm256_cmp_pd(_mm256_cvtepi32_pd(_mm_maskload_epi32(P, \
+                                          _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(T, \
+                                          _mm256_setr_epi32(0,2,4,6,0,0,0,0))))), \
+                                          _mm256_setzero_pd(), _CMP_NEQ_UQ)
+
+// x * 2^n for integral n
+W_TARGET static inline __m256d ldexp_avx2(__m256d x, __m256d n)
+{
+    __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+    e = _mm256_add_epi64(e, _mm256_set1_epi64x(1023));
+    return _mm256_mul_pd(x, _mm256_castsi256_pd(_mm256_slli_epi64(e, 52)));
+}
+
+// x = m * 2^e with m in [1,2), x positive and normal
+W_TARGET static inline void frexp_avx2(__m256d x, __m256d *m, __m256d *e)
+{
+    __m256i bits = _mm256_castpd_si256(x);
+    // exponent bits to double via the 2^52 magic number
+    __m256i ebits = _mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(0x4330000000000000LL));
+    *e = _mm256_sub_pd(_mm256_castsi256_pd(ebits), _mm256_set1_pd(4503599627370496.0 + 1023.0));
+    bits = _mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL));
+    *m = _mm256_castsi256_pd(_mm256_or_si256(bits, _mm256_set1_epi64x(0x3ff0000000000000LL)));
+}
+#endif //NCO==2
+
+#define W_LDEXP             ldexp_avx2
+#define W_FREXP(X,M,E)      frexp_avx2(X, &(M), &(E))
+
+#include "blackscholes.simd.kernel.h"
+
+#undef W_NAME
+#undef W_TARGET
+#undef W_TMASK
+#undef W_WIDTH
+#undef W_REG
+#undef W_MASK
+#undef W_SET
+#undef W_ADD
+#undef W_SUB
+#undef W_MUL
+#undef W_DIV
+#undef W_SQRT
+#undef W_MIN
+#undef W_MAX
+#undef W_FMADD
+#undef W_FNMADD
+#undef W_ROUND
+#undef W_ABS
+#undef W_CMPLT
+#undef W_CMPGT
+#undef W_BLEND
+#undef W_LOADU
+#undef W_STOREU
+#undef W_TAILMASK
+#undef W_MASKLOAD
+#undef W_MASKSTORE
+#undef W_PUTMASK
+#undef W_PUTMASK_TAIL
+#undef W_LDEXP
+#undef W_FREXP
+
+//////////////////////////////////////////////////////////////////////////////////////
+// AVX-512 kernel: 16 floats / 8 doubles per vector
+//////////////////////////////////////////////////////////////////////////////////////
+#define W_NAME(f)           f##_avx512
+#define W_TARGET            __attribute__((target("avx512f")))
+#define W_ROUND_MODE        (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+
+#if (NCO==4)
+#define W_WIDTH             16
+#define W_REG               __m512
+#define W_MASK              __mmask16
+#define W_TMASK             __mmask16
+#define W_SET(A)            _mm512_set1_ps(A)
+#define W_ADD               _mm512_add_ps
+#define W_SUB               _mm512_sub_ps
+#define W_MUL               _mm512_mul_ps
+#define W_DIV               _mm512_div_ps
+#define W_SQRT              _mm512_sqrt_ps
+#define W_MIN               _mm512_min_ps
+#define W_MAX               _mm512_max_ps
+#define W_FMADD             _mm512_fmadd_ps
+#define W_FNMADD            _mm512_fnmadd_ps
+#define W_ROUND(A)          _mm512_roundscale_ps(A, W_ROUND_MODE)
+#define W_ABS(A)            _mm512_abs_ps(A)
+#define W_CMPLT(A,B)        _mm512_cmp_ps_mask(A, B, _CMP_LT_OQ)
+#define W_CMPGT(A,B)        _mm512_cmp_ps_mask(A, B, _CMP_GT_OQ)
+#define W_BLEND(M,A,B)      _mm512_mask_blend_ps(M, A, B)
+#define W_LOADU             _mm512_loadu_ps
+#define W_STOREU            _mm512_storeu_ps
+#define W_TAILMASK(N)       ((__mmask16)((1u << (N)) - 1))
+#define W_MASKLOAD(P,T)     _mm512_maskz_loadu_ps(T, P)
+#define W_MASKSTORE(P,T,V)  _mm512_mask_storeu_ps(P, T, V)
+#define W_PUTMASK(P)        _mm512_cmpneq_epi32_mask(_mm512_loadu_si512(P), _mm512_setzero_si512())
+#define W_PUTMASK_TAIL(P,T) _mm512_mask_cmpneq_epi32_mask(T, _mm512_maskz_loadu_epi32(T, P), \
+                                                          _mm512_setzero_si512())
+#define W_LDEXP             _mm512_scalef_ps
+#define W_FREXP(X,M,E)      ((M) = _mm512_getmant_ps(X, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero), \
+                             (E) = _mm512_getexp_ps(X))
+#endif //NCO==4
+
+#if (NCO==2)
+#define W_WIDTH             8
+#define W_REG               __m512d
+#define W_MASK              __mmask8
+#define W_TMASK             __mmask8
+#define W_SET(A)            _mm512_set1_pd(A)
+#define W_ADD               _mm512_add_pd
+#define W_SUB               _mm512_sub_pd
+#define W_MUL               _mm512_mul_pd
+#define W_DIV               _mm512_div_pd
+#define W_SQRT              _mm512_sqrt_pd
+#define W_MIN               _mm512_min_pd
+#define W_MAX               _mm512_max_pd
+#define W_FMADD             _mm512_fmadd_pd
+#define W_FNMADD            _mm512_fnmadd_pd
+#define W_ROUND(A)          _mm512_roundscale_pd(A, W_ROUND_MODE)
+#define W_ABS(A)            _mm512_abs_pd(A)
+#define W_CMPLT(A,B)        _mm512_cmp_pd_mask(A, B, _CMP_LT_OQ)
+#define W_CMPGT(A,B)        _mm512_cmp_pd_mask(A, B, _CMP_GT_OQ)
+#define W_BLEND(M,A,B)      _mm512_mask_blend_pd(M, A, B)
+#define W_LOADU             _mm512_loadu_pd
+#define W_STOREU            _mm512_storeu_pd
+#define W_TAILMASK(N)       ((__mmask8)((1u << (N)) - 1))
+#define W_MASKLOAD(P,T)     _mm512_maskz_loadu_pd(T, P)
+#define W_MASKSTORE(P,T,V)  _mm512_mask_storeu_pd(P, T, V)
+// Eight 32-bit option types are read through the low half of a 512-bit register
+#define W_PUTMASK(P)        ((__mmask8)_mm512_mask_cmpneq_epi32_mask(0xff, _mm512_maskz_loadu_epi32(0xff, P), \
+                                                                     _mm512_setzero_si512()))
+#define W_PUTMASK_TAIL(P,T) ((__mmask8)_mm512_mask_cmpneq_epi32_mask(T, _mm512_maskz_loadu_epi32(T, P), \
+                                                                     _mm512_setzero_si512()))
+#define W_LDEXP             _mm512_scalef_pd
+#define W_FREXP(X,M,E)      ((M) = _mm512_getmant_pd(X, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_zero), \
+                             (E) = _mm512_getexp_pd(X))
+#endif //NCO==2
+
+//the AVX-512 intrinsics of GCC 12 trip -Wmaybe-uninitialized on their own
+//placeholder operands
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include "blackscholes.simd.kernel.h"
+#pragma GCC diagnostic pop
+#endif //ENABLE_WIDE_SIMD
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Runtime kernel selection
+//////////////////////////////////////////////////////////////////////////////////////
+typedef void (*bs_kernel_t)(fptype *, int, fptype *, fptype *, fptype *, fptype *, fptype *, int *);
+
+bs_kernel_t BlkSchlsKernel = BlkSchlsEqEuroNoDivSSE;
+const char *BlkSchlsKernelName = "sse";
+int BlkSchlsKernelWidth = NCO;
+
+// Pick the widest kernel supported by the CPU and the OS. The environment
+// variable BS_SIMD (sse, avx2 or avx512) caps the selection, which is
+// useful to compare kernels with a single binary.
+void SelectBlkSchlsKernel()
+{
+#ifdef ENABLE_WIDE_SIMD
+    const char *cap = getenv("BS_SIMD");
+    int level = 2;
+
+    if (cap != NULL) {
+        if (strcmp(cap, "sse") == 0) level = 0;
+        else if (strcmp(cap, "avx2") == 0) level = 1;
+    }
+
+    __builtin_cpu_init();
+    if (level >= 2 && __builtin_cpu_supports("avx512f")) {
+        BlkSchlsKernel = BlkSchlsEqEuroNoDiv_avx512;
+        BlkSchlsKernelName = "avx512";
+        BlkSchlsKernelWidth = 64 / sizeof(fptype);
+    } else if (level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        BlkSchlsKernel = BlkSchlsEqEuroNoDiv_avx2;
+        BlkSchlsKernelName = "avx2";
+        BlkSchlsKernelWidth = 32 / sizeof(fptype);
+    }
+#endif //ENABLE_WIDE_SIMD
+}
+
+#ifdef ERR_CHK
+void CheckPrices(int begin, int end)
+{
+    int i;
+    fptype priceDelta;
+
+    for (i=begin; i<end; i++) {
+        priceDelta = data[i].DGrefval - prices[i];
+        if (fabs(priceDelta) >= 1e-4) {
+            printf("Error on %d. Computed=%.5f, Ref=%.5f, Delta=%.5f\n",
+                   i, prices[i], data[i].DGrefval, priceDelta);
+            numError ++;
+        }
+    }
+}
+#endif
+
 #ifdef ENABLE_TBB
 struct mainWork {
   mainWork(){}
   mainWork(mainWork &w, tbb::split){}
 
   void operator()(const tbb::blocked_range<int> &range) const {
-    fptype price[NCO];
-    fptype priceDelta;
     int begin = range.begin();
     int end = range.end();
 
-    for (int i=begin; i!=end; i+=NCO) {
-      /* Calling main function to calculate option value based on 
-       * Black & Scholes's equation.
-       */
-
-      BlkSchlsEqEuroNoDiv( price, NCO, &(sptprice[i]), &(strike[i]),
-                           &(rate[i]), &(volatility[i]), &(otime[i]), 
-                           &(otype[i]), 0);
-      for (int k=0; k<NCO; k++) {
-        prices[i+k] = price[k];
+    /* Calling main function to calculate option value based on 
+     * Black & Scholes's equation.
+     */
+    BlkSchlsKernel(&(prices[begin]), end - begin, &(sptprice[begin]), &(strike[begin]),
+                   &(rate[begin]), &(volatility[begin]), &(otime[begin]), &(otype[begin]));
 
 #ifdef ERR_CHK 
-        priceDelta = data[i+k].DGrefval - price[k];
-        if( fabs(priceDelta) >= 1e-5 ){
-          fprintf(stderr,"Error on %d. Computed=%.5f, Ref=%.5f, Delta=%.5f\n",
-                 i+k, price, data[i+k].DGrefval, priceDelta);
-          numError ++;
-        }
+    CheckPrices(begin, end);
 #endif
-      }
-    }
   }
 };
 
@@ -353,43 +668,42 @@ int bs_thread(void *tid_ptr) {
 }
 #else // !ENABLE_TBB
 
+// Number of options handed to the kernel per OpenMP iteration
+#define OMP_BLOCK 1024
+
 #ifdef WIN32
 DWORD WINAPI bs_thread(LPVOID tid_ptr){
 #else
 int bs_thread(void *tid_ptr) {
 #endif
-    int i, j, k;
-    fptype price[NCO];
-    fptype priceDelta;
+    int j;
+#ifdef ENABLE_OPENMP
+    int i, n;
+#endif
     int tid = *(int *)tid_ptr;
     int start = tid * (numOptions / nThreads);
     int end = start + (numOptions / nThreads);
 
     for (j=0; j<NUM_RUNS; j++) {
 #ifdef ENABLE_OPENMP
-#pragma omp parallel for private(i, price, priceDelta)
-        for (i=0; i<numOptions; i += NCO) {
+#pragma omp parallel for private(i, n)
+        for (i=0; i<numOptions; i += OMP_BLOCK) {
+            n = (numOptions - i < OMP_BLOCK) ? numOptions - i : OMP_BLOCK;
+            BlkSchlsKernel(&(prices[i]), n, &(sptprice[i]), &(strike[i]),
+                           &(rate[i]), &(volatility[i]), &(otime[i]), &(otype[i]));
+        }
+#ifdef ERR_CHK
+        CheckPrices(0, numOptions);
+#endif
 #else  //ENABLE_OPENMP
-        for (i=start; i<end; i += NCO) {
-#endif //ENABLE_OPENMP
-            // Calling main function to calculate option value based on Black & Scholes's
-            // equation.
-            BlkSchlsEqEuroNoDiv(price, NCO, &(sptprice[i]), &(strike[i]),
-                                &(rate[i]), &(volatility[i]), &(otime[i]), &(otype[i]), 0);
-            for (k=0; k<NCO; k++) {
-              prices[i+k] = price[k];
-            } 
+        // Calling main function to calculate option value based on Black & Scholes's
+        // equation.
+        BlkSchlsKernel(&(prices[start]), end - start, &(sptprice[start]), &(strike[start]),
+                       &(rate[start]), &(volatility[start]), &(otime[start]), &(otype[start]));
 #ifdef ERR_CHK
-            for (k=0; k<NCO; k++) {
-                priceDelta = data[i+k].DGrefval - price[k];
-                if (fabs(priceDelta) >= 1e-4) {
-                    printf("Error on %d. Computed=%.5f, Ref=%.5f, Delta=%.5f\n",
-                           i + k, price[k], data[i+k].DGrefval, priceDelta);
-                    numError ++;
-                }
-            }
+        CheckPrices(start, end);
 #endif
-        }
+#endif //ENABLE_OPENMP
     }
 
     return 0;
@@ -460,7 +774,7 @@ int main (int argc, char **argv)
     prices = (fptype*)malloc(numOptions*sizeof(fptype));
     for ( loopnum = 0; loopnum < numOptions; ++ loopnum )
     {
-        rv = fscanf(file, "%f %f %f %f %f %f %c %f %f", &data[loopnum].s, &data[loopnum].strike, &data[loopnum].r, &data[loopnum].divq, &data[loopnum].v, &data[loopnum].t, &data[loopnum].OptionType, &data[loopnum].divs, &data[loopnum].DGrefval);
+        rv = fscanf(file, FPFMT " " FPFMT " " FPFMT " " FPFMT " " FPFMT " " FPFMT " %c " FPFMT " " FPFMT, &data[loopnum].s, &data[loopnum].strike, &data[loopnum].r, &data[loopnum].divq, &data[loopnum].v, &data[loopnum].t, &data[loopnum].OptionType, &data[loopnum].divs, &data[loopnum].DGrefval);
         if(rv != 9) {
           printf("ERROR: Unable to read from file `%s'.\n", inputFile);
           fclose(file);
@@ -501,7 +815,10 @@ int main (int argc, char **argv)
         otime[i]      = data[i].t;
     }
 
-    printf("Size of data: %d\n", numOptions * (sizeof(OptionData) + sizeof(int)));
+    printf("Size of data: %lu\n", numOptions * (sizeof(OptionData) + sizeof(int)));
+
+    SelectBlkSchlsKernel();
+    printf("SIMD kernel: %s (%d options per vector)\n", BlkSchlsKernelName, BlkSchlsKernelWidth);
 
 #ifdef ENABLE_PARSEC_HOOKS
     __parsec_roi_begin();
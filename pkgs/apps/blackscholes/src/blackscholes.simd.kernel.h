@@ -0,0 +1,202 @@
+// Copyright (c) 2007 Intel Corp.
+
+// Black-Scholes
+// Width-generic SIMD kernel body
+//
+// This file is included by blackscholes.simd.c once per instruction set
+// (AVX2, AVX-512) after the W_* macros below have been defined for that
+// instruction set and the precision selected by NCO. It must not be
+// compiled on its own.
+//
+//   W_NAME(f)          name of function f for this instruction set
+//   W_TARGET           function attribute enabling the instruction set
+//   W_WIDTH            number of options per vector
+//   W_REG / W_MASK     vector register / comparison mask types
+//   W_TMASK            tail mask type used by masked loads and stores
+//   W_LDEXP, W_FREXP   exponent manipulation helpers for W_EXP / W_LOG
+
+#ifndef W_NAME
+#error blackscholes.simd.kernel.h must be included from blackscholes.simd.c
+#endif
+
+#if (NCO==4)
+// Range reduction limits so that 2^n stays a normal number
+#define W_EXP_LO  -87.3
+#define W_EXP_HI   88.3
+#else
+#define W_EXP_LO  -708.0
+#define W_EXP_HI   709.0
+#endif
+
+#define W_LOG2E   1.44269504088896340736
+#define W_LN2_HI  0.693145751953125
+#define W_LN2_LO  1.42860682030941723212e-6
+#define W_SQRT2   1.41421356237309504880
+
+// exp(x) = 2^n * exp(r), |r| <= ln(2)/2, exp(r) by its Taylor polynomial
+W_TARGET static inline W_REG W_NAME(W_EXP) (W_REG x)
+{
+    W_REG n, r, p;
+
+    x = W_MIN(W_MAX(x, W_SET(W_EXP_LO)), W_SET(W_EXP_HI));
+    n = W_ROUND(W_MUL(x, W_SET(W_LOG2E)));
+    r = W_FNMADD(n, W_SET(W_LN2_HI), x);
+    r = W_FNMADD(n, W_SET(W_LN2_LO), r);
+
+#if (NCO==4)
+    p = W_FMADD(W_SET(1.0/5040.0), r, W_SET(1.0/720.0));
+#else
+    p = W_FMADD(W_SET(1.0/6227020800.0), r, W_SET(1.0/479001600.0));
+    p = W_FMADD(p, r, W_SET(1.0/39916800.0));
+    p = W_FMADD(p, r, W_SET(1.0/3628800.0));
+    p = W_FMADD(p, r, W_SET(1.0/362880.0));
+    p = W_FMADD(p, r, W_SET(1.0/40320.0));
+    p = W_FMADD(p, r, W_SET(1.0/5040.0));
+    p = W_FMADD(p, r, W_SET(1.0/720.0));
+#endif
+    p = W_FMADD(p, r, W_SET(1.0/120.0));
+    p = W_FMADD(p, r, W_SET(1.0/24.0));
+    p = W_FMADD(p, r, W_SET(1.0/6.0));
+    p = W_FMADD(p, r, W_SET(0.5));
+    p = W_FMADD(p, r, W_SET(1.0));
+    p = W_FMADD(p, r, W_SET(1.0));
+
+    return W_LDEXP(p, n);
+}
+
+// log(x) = e*ln(2) + log(m), m in [sqrt(2)/2, sqrt(2)),
+// log(m) = 2*atanh(s) with s = (m-1)/(m+1), |s| < 0.1716
+W_TARGET static inline W_REG W_NAME(W_LOG) (W_REG x)
+{
+    W_REG m, e, s, z, p;
+    W_MASK big;
+
+    W_FREXP(x, m, e);
+    big = W_CMPGT(m, W_SET(W_SQRT2));
+    m = W_BLEND(big, m, W_MUL(m, W_SET(0.5)));
+    e = W_BLEND(big, e, W_ADD(e, W_SET(1.0)));
+
+    s = W_DIV(W_SUB(m, W_SET(1.0)), W_ADD(m, W_SET(1.0)));
+    z = W_MUL(s, s);
+
+#if (NCO==4)
+    p = W_FMADD(W_SET(1.0/11.0), z, W_SET(1.0/9.0));
+#else
+    p = W_FMADD(W_SET(1.0/21.0), z, W_SET(1.0/19.0));
+    p = W_FMADD(p, z, W_SET(1.0/17.0));
+    p = W_FMADD(p, z, W_SET(1.0/15.0));
+    p = W_FMADD(p, z, W_SET(1.0/13.0));
+    p = W_FMADD(p, z, W_SET(1.0/11.0));
+    p = W_FMADD(p, z, W_SET(1.0/9.0));
+#endif
+    p = W_FMADD(p, z, W_SET(1.0/7.0));
+    p = W_FMADD(p, z, W_SET(1.0/5.0));
+    p = W_FMADD(p, z, W_SET(1.0/3.0));
+    p = W_FMADD(p, z, W_SET(1.0));
+    p = W_MUL(W_ADD(s, s), p);
+
+    p = W_FMADD(e, W_SET(W_LN2_LO), p);
+    return W_FMADD(e, W_SET(W_LN2_HI), p);
+}
+
+// Cumulative Normal Distribution Function, see Hull, Section 11.8, P.243-244
+// Negative inputs are handled with a blend instead of a branch:
+// CNDF(-x) = 1 - CNDF(x)
+W_TARGET static inline W_REG W_NAME(W_CNDF) (W_REG InputX)
+{
+    W_MASK sign;
+    W_REG xInput;
+    W_REG xNPrimeofX;
+    W_REG xK2;
+    W_REG xLocal;
+
+    sign = W_CMPLT(InputX, W_SET(0.0));
+    xInput = W_ABS(InputX);
+
+    xNPrimeofX = W_MUL(W_MUL(xInput, xInput), W_SET(-0.5));
+    xNPrimeofX = W_NAME(W_EXP)(xNPrimeofX);
+    xNPrimeofX = W_MUL(xNPrimeofX, W_SET(inv_sqrt_2xPI));
+
+    xK2 = W_FMADD(W_SET(0.2316419), xInput, W_SET(1.0));
+    xK2 = W_DIV(W_SET(1.0), xK2);
+
+    xLocal = W_FMADD(W_SET(1.330274429), xK2, W_SET(-1.821255978));
+    xLocal = W_FMADD(xLocal, xK2, W_SET(1.781477937));
+    xLocal = W_FMADD(xLocal, xK2, W_SET(-0.356563782));
+    xLocal = W_FMADD(xLocal, xK2, W_SET(0.319381530));
+    xLocal = W_MUL(xLocal, xK2);
+    xLocal = W_FNMADD(xLocal, xNPrimeofX, W_SET(1.0));
+
+    return W_BLEND(sign, xLocal, W_SUB(W_SET(1.0), xLocal));
+}
+
+W_TARGET static inline W_REG W_NAME(W_BlkSchls) (W_REG xStockPrice, W_REG xStrikePrice,
+                                                 W_REG xRiskFreeRate, W_REG xVolatility,
+                                                 W_REG xTime, W_MASK isPut)
+{
+    W_REG xSqrtTime;
+    W_REG xLogTerm;
+    W_REG xPowerTerm;
+    W_REG xD1, xD2;
+    W_REG xDen;
+    W_REG NofXd1, NofXd2;
+    W_REG FutureValueX;
+    W_REG xCall, xPut;
+
+    xSqrtTime = W_SQRT(xTime);
+    xLogTerm = W_NAME(W_LOG)(W_DIV(xStockPrice, xStrikePrice));
+
+    xPowerTerm = W_MUL(W_MUL(xVolatility, xVolatility), W_SET(0.5));
+    xD1 = W_ADD(xRiskFreeRate, xPowerTerm);
+    xD1 = W_FMADD(xD1, xTime, xLogTerm);
+    xDen = W_MUL(xVolatility, xSqrtTime);
+    xD1 = W_DIV(xD1, xDen);
+    xD2 = W_SUB(xD1, xDen);
+
+    NofXd1 = W_NAME(W_CNDF)(xD1);
+    NofXd2 = W_NAME(W_CNDF)(xD2);
+
+    FutureValueX = W_MUL(xRiskFreeRate, xTime);
+    FutureValueX = W_SUB(W_SET(0.0), FutureValueX);
+    FutureValueX = W_MUL(xStrikePrice, W_NAME(W_EXP)(FutureValueX));
+
+    xCall = W_MUL(xStockPrice, NofXd1);
+    xCall = W_FNMADD(FutureValueX, NofXd2, xCall);
+    xPut = W_MUL(FutureValueX, W_SUB(W_SET(1.0), NofXd2));
+    xPut = W_FNMADD(xStockPrice, W_SUB(W_SET(1.0), NofXd1), xPut);
+
+    return W_BLEND(isPut, xCall, xPut);
+}
+
+// Price numOptions consecutive options, W_WIDTH at a time. The last partial
+// vector is handled with masked loads and stores so no padding is required.
+W_TARGET void W_NAME(BlkSchlsEqEuroNoDiv) (fptype * OptionPrice, int numOptions, fptype * sptprice,
+                                           fptype * strike, fptype * rate, fptype * volatility,
+                                           fptype * time, int * otype)
+{
+    int i;
+    W_REG xPrice;
+    W_TMASK tail;
+
+    for (i=0; i+W_WIDTH<=numOptions; i+=W_WIDTH) {
+        xPrice = W_NAME(W_BlkSchls)(W_LOADU(&sptprice[i]), W_LOADU(&strike[i]),
+                                    W_LOADU(&rate[i]), W_LOADU(&volatility[i]),
+                                    W_LOADU(&time[i]), W_PUTMASK(&otype[i]));
+        W_STOREU(&OptionPrice[i], xPrice);
+    }
+
+    if (i < numOptions) {
+        tail = W_TAILMASK(numOptions - i);
+        xPrice = W_NAME(W_BlkSchls)(W_MASKLOAD(&sptprice[i], tail), W_MASKLOAD(&strike[i], tail),
+                                    W_MASKLOAD(&rate[i], tail), W_MASKLOAD(&volatility[i], tail),
+                                    W_MASKLOAD(&time[i], tail), W_PUTMASK_TAIL(&otype[i], tail));
+        W_MASKSTORE(&OptionPrice[i], tail, xPrice);
+    }
+}
+
+#undef W_EXP_LO
+#undef W_EXP_HI
+#undef W_LOG2E
+#undef W_LN2_HI
+#undef W_LN2_LO
+#undef W_SQRT2
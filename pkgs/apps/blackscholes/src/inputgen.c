@@ -4,6 +4,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "blackscholes.bin.h"
 
 
 
@@ -30,6 +33,133 @@ OptionData data_init[] = {
     #include "optionData.txt"
 };
 
+//Precision of the values in binary files, must match the benchmark
+#define binfptype float
+
+//Column-major option data used to write binary files
+typedef struct OptionColumns_ {
+  int numOptions;
+  binfptype *col[BSBIN_NCOLUMNS];
+  int *otype;
+} OptionColumns;
+
+static void AllocColumns(OptionColumns *cols, int numOptions) {
+  int c;
+
+  cols->numOptions = numOptions;
+  for(c=0; c<BSBIN_NCOLUMNS; c++) {
+    cols->col[c] = NULL;
+    if(c == BSBIN_OTYPE) continue;
+    cols->col[c] = (binfptype *)malloc(numOptions * sizeof(binfptype));
+    if(cols->col[c] == NULL) {
+      printf("ERROR: Out of memory.\n");
+      exit(1);
+    }
+  }
+  cols->otype = (int *)malloc(numOptions * sizeof(int));
+  if(cols->otype == NULL) {
+    printf("ERROR: Out of memory.\n");
+    exit(1);
+  }
+}
+
+static void SetOption(OptionColumns *cols, int i, double s, double strike, double r,
+                      double v, double t, char type, double refval) {
+  cols->col[BSBIN_SPTPRICE][i]   = s;
+  cols->col[BSBIN_STRIKE][i]     = strike;
+  cols->col[BSBIN_RATE][i]       = r;
+  cols->col[BSBIN_VOLATILITY][i] = v;
+  cols->col[BSBIN_OTIME][i]      = t;
+  cols->col[BSBIN_REFVAL][i]     = refval;
+  cols->otype[i]                 = (type == 'P') ? 1 : 0;
+}
+
+//Read a text input file as written by this program
+static void ReadText(OptionColumns *cols, const char *fileName) {
+  FILE *file;
+  int numOptions;
+  int rv;
+  int i;
+  double s, strike, r, divq, v, t, divs, refval;
+  char type;
+
+  file = fopen(fileName, "r");
+  if(file == NULL) {
+    printf("ERROR: Unable to open file `%s'.\n", fileName);
+    exit(1);
+  }
+  rv = fscanf(file, "%i", &numOptions);
+  if(rv != 1 || numOptions < 1) {
+    printf("ERROR: Unable to read from file `%s'.\n", fileName);
+    fclose(file);
+    exit(1);
+  }
+  AllocColumns(cols, numOptions);
+  for(i=0; i<numOptions; i++) {
+    rv = fscanf(file, "%lf %lf %lf %lf %lf %lf %c %lf %lf", &s, &strike, &r, &divq, &v, &t, &type, &divs, &refval);
+    if(rv != 9) {
+      printf("ERROR: Unable to read from file `%s'.\n", fileName);
+      fclose(file);
+      exit(1);
+    }
+    SetOption(cols, i, s, strike, r, v, t, type, refval);
+  }
+  fclose(file);
+}
+
+//Write options in the columnar binary format described in blackscholes.bin.h
+static void WriteBinary(const OptionColumns *cols, const char *fileName) {
+  FILE *file;
+  BinOptionHeader hdr;
+  long long pos;
+  size_t len;
+  int c;
+
+  file = fopen(fileName, "wb");
+  if(file == NULL) {
+    printf("ERROR: Unable to open file `%s'.\n", fileName);
+    exit(1);
+  }
+  BinOptionLayout(&hdr, cols->numOptions, sizeof(binfptype));
+  if(fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+    printf("ERROR: Unable to write to file `%s'.\n", fileName);
+    fclose(file);
+    exit(1);
+  }
+  pos = sizeof(hdr);
+  for(c=0; c<BSBIN_NCOLUMNS; c++) {
+    //zero padding up to the start of the column
+    for(; pos<hdr.offset[c]; pos++) {
+      fputc(0, file);
+    }
+    if(c == BSBIN_OTYPE) {
+      len = fwrite(cols->otype, sizeof(int), cols->numOptions, file);
+      pos += (long long)len * sizeof(int);
+    } else {
+      len = fwrite(cols->col[c], sizeof(binfptype), cols->numOptions, file);
+      pos += (long long)len * sizeof(binfptype);
+    }
+    if(len != (size_t)cols->numOptions) {
+      printf("ERROR: Unable to write to file `%s'.\n", fileName);
+      fclose(file);
+      exit(1);
+    }
+  }
+  if(fclose(file) != 0) {
+    printf("ERROR: Unable to close file `%s'.\n", fileName);
+    exit(1);
+  }
+}
+
+static void Usage(const char *name) {
+  printf("Usage:\n\t%s <numOptions> <fileName>\n", name);
+  printf("\t%s -b <numOptions> <fileName>\n", name);
+  printf("\t%s -c <textFile> <fileName>\n", name);
+  printf("Options:\n");
+  printf("\t-b\tWrite a binary input file\n");
+  printf("\t-c\tConvert a text input file to a binary input file\n");
+  exit(1);
+}
 
 
 int main (int argc, char **argv) {
@@ -38,9 +168,29 @@ int main (int argc, char **argv) {
   int rv;
   int i;
 
+  OptionColumns cols;
+
+  if(argc == 4 && strcmp(argv[1], "-c") == 0) {
+    ReadText(&cols, argv[2]);
+    WriteBinary(&cols, argv[3]);
+    return 0;
+  }
+  if(argc == 4 && strcmp(argv[1], "-b") == 0) {
+    numOptions = atoi(argv[2]);
+    if(numOptions < 1) {
+      printf("ERROR: Number of options must at least be 1.\n");
+      exit(1);
+    }
+    AllocColumns(&cols, numOptions);
+    for(i=0; i<numOptions; i++) {
+      OptionData *o = &data_init[i % MAX_OPTIONS];
+      SetOption(&cols, i, o->s, o->strike, o->r, o->v, o->t, o->OptionType[0], o->DGrefval);
+    }
+    WriteBinary(&cols, argv[3]);
+    return 0;
+  }
   if (argc != 3) {
-    printf("Usage:\n\t%s <numOptions> <fileName>\n", argv[0]);
-    exit(1);
+    Usage(argv[0]);
   }
   numOptions = atoi(argv[1]);
   fileName = argv[2];
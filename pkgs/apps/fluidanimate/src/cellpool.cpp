@@ -56,6 +56,7 @@ static struct datablockhdr *cellpool_allocblock(int cells) {
 
   //initialize header and cells
   block->next = NULL;
+  block->cells = cells;
   temp1 = (struct Cell *)(block+1);
   for(i=0; i<cells; i++) {
     //If all structures are correctly padded then all pointers should also be correctly aligned,
@@ -89,6 +90,10 @@ void cellpool_init(cellpool *pool, int particles) {
   pool->alloc = pool->alloc < ALLOC_MIN_CELLS ? ALLOC_MIN_CELLS : pool->alloc;
   pool->datablocks = cellpool_allocblock(pool->alloc);
   pool->cells = (struct Cell *)(pool->datablocks + 1);
+  pool->blocks = 1;
+  pool->taken = 0;
+  pool->returned = 0;
+  pool->foreign = 0;
 }
 
 //Get a Cell structure from the memory pool
@@ -105,19 +110,34 @@ Cell *cellpool_getcell(cellpool *pool) {
     block->next = pool->datablocks;
     pool->datablocks = block;
     pool->cells = (struct Cell *)(pool->datablocks + 1);
+    pool->blocks++;
   }
 
   //return first cell in list
   temp = pool->cells;
   pool->cells = temp->next;
   temp->next = NULL;
+  pool->taken++;
   return temp;
 }
 
+//Check whether a Cell structure was allocated by the memory pool
+static bool cellpool_owns(cellpool *pool, Cell *cell) {
+  for(struct datablockhdr *block = pool->datablocks; block != NULL; block = block->next) {
+    struct Cell *first = (struct Cell *)(block+1);
+    if(cell >= first && cell < first + block->cells)
+      return true;
+  }
+  return false;
+}
+
 //Return a Cell structure to the memory pool
 void cellpool_returncell(cellpool *pool, Cell *cell) {
   assert(pool != NULL);
   assert(cell != NULL);
+  if(!cellpool_owns(pool, cell))
+    pool->foreign++;
+  pool->returned++;
   cell->next = pool->cells;
   pool->cells = cell;
 }
@@ -145,6 +165,7 @@ void cellpool_destroy(cellpool *pool) {
 //Do nothing because there is no cell pool
 void cellpool_init(cellpool *pool, int particles) {
   std::cout << "WARNING: Malloc fallback enabled for cell pool." << std::endl;
+  pool->blocks = pool->taken = pool->returned = pool->foreign = 0;
 }
 
 //Get a Cell structure
@@ -16,9 +16,11 @@
 //NOTE: Do not add additional member variables or the padding might be wrong.
 struct datablockhdr {
   struct datablockhdr *next;
+  //number of cells in the block
+  int cells;
   //NOTE: This form of padding will break if additional variables are added to the structure
   //because it does not account for compiler-inserted padding between structure members.
-  char padding[CACHELINE_SIZE - sizeof(datablockhdr *) % CACHELINE_SIZE];
+  char padding[CACHELINE_SIZE - (sizeof(datablockhdr *) + sizeof(int)) % CACHELINE_SIZE];
 };
 
 //The memory pool data structure
@@ -26,13 +28,27 @@ struct datablockhdr {
 //list of data blocks. The data blocks preserve the original block structure as returned
 //by malloc, the cell list breaks the blocks down into smaller cell structures which can
 //be used by the program as needed.
+//The memory of a pool is first touched by the thread that calls cellpool_init and
+//cellpool_getcell, which on NUMA systems places it on the node of that thread.
 typedef struct {
-  //linked list of available cells
-  struct Cell *cells;
-  //number of cells allocated so far (NOT number of cells currently available in pool)
-  int alloc;
-  //linked list of allocated data blocks (required for free operation)
-  struct datablockhdr *datablocks;
+  union {
+    struct {
+      //linked list of available cells
+      struct Cell *cells;
+      //number of cells allocated so far (NOT number of cells currently available in pool)
+      int alloc;
+      //linked list of allocated data blocks (required for free operation)
+      struct datablockhdr *datablocks;
+      //statistics
+      int blocks;   //number of data blocks allocated so far
+      int taken;    //cells handed out by the pool
+      int returned; //cells returned to the pool, which may have been taken from another
+                    //pool, so only the sums over all pools give the cells in use
+      int foreign;  //cells returned to the pool that were allocated by another pool
+    };
+    //pools of different threads are usually stored next to each other
+    unsigned char pp[CACHELINE_SIZE];
+  };
 } cellpool;
 
 
@@ -5,9 +5,11 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
 
 #include <iostream>
 #include <fstream>
+#include <string>
 #if defined(WIN32)
 #define NOMINMAX
 #include <windows.h>
@@ -16,10 +18,23 @@
 #include <pthread.h>
 #include <assert.h>
 #include <float.h>
+#include <stdio.h>
+#if !defined(WIN32)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
 
 #include "fluid.hpp"
 #include "cellpool.hpp"
 #include "parsec_barrier.hpp"
+#include "sph_kernels.hpp"
+#include "snapshot.hpp"
 
 #ifdef ENABLE_VISUALIZATION
 #include "fluidview.hpp"
@@ -48,17 +63,50 @@ Cell *cells2 = 0;
 int *cnumPars = 0;
 int *cnumPars2 = 0;
 Cell **last_cells = NULL; //helper array with pointers to last cell structure of "cells" array lists
+
+//Particles in structure-of-arrays form, see SortParticlesSoAMT
+bool useSoA = false;
+struct ParticleArrays {
+  fptype *px, *py, *pz;
+  fptype *hvx, *hvy, *hvz;
+  fptype *vx, *vy, *vz;
+  fptype *ax, *ay, *az;
+  fptype *density;
+};
+ParticleArrays pars;            // particles of the frame in progress, sorted by cell
+ParticleArrays pars2;           // particles of the previous frame
+int *cellStart = 0;             // index of the first particle of each cell in pars
+int *cellStart2 = 0;            // same for pars2
+#define MOVE_DIRS 27
+unsigned char *moveDir = 0;     // direction of the cell each particle of pars2 moves to
+int *moveOffset = 0;            // MOVE_DIRS per cell: particles moving in each direction, then their offsets
+int *localStart = 0;            // start of each cell relative to the range of its thread
+int *owner = 0;                 // partition of each cell
+int *threadCount = 0;           // particles in the range of each thread
+int *threadStarts = 0;          // NUM_GRIDS x NUM_GRIDS scratch for MoveParticlesSoAMT
+//Per-thread copy of the neighbors of one cell, see GatherNeighborsSoA
+struct NeighborBuffer
+{
+  union {
+    struct {
+      fptype *px, *py, *pz;
+      fptype *vx, *vy, *vz;
+      fptype *density;
+      int capacity;
+    };
+    unsigned char pp[CACHELINE_SIZE];
+  };
+} *neighBufs = 0;
 #ifdef ENABLE_VISUALIZATION
 Vec3 vMax(0.0,0.0,0.0);
 Vec3 vMin(0.0,0.0,0.0);
 #endif
 
 int XDIVS = 1;  // number of partitions in X
-int ZDIVS = 1;  // number of partitions in Z
+int *ZDIVS = 0; // number of partitions in Z of each partition in X
+int numGrids = 1; // number of partitions in total, one per thread
 
-#define NUM_GRIDS  ((XDIVS) * (ZDIVS))
-#define MUTEXES_PER_CELL 128
-#define CELL_MUTEX_ID 0
+#define NUM_GRIDS  (numGrids)
 
 struct Grid
 {
@@ -71,10 +119,69 @@ struct Grid
   };
 } *grids;
 bool  *border;
+
+//Per-thread load statistics, double buffered by frame parity: the threads fill in the
+//slots of the current frame while thread 0 reads those of the previous one
+struct ThreadStats
+{
+  union {
+    struct {
+      double mark;          // time at which the thread last left a barrier
+      double busy[2];       // seconds spent outside of barriers
+      int particles[2];     // particles in the partition of the thread
+    };
+    unsigned char pp[CACHELINE_SIZE];
+  };
+} *tstats;
+
+//Steps of a frame after which the threads report their progress. Most steps only
+//depend on the threads owning neighbor cells, so instead of meeting at a global
+//barrier the threads wait for those, see AdvanceFrameMT
+enum FrameStep
+{
+  STEP_START,       // thread 0 swapped the grids and repartitioned them
+  STEP_SORTED,      // --soa: moves out of the cells counted
+  STEP_COUNTED,     // --soa: sizes of the cells known
+  STEP_REBUILT,     // particles in their new cells
+  STEP_DENSITIES,   // densities final
+  STEP_FORCES,      // forces final
+  STEP_DONE,        // particles advanced
+  NUM_STEPS
+};
+
+struct Progress
+{
+  std::atomic<int> step;  // last step reached, see StepId
+  unsigned char pp[CACHELINE_SIZE - sizeof(std::atomic<int>)];
+} *progress;
+int *nearThreads = 0; // NUM_GRIDS x NUM_GRIDS: threads owning cells next to the partition of each thread
+int *numNear = 0;     // number of such threads of each thread
+int *allThreads = 0;  // 0, 1, ..., NUM_GRIDS-1
+
+int rebalanceInterval = 16; // frames between two repartitionings of the grid, 0 disables them
+bool balanceReport = false; // print the load imbalance of every frame
+int numRepartitions = 0;
+double sumImbalance = 0.0;  // sum and maximum of the busy time imbalance over all frames
+double maxImbalance = 0.0;
+
+//Snapshots written by an I/O thread while the simulation runs, see snapshot.hpp
+snapshot_writer snapshots;
+int snapshotInterval = 0;             // frames between two snapshots, 0 disables them
+char const *snapshotPrefix = "snapshot";
+int snapshotSinks = SNAPSHOT_FLUID;
+snapshot *curSnapshot = NULL;         // snapshot of the frame in progress, if any
+
+int checkpointInterval = 0;           // frames between two checkpoints, 0 disables them
+char const *checkpointFile = "fluidanimate.ckpt";
+int firstFrame = 0;                   // frames computed before this run when restarting from a checkpoint
+
+bool pinThreads = false;              // pin every thread to one CPU, see PinThread
+int *cpus = NULL;                     // CPUs the threads are pinned to, by thread id
+int numCpus = 0;
+
 pthread_attr_t attr;
 pthread_t *thread;
-pthread_mutex_t **mutex;  // used to lock cells in RebuildGrid and also particles in other functions
-pthread_barrier_t barrier;  // global barrier used by all threads
+pthread_mutex_t *mutex;   // used to lock border cells in RebuildGrid
 #ifdef ENABLE_VISUALIZATION
 pthread_barrier_t visualization_barrier;  // global barrier to separate (serial) visualization phase from (parallel) fluid simulation
 #endif
@@ -86,80 +193,593 @@ typedef struct __thread_args {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+//Wall clock time in seconds
+static inline double WallTime()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void *AlignedMalloc(size_t size)
+{
+  void *ptr;
+#if defined(WIN32)
+  ptr = _aligned_malloc(size, CACHELINE_SIZE);
+#elif defined(SPARC_SOLARIS)
+  ptr = memalign(CACHELINE_SIZE, size);
+#else
+  if(posix_memalign(&ptr, CACHELINE_SIZE, size) != 0)
+    ptr = NULL;
+#endif
+  assert(ptr != NULL);
+  return ptr;
+}
+
+static void AlignedFree(void *ptr)
+{
+#if defined(WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+static void AllocParticleArrays(ParticleArrays *a, int n)
+{
+  fptype **fields[] = { &a->px, &a->py, &a->pz, &a->hvx, &a->hvy, &a->hvz, &a->vx, &a->vy, &a->vz,
+                        &a->ax, &a->ay, &a->az, &a->density };
+  for(unsigned int i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+    *fields[i] = (fptype *)AlignedMalloc(sizeof(fptype) * (n > 0 ? n : 1));
+}
+
+static void FreeParticleArrays(ParticleArrays *a)
+{
+  fptype *fields[] = { a->px, a->py, a->pz, a->hvx, a->hvy, a->hvz, a->vx, a->vy, a->vz,
+                       a->ax, a->ay, a->az, a->density };
+  for(unsigned int i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+    AlignedFree(fields[i]);
+}
+
+static void AllocNeighborBuffer(NeighborBuffer *b, int n)
+{
+  fptype **fields[] = { &b->px, &b->py, &b->pz, &b->vx, &b->vy, &b->vz, &b->density };
+  for(unsigned int i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+    *fields[i] = (fptype *)AlignedMalloc(sizeof(fptype) * (n > 0 ? n : 1));
+  b->capacity = n;
+}
+
+static void FreeNeighborBuffer(NeighborBuffer *b)
+{
+  fptype *fields[] = { b->px, b->py, b->pz, b->vx, b->vy, b->vz, b->density };
+  for(unsigned int i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+    AlignedFree(fields[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 /*
- * hmgweight
+ * BalancedCuts
  *
- * Computes the hamming weight of x
+ * Splits the n entries of weights into parts contiguous ranges so that range j
+ * gets a share of the total weight proportional to shares[j]. Every range gets
+ * at least one entry. If all weights are zero the entries themselves are split.
  *
- * x      - input value
- * lsb    - if x!=0 position of smallest bit set, else -1
+ * cuts   - range j is [cuts[j], cuts[j+1]), cuts[0] == 0 and cuts[parts] == n
+ */
+void BalancedCuts(long const *weights, int n, int const *shares, int parts, int *cuts)
+{
+  assert(n >= parts);
+  long total = 0;
+  for(int i = 0; i < n; ++i)
+    total += weights[i];
+  long totalShares = 0;
+  for(int j = 0; j < parts; ++j)
+    totalShares += shares[j];
+
+  cuts[0] = 0;
+  int c = 0;
+  long prefix = 0;   // weight of the entries [0, c)
+  long share = 0;
+  for(int j = 1; j < parts; ++j)
+  {
+    share += shares[j-1];
+    double target = (total > 0 ? (double)total : (double)n) * share / totalShares;
+    while(c < n && (double)prefix < target)
+    {
+      prefix += (total > 0 ? weights[c] : 1);
+      ++c;
+    }
+    //the entry that crossed the target goes to whichever side is closer to it
+    int cut = c;
+    if(c > 0 && (double)prefix - target > target - (double)(prefix - (total > 0 ? weights[c-1] : 1)))
+      cut = c-1;
+    if(cut < cuts[j-1]+1) cut = cuts[j-1]+1;
+    if(cut > n-(parts-j)) cut = n-(parts-j);
+    cuts[j] = cut;
+  }
+  cuts[parts] = n;
+}
+
+/*
+ * PartitionGrid
  *
- * return - the hamming weight
+ * Splits the grid into XDIVS slabs along x and every slab i into ZDIVS[i]
+ * blocks along z, one block per thread. The cuts balance the number of
+ * particles per cell in counts, first between the slabs (weighted by
+ * the number of blocks in them) and then between the blocks of each slab.
  */
-unsigned int hmgweight(unsigned int x, int *lsb) {
-  unsigned int weight=0;
-  unsigned int mask= 1;
-  unsigned int count=0;
-
-  *lsb=-1;
-  while(x > 0) {
-    unsigned int temp;
-    temp=(x&mask);
-    if((x&mask) == 1) {
-      weight++;
-      if(*lsb == -1) *lsb = count;
+void PartitionGrid(const int *counts)
+{
+  long *weights = new long[std::max(nx, nz)];
+  int *cutsx = new int[XDIVS+1];
+  int *cutsz = new int[nz+1];
+  int *ones = new int[nz];
+  for(int j = 0; j < nz; ++j)
+    ones[j] = 1;
+
+  for(int ix = 0; ix < nx; ++ix)
+    weights[ix] = 0;
+  for(int iz = 0; iz < nz; ++iz)
+    for(int iy = 0; iy < ny; ++iy)
+      for(int ix = 0; ix < nx; ++ix)
+        weights[ix] += counts[(iz*ny + iy)*nx + ix];
+  BalancedCuts(weights, nx, ZDIVS, XDIVS, cutsx);
+
+  int gi = 0;
+  for(int i = 0; i < XDIVS; ++i)
+  {
+    for(int iz = 0; iz < nz; ++iz)
+    {
+      weights[iz] = 0;
+      for(int iy = 0; iy < ny; ++iy)
+        for(int ix = cutsx[i]; ix < cutsx[i+1]; ++ix)
+          weights[iz] += counts[(iz*ny + iy)*nx + ix];
+    }
+    BalancedCuts(weights, nz, ones, ZDIVS[i], cutsz);
+
+    for(int j = 0; j < ZDIVS[i]; ++j, ++gi)
+    {
+      grids[gi].sx = cutsx[i];
+      grids[gi].ex = cutsx[i+1];
+      grids[gi].sy = 0;
+      grids[gi].ey = ny;
+      grids[gi].sz = cutsz[j];
+      grids[gi].ez = cutsz[j+1];
+      for(int iz = cutsz[j]; iz < cutsz[j+1]; ++iz)
+        for(int iy = 0; iy < ny; ++iy)
+          for(int ix = cutsx[i]; ix < cutsx[i+1]; ++ix)
+            owner[(iz*ny + iy)*nx + ix] = gi;
     }
-    x >>= 1;
-    count++;
   }
+  assert(gi == NUM_GRIDS);
 
-  return weight;
+  delete[] weights;
+  delete[] cutsx;
+  delete[] cutsz;
+  delete[] ones;
 }
 
-void InitSim(char const *fileName, unsigned int threadnum)
+/*
+ * UpdateBorders
+ *
+ * Flags the cells that have a neighbor in another partition and finds the
+ * threads whose partitions touch each partition
+ */
+void UpdateBorders()
 {
-  //Compute partitioning based on square root of number of threads
-  //NOTE: Other partition sizes are possible as long as XDIVS * ZDIVS == threadnum,
-  //      but communication is minimal (and hence optimal) if XDIVS == ZDIVS
-  int lsb;
-  if(hmgweight(threadnum,&lsb) != 1) {
-    std::cerr << "Number of threads must be a power of 2" << std::endl;
-    exit(1);
+  for(int i = 0; i < NUM_GRIDS; ++i)
+    for(int iz = grids[i].sz; iz < grids[i].ez; ++iz)
+      for(int iy = grids[i].sy; iy < grids[i].ey; ++iy)
+        for(int ix = grids[i].sx; ix < grids[i].ex; ++ix)
+        {
+          int index = (iz*ny + iy)*nx + ix;
+          bool isBorder = false;
+          for(int dk = -1; dk <= 1 && !isBorder; ++dk)
+            for(int dj = -1; dj <= 1 && !isBorder; ++dj)
+              for(int di = -1; di <= 1 && !isBorder; ++di)
+              {
+                int ci = ix + di;
+                int cj = iy + dj;
+                int ck = iz + dk;
+
+                if(ci < 0) ci = 0; else if(ci > (nx-1)) ci = nx-1;
+                if(cj < 0) cj = 0; else if(cj > (ny-1)) cj = ny-1;
+                if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
+
+                if( ci < grids[i].sx || ci >= grids[i].ex ||
+                  cj < grids[i].sy || cj >= grids[i].ey ||
+                  ck < grids[i].sz || ck >= grids[i].ez )
+                    isBorder = true;
+              }
+          border[index] = isBorder;
+        }
+
+  for(int i = 0; i < NUM_GRIDS; ++i)
+  {
+    numNear[i] = 0;
+    for(int j = 0; j < NUM_GRIDS; ++j)
+      if(j != i &&
+         grids[j].sx <= grids[i].ex && grids[j].ex >= grids[i].sx &&
+         grids[j].sy <= grids[i].ey && grids[j].ey >= grids[i].sy &&
+         grids[j].sz <= grids[i].ez && grids[j].ez >= grids[i].sz)
+        nearThreads[i*NUM_GRIDS + numNear[i]++] = j;
+  }
+}
+
+/*
+ * RepartitionGrid
+ *
+ * Moves the partition boundaries to follow the particles. Must only be called
+ * while no other thread touches the grid.
+ *
+ * return - true if any partition changed
+ */
+bool RepartitionGrid()
+{
+  Grid *old = new Grid[NUM_GRIDS];
+  memcpy(old, grids, sizeof(Grid) * NUM_GRIDS);
+  PartitionGrid(cnumPars);
+  bool changed = false;
+  for(int i = 0; i < NUM_GRIDS && !changed; ++i)
+    changed = old[i].sx != grids[i].sx || old[i].ex != grids[i].ex ||
+              old[i].sz != grids[i].sz || old[i].ez != grids[i].ez;
+  delete[] old;
+  if(changed)
+  {
+    UpdateBorders();
+    ++numRepartitions;
+  }
+  return changed;
+}
+
+/*
+ * RecordBalance
+ *
+ * Adds the load of frame f to the imbalance statistics and prints it if
+ * requested. The imbalance is the maximum over the mean of the per-thread
+ * values, 1.0 means perfect balance.
+ */
+void RecordBalance(int f, bool repartitioned)
+{
+  int parity = f & 1;
+  double maxBusy = 0.0, sumBusy = 0.0;
+  int maxPars = 0, minPars = numParticles, slowest = 0;
+  for(int i = 0; i < NUM_GRIDS; ++i)
+  {
+    double busy = tstats[i].busy[parity];
+    int pars = tstats[i].particles[parity];
+    sumBusy += busy;
+    if(busy > maxBusy) { maxBusy = busy; slowest = i; }
+    maxPars = std::max(maxPars, pars);
+    minPars = std::min(minPars, pars);
+  }
+  double imbalance = sumBusy > 0.0 ? maxBusy * NUM_GRIDS / sumBusy : 1.0;
+  sumImbalance += imbalance;
+  maxImbalance = std::max(maxImbalance, imbalance);
+
+  if(balanceReport)
+  {
+    std::cout << "Frame " << f << ": particles per thread " << minPars << " - " << maxPars
+              << " (imbalance " << (numParticles > 0 ? (double)maxPars * NUM_GRIDS / numParticles : 1.0) << ")"
+              << ", busy time imbalance " << imbalance << ", slowest thread " << slowest
+              << " (" << maxBusy * 1e3 << " ms)" << (repartitioned ? ", repartitioned" : "") << std::endl;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Checkpoints (--checkpoint)
+//
+// A checkpoint holds the complete state of the simulation after a frame: the
+// particles of every cell, in the order in which the next frame reads them, and
+// the time step. A .fluid file only has the particles, which InitSim bins into
+// cells by position. That moves every particle that left its cell in the last
+// frame one frame early, so a run restarted from a .fluid file diverges from an
+// uninterrupted one. A run restarted from a checkpoint does not (see README).
+//
+// Layout, every part starts at a multiple of CHECKPOINT_ALIGN bytes:
+//
+//   | CheckpointHeader | particles of each cell (int) | px of all particles | py | ... | vz |
+//
+// The particles are sorted by cell index. The values are stored in the byte
+// order and precision of the host, so only the same build can restart from a
+// checkpoint. Restarting maps the file into memory and copies it cell by cell
+// into the Cell lists or the particle arrays.
+#define CHECKPOINT_ALIGN   64
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_FIELDS  9   // px, py, pz, hvx, hvy, hvz, vx, vy, vz
+
+struct CheckpointHeader
+{
+  char magic[4];                 // "FCKP"
+  int version;
+  int byteOrder;                 // 0x01020304 in the byte order of the writer
+  int fptypeSize;                // sizeof(fptype)
+  int frame;                     // frames computed
+  int numParticles;
+  int nx, ny, nz;
+  double restParticlesPerMeter;
+  double timeStep;
+};
+
+//A checkpoint mapped into memory
+struct CheckpointMap
+{
+  void *data;
+  size_t size;
+  const CheckpointHeader *header;
+  const int *counts;                          // particles of each cell
+  const fptype *values[CHECKPOINT_FIELDS];    // components of all particles
+};
+
+static inline size_t CheckpointAlign(size_t n)
+{
+  return (n + CHECKPOINT_ALIGN-1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+//Offset of the particle counts in a checkpoint
+static inline size_t CheckpointCountsOffset()
+{
+  return CheckpointAlign(sizeof(CheckpointHeader));
+}
+
+//Offset of a component of all particles in a checkpoint, CHECKPOINT_FIELDS gives the file size
+static inline size_t CheckpointFieldOffset(int cells, int particles, int field)
+{
+  size_t start = CheckpointAlign(CheckpointCountsOffset() + sizeof(int) * cells);
+  return start + field * CheckpointAlign(sizeof(fptype) * particles);
+}
+
+static void CheckpointError(char const *fileName, char const *msg)
+{
+  std::cerr << "Checkpoint \"" << fileName << "\": " << msg << ". Aborting." << std::endl;
+  exit(1);
+}
+
+//Maps a checkpoint into memory, returns false if the file is not a checkpoint
+static bool MapCheckpoint(char const *fileName, CheckpointMap *ck)
+{
+  char magic[4] = { 0, 0, 0, 0 };
+  std::ifstream probe(fileName, std::ios::binary);
+  probe.read(magic, sizeof(magic));
+  if(!probe || memcmp(magic, "FCKP", sizeof(magic)) != 0)
+    return false;
+
+#if defined(WIN32)
+  probe.seekg(0, std::ios::end);
+  ck->size = (size_t)probe.tellg();
+  probe.seekg(0, std::ios::beg);
+  ck->data = AlignedMalloc(ck->size);
+  probe.read((char *)ck->data, ck->size);
+  if(!probe)
+    CheckpointError(fileName, "cannot be read");
+#else
+  probe.close();
+  int fd = open(fileName, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0)
+    CheckpointError(fileName, "cannot be opened");
+  ck->size = (size_t)st.st_size;
+  ck->data = mmap(NULL, ck->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(ck->data == MAP_FAILED)
+    CheckpointError(fileName, "cannot be mapped");
+  //the whole file is read right away, start reading it ahead
+  madvise(ck->data, ck->size, MADV_WILLNEED);
+#endif
+
+  const char *data = (const char *)ck->data;
+  const CheckpointHeader *hdr = (const CheckpointHeader *)data;
+  ck->header = hdr;
+  if(ck->size < sizeof(CheckpointHeader) || hdr->version != CHECKPOINT_VERSION)
+    CheckpointError(fileName, "unsupported version");
+  if(hdr->byteOrder != 0x01020304 || hdr->fptypeSize != (int)sizeof(fptype))
+    CheckpointError(fileName, "written with a different byte order or precision");
+  if(hdr->numParticles < 0 || hdr->nx < 1 || hdr->ny < 1 || hdr->nz < 1)
+    CheckpointError(fileName, "corrupt header");
+  int cells = hdr->nx * hdr->ny * hdr->nz;
+  if(ck->size < CheckpointFieldOffset(cells, hdr->numParticles, CHECKPOINT_FIELDS))
+    CheckpointError(fileName, "truncated");
+
+  ck->counts = (const int *)(data + CheckpointCountsOffset());
+  long total = 0;
+  for(int i = 0; i < cells; ++i)
+    total += ck->counts[i];
+  if(total != hdr->numParticles)
+    CheckpointError(fileName, "particle counts do not add up");
+  for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+    ck->values[f] = (const fptype *)(data + CheckpointFieldOffset(cells, hdr->numParticles, f));
+  return true;
+}
+
+static void UnmapCheckpoint(CheckpointMap *ck)
+{
+#if defined(WIN32)
+  AlignedFree(ck->data);
+#else
+  munmap(ck->data, ck->size);
+#endif
+  ck->data = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Finds the CPUs the process may run on, thread i is pinned to the i-th of them
+void InitPinning()
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) == 0)
+  {
+    cpus = new int[CPU_SETSIZE];
+    for(int i = 0; i < CPU_SETSIZE; ++i)
+      if(CPU_ISSET(i, &set))
+        cpus[numCpus++] = i;
+  }
+#endif
+  if(numCpus == 0)
+    std::cerr << "WARNING: --pin is not supported on this system, threads are not pinned" << std::endl;
+}
+
+//Pins the calling thread to its CPU with --pin. Thread tid runs on the same CPU
+//during the initialization and the simulation, so the memory it touched first
+//stays on its NUMA node.
+static void PinThread(int tid)
+{
+#if defined(__linux__)
+  if(!pinThreads || numCpus == 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpus[tid % numCpus], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+//Particles sorted by cell index, from which InitPartitionMT fills the partitions
+struct ParticleStage
+{
+  const int *counts;                          // particles of each cell
+  int *start;                                 // index of the first particle of each cell
+  const fptype *values[CHECKPOINT_FIELDS];    // px, py, pz, hvx, hvy, hvz, vx, vy, vz
+  int *threadStart;                           // --soa: first particle of the range of each thread
+} stage;
+
+//Fills the partition of a thread from the stage, one thread per partition before
+//the simulation starts. The thread is the first to touch the cells, pools and
+//array ranges of its partition, so on NUMA systems their memory is placed on the
+//node of the thread that works on them.
+void *InitPartitionMT(void *args)
+{
+  int tid = ((thread_args *)args)->tid;
+  PinThread(tid);
+
+  //the structure-of-arrays storage needs no Cell lists
+  if(!useSoA)
+    cellpool_init(&pools[tid], numParticles/NUM_GRIDS);
+
+  fptype *dst[CHECKPOINT_FIELDS] = { pars.px, pars.py, pars.pz, pars.hvx, pars.hvy, pars.hvz, pars.vx, pars.vy, pars.vz };
+  const fptype * const *v = stage.values;
+  int k = useSoA ? stage.threadStart[tid] : 0;
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index = (iz*ny + iy)*nx + ix;
+        int n = stage.counts[index];
+        int s = stage.start[index];
+        cnumPars[index] = n;
+        //the grid of the next frame must start out empty, see RebuildGridMT
+        cnumPars2[index] = 0;
+
+        if(useSoA) {
+          //lay out the cells of the thread in the order it visits them
+          cellStart[index] = k;
+          cellStart2[index] = k;
+          localStart[index] = 0;
+          memset(&moveOffset[index * MOVE_DIRS], 0, sizeof(int) * MOVE_DIRS);
+          for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+            memcpy(&dst[f][k], &v[f][s], sizeof(fptype) * n);
+          k += n;
+          continue;
+        }
+
+        // because cells and cells2 are not allocated via new
+        // we construct them here
+        new (&cells[index]) Cell;
+        new (&cells2[index]) Cell;
+        last_cells[index] = NULL;
+        Cell *cell = &cells[index];
+        for(int j = 0; j < n; ++j, ++s)
+        {
+          int np = j % PARTICLES_PER_CELL;
+          //add another cell structure if everything full
+          if(np == 0 && j > 0) {
+            cell->next = cellpool_getcell(&pools[tid]);
+            cell = cell->next;
+          }
+          cell->p[np].x  = v[0][s];
+          cell->p[np].y  = v[1][s];
+          cell->p[np].z  = v[2][s];
+          cell->hv[np].x = v[3][s];
+          cell->hv[np].y = v[4][s];
+          cell->hv[np].z = v[5][s];
+          cell->v[np].x  = v[6][s];
+          cell->v[np].y  = v[7][s];
+          cell->v[np].z  = v[8][s];
+        }
+      }
+
+  if(useSoA) {
+    //touch the remaining arrays in the range of the thread as well
+    int first = stage.threadStart[tid];
+    ParticleArrays *arrays[] = { &pars, &pars2 };
+    for(int i = 0; i < 2; ++i)
+    {
+      ParticleArrays *a = arrays[i];
+      fptype *fields[] = { a->px, a->py, a->pz, a->hvx, a->hvy, a->hvz, a->vx, a->vy, a->vz,
+                           a->ax, a->ay, a->az, a->density };
+      for(unsigned int f = i == 0 ? CHECKPOINT_FIELDS : 0; f < sizeof(fields)/sizeof(fields[0]); ++f)
+        memset(&fields[f][first], 0, sizeof(fptype) * (k - first));
+    }
+    memset(&moveDir[first], 0, k - first);
   }
-  XDIVS = 1<<(lsb/2);
-  ZDIVS = 1<<(lsb/2);
-  if(XDIVS*ZDIVS != threadnum) XDIVS*=2;
-  assert(XDIVS * ZDIVS == threadnum);
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void InitSim(char const *fileName, unsigned int threadnum)
+{
+  //One partition per thread. The grid is split into about sqrt(threadnum) slabs
+  //along x and the slabs into blocks along z, which keeps the borders short for
+  //any number of threads. The cuts themselves are placed by PartitionGrid once the
+  //particles are known.
+  numGrids = threadnum;
+  XDIVS = (int)(sqrt((double)threadnum) + 0.5);
+  ZDIVS = new int[XDIVS];
+  for(int i = 0; i < XDIVS; ++i)
+    ZDIVS[i] = threadnum / XDIVS + (i < (int)(threadnum % XDIVS) ? 1 : 0);
 
   thread = new pthread_t[NUM_GRIDS];
   grids = new struct Grid[NUM_GRIDS];
   assert(sizeof(Grid) <= CACHELINE_SIZE); // as we put and aligh grid on the cacheline size to avoid false-sharing
                                           // if asserts fails - increase pp union member in Grid declarationi
                                           // and change this macro 
+  assert(sizeof(ThreadStats) <= CACHELINE_SIZE);
   pools = new cellpool[NUM_GRIDS];
 
-  //Load input particles
+  //Load input particles, either from a .fluid file or from a checkpoint
   std::cout << "Loading file \"" << fileName << "\"..." << std::endl;
-  std::ifstream file(fileName, std::ios::binary);
-  if(!file) {
-    std::cerr << "Error opening file. Aborting." << std::endl;
-    exit(1);
-  }
-
-  //Always use single precision float variables b/c file format uses single precision
-  float restParticlesPerMeter_le;
-  int numParticles_le;
-  file.read((char *)&restParticlesPerMeter_le, FILE_SIZE_FLOAT);
-  file.read((char *)&numParticles_le, FILE_SIZE_INT);
-  if(!isLittleEndian()) {
-    restParticlesPerMeter = bswap_float(restParticlesPerMeter_le);
-    numParticles          = bswap_int32(numParticles_le);
+  CheckpointMap ck = {};
+  bool restart = MapCheckpoint(fileName, &ck);
+  std::ifstream file;
+  if(restart) {
+    restParticlesPerMeter = ck.header->restParticlesPerMeter;
+    numParticles = ck.header->numParticles;
+    timeStep = ck.header->timeStep;
+    firstFrame = ck.header->frame;
+    std::cout << "Restarting after frame " << firstFrame << std::endl;
   } else {
-    restParticlesPerMeter = restParticlesPerMeter_le;
-    numParticles          = numParticles_le;
-  }
-  for(int i=0; i<NUM_GRIDS; i++) cellpool_init(&pools[i], numParticles/NUM_GRIDS);
+    file.open(fileName, std::ios::binary);
+    if(!file) {
+      std::cerr << "Error opening file. Aborting." << std::endl;
+      exit(1);
+    }
 
+    //Always use single precision float variables b/c file format uses single precision
+    float restParticlesPerMeter_le;
+    int numParticles_le;
+    file.read((char *)&restParticlesPerMeter_le, FILE_SIZE_FLOAT);
+    file.read((char *)&numParticles_le, FILE_SIZE_INT);
+    if(!isLittleEndian()) {
+      restParticlesPerMeter = bswap_float(restParticlesPerMeter_le);
+      numParticles          = bswap_int32(numParticles_le);
+    } else {
+      restParticlesPerMeter = restParticlesPerMeter_le;
+      numParticles          = numParticles_le;
+    }
+  }
   h = kernelRadiusMultiplier / restParticlesPerMeter;
   hSq = h*h;
 
@@ -188,87 +808,19 @@ void InitSim(char const *fileName, unsigned int threadnum)
   delta.y = range.y / ny;
   delta.z = range.z / nz;
   assert(delta.x >= h && delta.y >= h && delta.z >= h);
+  if(restart && (nx != ck.header->nx || ny != ck.header->ny || nz != ck.header->nz))
+    CheckpointError(fileName, "grid does not match");
 
   std::cout << "Grids steps over x, y, z: " << delta.x << " " << delta.y << " " << delta.z << std::endl;
   
-  assert(nx >= XDIVS && nz >= ZDIVS);
-  int gi = 0;
-  int sx, sz, ex, ez;
-  ex = 0;
-  for(int i = 0; i < XDIVS; ++i)
-  {
-    sx = ex;
-    ex = (int)((fptype)(nx)/(fptype)(XDIVS) * (i+1) + 0.5);
-    assert(sx < ex);
-
-    ez = 0;
-    for(int j = 0; j < ZDIVS; ++j, ++gi)
-    {
-      sz = ez;
-      ez = (int)((fptype)(nz)/(fptype)(ZDIVS) * (j+1) + 0.5);
-      assert(sz < ez);
-
-      grids[gi].sx = sx;
-      grids[gi].ex = ex;
-      grids[gi].sy = 0;
-      grids[gi].ey = ny;
-      grids[gi].sz = sz;
-      grids[gi].ez = ez;
-    }
+  if(nx < XDIVS || nz < ZDIVS[0]) {
+    std::cerr << "Grid of " << nx << " x " << nz << " cells is too small for " << NUM_GRIDS << " threads" << std::endl;
+    exit(1);
   }
-  assert(gi == NUM_GRIDS);
-
-  border = new bool[numCells];
-  for(int i = 0; i < NUM_GRIDS; ++i)
-    for(int iz = grids[i].sz; iz < grids[i].ez; ++iz)
-      for(int iy = grids[i].sy; iy < grids[i].ey; ++iy)
-        for(int ix = grids[i].sx; ix < grids[i].ex; ++ix)
-        {
-          int index = (iz*ny + iy)*nx + ix;
-          border[index] = false;
-          for(int dk = -1; dk <= 1; ++dk)
-	  {
-            for(int dj = -1; dj <= 1; ++dj)
-	    {
-              for(int di = -1; di <= 1; ++di)
-              {
-                int ci = ix + di;
-                int cj = iy + dj;
-                int ck = iz + dk;
-
-                if(ci < 0) ci = 0; else if(ci > (nx-1)) ci = nx-1;
-                if(cj < 0) cj = 0; else if(cj > (ny-1)) cj = ny-1;
-                if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
-
-                if( ci < grids[i].sx || ci >= grids[i].ex ||
-                  cj < grids[i].sy || cj >= grids[i].ey ||
-                  ck < grids[i].sz || ck >= grids[i].ez ) {
-                      
-                    border[index] = true;
-		    break;
-		}
-              } // for(int di = -1; di <= 1; ++di)
-	      if(border[index])
-		break;
-	    } // for(int dj = -1; dj <= 1; ++dj)
-	    if(border[index])
-	       break;
-           } // for(int dk = -1; dk <= 1; ++dk)
-        }
 
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-  mutex = new pthread_mutex_t *[numCells];
-  for(int i = 0; i < numCells; ++i)
-  {
-    assert(CELL_MUTEX_ID < MUTEXES_PER_CELL);
-    int n = (border[i] ? MUTEXES_PER_CELL : CELL_MUTEX_ID+1);
-    mutex[i] = new pthread_mutex_t[n];
-    for(int j = 0; j < n; ++j)
-      pthread_mutex_init(&mutex[i][j], NULL);
-  }
-  pthread_barrier_init(&barrier, NULL, NUM_GRIDS);
 #ifdef ENABLE_VISUALIZATION
   //visualization barrier is used by all NUM_GRIDS worker threads and 1 master thread
   pthread_barrier_init(&visualization_barrier, NULL, NUM_GRIDS+1);
@@ -278,43 +830,53 @@ void InitSim(char const *fileName, unsigned int threadnum)
   //make sure helper Cell structure is in sync with real Cell structure
   assert(offsetof(struct Cell_aux, padding) == offsetof(struct Cell, padding));
 
+  int numCellLists = useSoA ? 0 : numCells;
 #if defined(WIN32)
-  cells = (struct Cell*)_aligned_malloc(sizeof(struct Cell) * numCells, CACHELINE_SIZE);
-  cells2 = (struct Cell*)_aligned_malloc(sizeof(struct Cell) * numCells, CACHELINE_SIZE);
+  cells = (struct Cell*)_aligned_malloc(sizeof(struct Cell) * numCellLists, CACHELINE_SIZE);
+  cells2 = (struct Cell*)_aligned_malloc(sizeof(struct Cell) * numCellLists, CACHELINE_SIZE);
   cnumPars = (int*)_aligned_malloc(sizeof(int) * numCells, CACHELINE_SIZE);
   cnumPars2 = (int*)_aligned_malloc(sizeof(int) * numCells, CACHELINE_SIZE);
-  last_cells = (struct Cell **)_aligned_malloc(sizeof(struct Cell *) * numCells, CACHELINE_SIZE);
+  last_cells = (struct Cell **)_aligned_malloc(sizeof(struct Cell *) * numCellLists, CACHELINE_SIZE);
   assert((cells!=NULL) && (cells2!=NULL) && (cnumPars!=NULL) && (cnumPars2!=NULL) && (last_cells!=NULL)); 
 #elif defined(SPARC_SOLARIS)
-  cells = (Cell*)memalign(CACHELINE_SIZE, sizeof(struct Cell) * numCells);
-  cells2 =  (Cell*)memalign(CACHELINE_SIZE, sizeof(struct Cell) * numCells);
+  cells = (Cell*)memalign(CACHELINE_SIZE, sizeof(struct Cell) * numCellLists);
+  cells2 =  (Cell*)memalign(CACHELINE_SIZE, sizeof(struct Cell) * numCellLists);
   cnumPars =  (int*)memalign(CACHELINE_SIZE, sizeof(int) * numCells);
   cnumPars2 =  (int*)memalign(CACHELINE_SIZE, sizeof(int) * numCells);
-  last_cells =  (Cell**)memalign(CACHELINE_SIZE, sizeof(struct Cell *) * numCells);
+  last_cells =  (Cell**)memalign(CACHELINE_SIZE, sizeof(struct Cell *) * numCellLists);
   assert((cells!=0) && (cells2!=0) && (cnumPars!=0) && (cnumPars2!=0) && (last_cells!=0));
 #else
-  int rv0 = posix_memalign((void **)(&cells), CACHELINE_SIZE, sizeof(struct Cell) * numCells);
-  int rv1 = posix_memalign((void **)(&cells2), CACHELINE_SIZE, sizeof(struct Cell) * numCells);
+  int rv0 = posix_memalign((void **)(&cells), CACHELINE_SIZE, sizeof(struct Cell) * numCellLists);
+  int rv1 = posix_memalign((void **)(&cells2), CACHELINE_SIZE, sizeof(struct Cell) * numCellLists);
   int rv2 = posix_memalign((void **)(&cnumPars), CACHELINE_SIZE, sizeof(int) * numCells);
   int rv3 = posix_memalign((void **)(&cnumPars2), CACHELINE_SIZE, sizeof(int) * numCells);
-  int rv4 = posix_memalign((void **)(&last_cells), CACHELINE_SIZE, sizeof(struct Cell *) * numCells);
+  int rv4 = posix_memalign((void **)(&last_cells), CACHELINE_SIZE, sizeof(struct Cell *) * numCellLists);
   assert((rv0==0) && (rv1==0) && (rv2==0) && (rv3==0) && (rv4==0));
 #endif
 
-  // because cells and cells2 are not allocated via new
-  // we construct them here
-  for(int i=0; i<numCells; ++i)
-  {
-	  new (&cells[i]) Cell;
-	  new (&cells2[i]) Cell;
+  //Particles are staged sorted by cell and then copied into the partitions by
+  //one thread per partition, see InitPartitionMT. A checkpoint is sorted already.
+  fptype *loaded = NULL, *sorted = NULL;
+  int *parCell = NULL, *counts = NULL;
+  stage.start = new int[numCells];
+  if(restart) {
+    stage.counts = ck.counts;
+    for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+      stage.values[f] = ck.values[f];
+  } else {
+    loaded = new fptype[(size_t)CHECKPOINT_FIELDS * numParticles];
+    sorted = new fptype[(size_t)CHECKPOINT_FIELDS * numParticles];
+    parCell = new int[numParticles];
+    counts = new int[numCells];
+    memset(counts, 0, sizeof(int) * numCells);
+    stage.counts = counts;
+    for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+      stage.values[f] = &sorted[(size_t)f * numParticles];
   }
 
-  memset(cnumPars, 0, numCells*sizeof(int));
-
   //Always use single precision float variables b/c file format uses single precision float
-  int pool_id = 0;
   float px, py, pz, hvx, hvy, hvz, vx, vy, vz;
-  for(int i = 0; i < numParticles; ++i)
+  for(int i = 0; i < numParticles && !restart; ++i)
   {
     file.read((char *)&px, FILE_SIZE_FLOAT);
     file.read((char *)&py, FILE_SIZE_FLOAT);
@@ -346,118 +908,294 @@ void InitSim(char const *fileName, unsigned int threadnum)
     if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
 
     int index = (ck*ny + cj)*nx + ci;
-    Cell *cell = &cells[index];
-
-    //go to last cell structure in list
-    int np = cnumPars[index];
-    while(np > PARTICLES_PER_CELL) {
-      cell = cell->next;
-      np = np - PARTICLES_PER_CELL;
-    }
-    //add another cell structure if everything full
-    if( (np % PARTICLES_PER_CELL == 0) && (cnumPars[index] != 0) ) {
-      //Get cells from pools in round-robin fashion to balance load during parallel phase
-      cell->next = cellpool_getcell(&pools[pool_id]);
-      pool_id = (pool_id+1) % NUM_GRIDS;
-      cell = cell->next;
-      np = np - PARTICLES_PER_CELL;
-    }
-
-    cell->p[np].x = px;
-    cell->p[np].y = py;
-    cell->p[np].z = pz;
-    cell->hv[np].x = hvx;
-    cell->hv[np].y = hvy;
-    cell->hv[np].z = hvz;
-    cell->v[np].x = vx;
-    cell->v[np].y = vy;
-    cell->v[np].z = vz;
+    float values[CHECKPOINT_FIELDS] = { px, py, pz, hvx, hvy, hvz, vx, vy, vz };
+    for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+      loaded[(size_t)f * numParticles + i] = values[f];
+    parCell[i] = index;
+    ++counts[index];
 #ifdef ENABLE_VISUALIZATION
-	vMin.x = std::min(vMin.x, cell->v[np].x);
-	vMax.x = std::max(vMax.x, cell->v[np].x);
-	vMin.y = std::min(vMin.y, cell->v[np].y);
-	vMax.y = std::max(vMax.y, cell->v[np].y);
-	vMin.z = std::min(vMin.z, cell->v[np].z);
-	vMax.z = std::max(vMax.z, cell->v[np].z);
+	vMin.x = std::min(vMin.x, (fptype)vx);
+	vMax.x = std::max(vMax.x, (fptype)vx);
+	vMin.y = std::min(vMin.y, (fptype)vy);
+	vMax.y = std::max(vMax.y, (fptype)vy);
+	vMin.z = std::min(vMin.z, (fptype)vz);
+	vMax.z = std::max(vMax.z, (fptype)vz);
 #endif
-    ++cnumPars[index];
   }
 
-  std::cout << "Number of particles: " << numParticles << std::endl;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-void SaveFile(char const *fileName)
+  int start = 0;
+  for(int i = 0; i < numCells; ++i)
+  {
+    stage.start[i] = start;
+    start += stage.counts[i];
+  }
+  //sort the particles by cell, keeping the order of the file inside each cell
+  if(!restart) {
+    int *next = new int[numCells];
+    memcpy(next, stage.start, sizeof(int) * numCells);
+    for(int i = 0; i < numParticles; ++i)
+    {
+      int k = next[parCell[i]]++;
+      for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+        sorted[(size_t)f * numParticles + k] = loaded[(size_t)f * numParticles + i];
+    }
+    delete[] next;
+    delete[] loaded;
+    delete[] parCell;
+  }
+
+  std::cout << "Number of particles: " << numParticles << std::endl;
+
+  //Balance the partitions by the number of particles in them
+  owner = new int[numCells];
+  border = new bool[numCells];
+  nearThreads = new int[NUM_GRIDS * NUM_GRIDS];
+  numNear = new int[NUM_GRIDS];
+  mutex = new pthread_mutex_t[numCells];
+  for(int i = 0; i < numCells; ++i)
+    pthread_mutex_init(&mutex[i], NULL);
+  PartitionGrid(stage.counts);
+  UpdateBorders();
+
+  if(useSoA) {
+    //the arrays are touched first by InitPartitionMT
+    AllocParticleArrays(&pars, numParticles);
+    AllocParticleArrays(&pars2, numParticles);
+    cellStart = (int *)AlignedMalloc(sizeof(int) * numCells);
+    cellStart2 = (int *)AlignedMalloc(sizeof(int) * numCells);
+    moveDir = (unsigned char *)AlignedMalloc(numParticles > 0 ? numParticles : 1);
+    moveOffset = (int *)AlignedMalloc(sizeof(int) * numCells * MOVE_DIRS);
+    localStart = (int *)AlignedMalloc(sizeof(int) * numCells);
+    threadCount = new int[NUM_GRIDS];
+    threadStarts = new int[NUM_GRIDS * NUM_GRIDS];
+    //the buffers grow on first use by their thread
+    neighBufs = new NeighborBuffer[NUM_GRIDS];
+    for(int t = 0; t < NUM_GRIDS; ++t)
+      AllocNeighborBuffer(&neighBufs[t], 0);
+
+    //the ranges of the threads follow each other in the order of the threads
+    stage.threadStart = new int[NUM_GRIDS];
+    int threadStart = 0;
+    for(int t = 0; t < NUM_GRIDS; ++t)
+    {
+      stage.threadStart[t] = threadStart;
+      for(int iz = grids[t].sz; iz < grids[t].ez; ++iz)
+        for(int iy = grids[t].sy; iy < grids[t].ey; ++iy)
+          for(int ix = grids[t].sx; ix < grids[t].ex; ++ix)
+            threadStart += stage.counts[(iz*ny + iy)*nx + ix];
+    }
+  }
+
+  thread_args *targs = new thread_args[NUM_GRIDS];
+  for(int i = 0; i < NUM_GRIDS; ++i) {
+    targs[i].tid = i;
+    targs[i].frames = 0;
+    pthread_create(&thread[i], &attr, InitPartitionMT, &targs[i]);
+  }
+  for(int i = 0; i < NUM_GRIDS; ++i)
+    pthread_join(thread[i], NULL);
+  delete[] targs;
+
+  delete[] stage.start;
+  delete[] stage.threadStart;
+  stage.threadStart = NULL;
+  delete[] sorted;
+  delete[] counts;
+  if(restart)
+    UnmapCheckpoint(&ck);
+
+  tstats = new ThreadStats[NUM_GRIDS];
+  memset(tstats, 0, sizeof(ThreadStats) * NUM_GRIDS);
+  progress = (Progress *)AlignedMalloc(sizeof(Progress) * NUM_GRIDS);
+  allThreads = new int[NUM_GRIDS];
+  for(int i = 0; i < NUM_GRIDS; ++i)
+  {
+    new (&progress[i]) Progress;
+    progress[i].step.store(0);
+    allThreads[i] = i;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Appends the particles of a cell to a snapshot chunk in the layout of the .fluid format
+static void SnapshotCell(snapshot_chunk *chunk, int index)
+{
+  int np = cnumPars[index];
+  assert(chunk->count + np <= chunk->capacity);
+  //Always use single precision float variables b/c file format uses single precision
+  float *out = &chunk->values[chunk->count * SNAPSHOT_VALUES];
+  if(useSoA) {
+    int end = cellStart[index] + np;
+    for(int j = cellStart[index]; j < end; ++j)
+    {
+      out[0] = (float)pars.px[j];  out[1] = (float)pars.py[j];  out[2] = (float)pars.pz[j];
+      out[3] = (float)pars.hvx[j]; out[4] = (float)pars.hvy[j]; out[5] = (float)pars.hvz[j];
+      out[6] = (float)pars.vx[j];  out[7] = (float)pars.vy[j];  out[8] = (float)pars.vz[j];
+      out += SNAPSHOT_VALUES;
+    }
+  } else {
+    Cell *cell = &cells[index];
+    for(int j = 0; j < np; ++j)
+    {
+      int k = j % PARTICLES_PER_CELL;
+      out[0] = (float)cell->p[k].x;  out[1] = (float)cell->p[k].y;  out[2] = (float)cell->p[k].z;
+      out[3] = (float)cell->hv[k].x; out[4] = (float)cell->hv[k].y; out[5] = (float)cell->hv[k].z;
+      out[6] = (float)cell->v[k].x;  out[7] = (float)cell->v[k].y;  out[8] = (float)cell->v[k].z;
+      out += SNAPSHOT_VALUES;
+
+      //move pointer to next cell in list if end of array is reached
+      if(k == PARTICLES_PER_CELL-1) {
+        cell = cell->next;
+      }
+    }
+  }
+  chunk->count += np;
+}
+
+void SaveFile(char const *fileName)
 {
   std::cout << "Saving file \"" << fileName << "\"..." << std::endl;
 
-  std::ofstream file(fileName, std::ios::binary);
-  assert(file);
+  snapshot_chunk all;
+  all.values = NULL;
+  all.capacity = 0;
+  snapshot_chunk_reserve(&all, numParticles);
+  for(int i = 0; i < numCells; ++i)
+    SnapshotCell(&all, i);
+  assert(all.count == numParticles);
 
-  //Always use single precision float variables b/c file format uses single precision
-  if(!isLittleEndian()) {
-    float restParticlesPerMeter_le;
-    int   numParticles_le;
+  snapshot_write_fluid(fileName, (float)restParticlesPerMeter, &all, 1);
+  free(all.values);
+}
 
-    restParticlesPerMeter_le = bswap_float((float)restParticlesPerMeter);
-    numParticles_le      = bswap_int32(numParticles);
-    file.write((char *)&restParticlesPerMeter_le, FILE_SIZE_FLOAT);
-    file.write((char *)&numParticles_le,      FILE_SIZE_INT);
-  } else {
-    file.write((char *)&restParticlesPerMeter, FILE_SIZE_FLOAT);
-    file.write((char *)&numParticles,      FILE_SIZE_INT);
+////////////////////////////////////////////////////////////////////////////////
+
+//Writes size bytes to a new file and, except on Windows, waits until they are
+//on disk
+static bool WriteCheckpointFile(char const *fileName, char const *data, size_t size)
+{
+#if defined(WIN32)
+  std::ofstream file(fileName, std::ios::binary);
+  file.write(data, size);
+  file.close();
+  return !file.fail();
+#else
+  int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return false;
+  size_t done = 0;
+  while(done < size)
+  {
+    ssize_t n = write(fd, data + done, size - done);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0) {
+      close(fd);
+      return false;
+    }
+    done += n;
   }
+  bool ok = fsync(fd) == 0;
+  return close(fd) == 0 && ok;
+#endif
+}
 
-  int count = 0;
+//Flushes the directory entry of fileName to disk, so that a rename survives a
+//system crash
+static bool SyncParentDirectory(char const *fileName)
+{
+#if defined(WIN32)
+  return true;
+#else
+  std::string dir(fileName);
+  size_t slash = dir.rfind('/');
+  dir = slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+  int fd = open(dir.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+  bool ok = fsync(fd) == 0;
+  return close(fd) == 0 && ok;
+#endif
+}
+
+//Writes the state after the given number of frames as checkpoint. The file is
+//written under a temporary name, synced to disk and renamed, so a crash or, on
+//POSIX systems, a power loss while writing leaves the previous checkpoint
+//intact. A failed write is reported but does not stop the run.
+void SaveCheckpoint(char const *fileName, int frame)
+{
+  std::cout << "Saving checkpoint \"" << fileName << "\" after frame " << frame << "..." << std::endl;
+
+  size_t size = CheckpointFieldOffset(numCells, numParticles, CHECKPOINT_FIELDS);
+  char *data = (char *)calloc(size, 1);
+  assert(data);
+
+  CheckpointHeader *hdr = (CheckpointHeader *)data;
+  memcpy(hdr->magic, "FCKP", sizeof(hdr->magic));
+  hdr->version = CHECKPOINT_VERSION;
+  hdr->byteOrder = 0x01020304;
+  hdr->fptypeSize = sizeof(fptype);
+  hdr->frame = frame;
+  hdr->numParticles = numParticles;
+  hdr->nx = nx;
+  hdr->ny = ny;
+  hdr->nz = nz;
+  hdr->restParticlesPerMeter = restParticlesPerMeter;
+  hdr->timeStep = timeStep;
+  memcpy(data + CheckpointCountsOffset(), cnumPars, sizeof(int) * numCells);
+
+  fptype *v[CHECKPOINT_FIELDS];
+  for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+    v[f] = (fptype *)(data + CheckpointFieldOffset(numCells, numParticles, f));
+  fptype *src[CHECKPOINT_FIELDS] = { pars.px, pars.py, pars.pz, pars.hvx, pars.hvy, pars.hvz, pars.vx, pars.vy, pars.vz };
+  int k = 0;
   for(int i = 0; i < numCells; ++i)
   {
-    Cell *cell = &cells[i];
     int np = cnumPars[i];
-    for(int j = 0; j < np; ++j)
+    if(useSoA) {
+      for(int f = 0; f < CHECKPOINT_FIELDS; ++f)
+        memcpy(&v[f][k], &src[f][cellStart[i]], sizeof(fptype) * np);
+      k += np;
+      continue;
+    }
+    Cell *cell = &cells[i];
+    for(int j = 0; j < np; ++j, ++k)
     {
-      //Always use single precision float variables b/c file format uses single precision
-      float px, py, pz, hvx, hvy, hvz, vx,vy, vz;
-      if(!isLittleEndian()) {
-        px  = bswap_float((float)(cell->p[j % PARTICLES_PER_CELL].x));
-        py  = bswap_float((float)(cell->p[j % PARTICLES_PER_CELL].y));
-        pz  = bswap_float((float)(cell->p[j % PARTICLES_PER_CELL].z));
-        hvx = bswap_float((float)(cell->hv[j % PARTICLES_PER_CELL].x));
-        hvy = bswap_float((float)(cell->hv[j % PARTICLES_PER_CELL].y));
-        hvz = bswap_float((float)(cell->hv[j % PARTICLES_PER_CELL].z));
-        vx  = bswap_float((float)(cell->v[j % PARTICLES_PER_CELL].x));
-        vy  = bswap_float((float)(cell->v[j % PARTICLES_PER_CELL].y));
-        vz  = bswap_float((float)(cell->v[j % PARTICLES_PER_CELL].z));
-      } else {
-        px  = (float)(cell->p[j % PARTICLES_PER_CELL].x);
-        py  = (float)(cell->p[j % PARTICLES_PER_CELL].y);
-        pz  = (float)(cell->p[j % PARTICLES_PER_CELL].z);
-        hvx = (float)(cell->hv[j % PARTICLES_PER_CELL].x);
-        hvy = (float)(cell->hv[j % PARTICLES_PER_CELL].y);
-        hvz = (float)(cell->hv[j % PARTICLES_PER_CELL].z);
-        vx  = (float)(cell->v[j % PARTICLES_PER_CELL].x);
-        vy  = (float)(cell->v[j % PARTICLES_PER_CELL].y);
-        vz  = (float)(cell->v[j % PARTICLES_PER_CELL].z);
-      }
-      file.write((char *)&px,  FILE_SIZE_FLOAT);
-      file.write((char *)&py,  FILE_SIZE_FLOAT);
-      file.write((char *)&pz,  FILE_SIZE_FLOAT);
-      file.write((char *)&hvx, FILE_SIZE_FLOAT);
-      file.write((char *)&hvy, FILE_SIZE_FLOAT);
-      file.write((char *)&hvz, FILE_SIZE_FLOAT);
-      file.write((char *)&vx,  FILE_SIZE_FLOAT);
-      file.write((char *)&vy,  FILE_SIZE_FLOAT);
-      file.write((char *)&vz,  FILE_SIZE_FLOAT);
-      ++count;
+      int jj = j % PARTICLES_PER_CELL;
+      v[0][k] = cell->p[jj].x;
+      v[1][k] = cell->p[jj].y;
+      v[2][k] = cell->p[jj].z;
+      v[3][k] = cell->hv[jj].x;
+      v[4][k] = cell->hv[jj].y;
+      v[5][k] = cell->hv[jj].z;
+      v[6][k] = cell->v[jj].x;
+      v[7][k] = cell->v[jj].y;
+      v[8][k] = cell->v[jj].z;
 
       //move pointer to next cell in list if end of array is reached
-      if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+      if(jj == PARTICLES_PER_CELL-1) {
         cell = cell->next;
       }
-
     }
   }
-  assert(count == numParticles);
+  assert(k == numParticles);
+
+  std::string tmpName = std::string(fileName) + ".tmp";
+  bool ok = WriteCheckpointFile(tmpName.c_str(), data, size);
+  free(data);
+  if(ok) {
+#if defined(WIN32)
+    remove(fileName);
+#endif
+    ok = rename(tmpName.c_str(), fileName) == 0;
+  }
+  if(!ok)
+    std::cerr << "Error saving checkpoint \"" << fileName << "\" after frame " << frame
+              << ", a restart would use the previous checkpoint, if there is one" << std::endl;
+  else if(!SyncParentDirectory(fileName))
+    std::cerr << "Error syncing the directory of checkpoint \"" << fileName
+              << "\", a system crash may leave the previous checkpoint in place" << std::endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -465,7 +1203,7 @@ void SaveFile(char const *fileName)
 void CleanUpSim()
 {
   // first return extended cells to cell pools
-  for(int i=0; i< numCells; ++i)
+  for(int i=0; i< numCells && !useSoA; ++i)
   {
     Cell& cell = cells[i];
 	while(cell.next)
@@ -481,24 +1219,37 @@ void CleanUpSim()
   //      uses its internal meta information to free exactly the cells which it allocated
   //      itself. This guarantees that all allocated cells will be freed but it might
   //      render other cell pools unusable so they also have to be destroyed.
-  for(int i=0; i<NUM_GRIDS; i++) cellpool_destroy(&pools[i]);
+  if(!useSoA)
+    for(int i=0; i<NUM_GRIDS; i++) cellpool_destroy(&pools[i]);
   pthread_attr_destroy(&attr);
 
   for(int i = 0; i < numCells; ++i)
-  {
-    assert(CELL_MUTEX_ID < MUTEXES_PER_CELL);
-    int n = (border[i] ? MUTEXES_PER_CELL : CELL_MUTEX_ID+1);
-    for(int j = 0; j < n; ++j)
-      pthread_mutex_destroy(&mutex[i][j]);
-    delete[] mutex[i];
-  }
+    pthread_mutex_destroy(&mutex[i]);
   delete[] mutex;
-  pthread_barrier_destroy(&barrier);
 #ifdef ENABLE_VISUALIZATION
   pthread_barrier_destroy(&visualization_barrier);
 #endif
 
   delete[] border;
+  delete[] owner;
+  delete[] nearThreads;
+  delete[] numNear;
+  delete[] allThreads;
+  AlignedFree(progress);
+  if(useSoA) {
+    FreeParticleArrays(&pars);
+    FreeParticleArrays(&pars2);
+    AlignedFree(cellStart);
+    AlignedFree(cellStart2);
+    AlignedFree(moveDir);
+    AlignedFree(moveOffset);
+    AlignedFree(localStart);
+    delete[] threadCount;
+    delete[] threadStarts;
+    for(int t = 0; t < NUM_GRIDS; ++t)
+      FreeNeighborBuffer(&neighBufs[t]);
+    delete[] neighBufs;
+  }
 
 #if defined(WIN32)
   _aligned_free(cells);
@@ -515,25 +1266,17 @@ void CleanUpSim()
 #endif
   delete[] thread;
   delete[] grids;
+  delete[] ZDIVS;
+  delete[] tstats;
+  delete[] cpus;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ClearParticlesMT(int tid)
-{
-  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
-    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
-      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
-      {
-        int index = (iz*ny + iy)*nx + ix;
-        cnumPars[index] = 0;
-		cells[index].next = NULL;
-        last_cells[index] = &cells[index];
-      }
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
+// Moves the particles of the partition of thread tid from cells2 into their new
+// cells, initializing their densities and accelerations on the way. The source
+// cells are emptied right after, so after the swap of the next frame the
+// destination grid is empty without a separate clearing pass.
 void RebuildGridMT(int tid)
 {
   // Note, in parallel versions the below swaps
@@ -600,25 +1343,27 @@ void RebuildGridMT(int tid)
           int index = (ck*ny + cj)*nx + ci;
           // this assumes that particles cannot travel more than one grid cell per time step
           if(border[index])
-            pthread_mutex_lock(&mutex[index][CELL_MUTEX_ID]);
-          Cell *cell = last_cells[index];
+            pthread_mutex_lock(&mutex[index]);
           int np = cnumPars[index];
+          Cell *cell = np == 0 ? &cells[index] : last_cells[index];
 
           //add another cell structure if everything full
           if( (np % PARTICLES_PER_CELL == 0) && (cnumPars[index] != 0) ) {
             cell->next = cellpool_getcell(&pools[tid]);
             cell = cell->next;
-            last_cells[index] = cell;
           }
+          last_cells[index] = cell;
           ++cnumPars[index];
           if(border[index])
-            pthread_mutex_unlock(&mutex[index][CELL_MUTEX_ID]);
+            pthread_mutex_unlock(&mutex[index]);
 
           //copy source to destination particle
           
           cell->p[np % PARTICLES_PER_CELL]  = cell2->p[j % PARTICLES_PER_CELL];
           cell->hv[np % PARTICLES_PER_CELL] = cell2->hv[j % PARTICLES_PER_CELL];
           cell->v[np % PARTICLES_PER_CELL]  = cell2->v[j % PARTICLES_PER_CELL];
+          cell->density[np % PARTICLES_PER_CELL] = 0.0;
+          cell->a[np % PARTICLES_PER_CELL] = externalAcceleration;
           //move pointer to next source cell in list if end of array is reached
           if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
             Cell *temp = cell2;
@@ -634,6 +1379,8 @@ void RebuildGridMT(int tid)
         if((cell2 != NULL) && (cell2 != &cells2[index2])) {
           cellpool_returncell(&pools[tid], cell2);
     }
+        cells2[index2].next = NULL;
+        cnumPars2[index2] = 0;
       }
 }
 
@@ -670,25 +1417,61 @@ int InitNeighCellList(int ci, int cj, int ck, int *neighCells)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void InitDensitiesAndForcesMT(int tid)
+// Neighbor list of a cell in the partition of thread tid. Its first *numLocal
+// entries are the cell itself and its neighbors in the same partition with a lower
+// index, as in InitNeighCellList; pairs with them are visited once and update both
+// particles. The remaining entries are all neighbors in other partitions; pairs with
+// them only update the particle of this thread because the thread owning the
+// neighbor visits the same pair from its side. No two threads ever write to the
+// same particle, so the pair loops need no locks.
+int InitNeighCellListMT(int tid, int ci, int cj, int ck, int *neighCells, int *numLocal)
 {
-  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
-    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
-      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+  int my_index = (ck*ny + cj)*nx + ci;
+  if(!border[my_index])
+  {
+    *numLocal = InitNeighCellList(ci, cj, ck, neighCells);
+    return *numLocal;
+  }
+
+  int numNeighCells = 0;
+  int numRemote = 0;
+  int remoteCells[3*3*3];
+
+  neighCells[numNeighCells] = my_index;
+  ++numNeighCells;
+
+  for(int di = -1; di <= 1; ++di)
+    for(int dj = -1; dj <= 1; ++dj)
+      for(int dk = -1; dk <= 1; ++dk)
       {
-                    int index = (iz*ny + iy)*nx + ix;
-        Cell *cell = &cells[index];
-        int np = cnumPars[index];
-        for(int j = 0; j < np; ++j)
+        int ii = ci + di;
+        int jj = cj + dj;
+        int kk = ck + dk;
+        if(ii >= 0 && ii < nx && jj >= 0 && jj < ny && kk >= 0 && kk < nz)
         {
-          cell->density[j % PARTICLES_PER_CELL] = 0.0;
-          cell->a[j % PARTICLES_PER_CELL] = externalAcceleration;
-          //move pointer to next cell in list if end of array is reached
-          if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
-            cell = cell->next;
+          int index = (kk*ny + jj)*nx + ii;
+          if(cnumPars[index] == 0)
+            continue;
+          bool local = ii >= grids[tid].sx && ii < grids[tid].ex &&
+                       jj >= grids[tid].sy && jj < grids[tid].ey &&
+                       kk >= grids[tid].sz && kk < grids[tid].ez;
+          if(local && index < my_index)
+          {
+            neighCells[numNeighCells] = index;
+            ++numNeighCells;
+          }
+          else if(!local)
+          {
+            remoteCells[numRemote] = index;
+            ++numRemote;
           }
         }
       }
+
+  *numLocal = numNeighCells;
+  for(int i = 0; i < numRemote; ++i)
+    neighCells[numNeighCells++] = remoteCells[i];
+  return numNeighCells;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -706,7 +1489,8 @@ void ComputeDensitiesMT(int tid)
         if(np == 0)
           continue;
 
-        int numNeighCells = InitNeighCellList(ix, iy, iz, neighCells);
+        int numLocal;
+        int numNeighCells = InitNeighCellListMT(tid, ix, iy, iz, neighCells, &numLocal);
 
         Cell *cell = &cells[index];
         for(int ipar = 0; ipar < np; ++ipar)
@@ -714,12 +1498,14 @@ void ComputeDensitiesMT(int tid)
           for(int inc = 0; inc < numNeighCells; ++inc)
           {
             int indexNeigh = neighCells[inc];
+            bool local = inc < numLocal;
             Cell *neigh = &cells[indexNeigh];
             int numNeighPars = cnumPars[indexNeigh];
             for(int iparNeigh = 0; iparNeigh < numNeighPars; ++iparNeigh)
             {
-              //Check address to make sure densities are computed only once per pair
-              if(&neigh->p[iparNeigh % PARTICLES_PER_CELL] < &cell->p[ipar % PARTICLES_PER_CELL])
+              //Check address to make sure densities are computed only once per pair,
+              //pairs with other partitions are computed once from each side
+              if(!local || &neigh->p[iparNeigh % PARTICLES_PER_CELL] < &cell->p[ipar % PARTICLES_PER_CELL])
               {
                 fptype distSq = (cell->p[ipar % PARTICLES_PER_CELL] - neigh->p[iparNeigh % PARTICLES_PER_CELL]).GetLengthSq();
                 if(distSq < hSq)
@@ -727,22 +1513,8 @@ void ComputeDensitiesMT(int tid)
                   fptype t = hSq - distSq;
                   fptype tc = t*t*t;
 
-                  if(border[index])
-                  {
-                    pthread_mutex_lock(&mutex[index][ipar % MUTEXES_PER_CELL]);
-                    cell->density[ipar % PARTICLES_PER_CELL] += tc;
-                    pthread_mutex_unlock(&mutex[index][ipar % MUTEXES_PER_CELL]);
-                  }
-                  else
-                    cell->density[ipar % PARTICLES_PER_CELL] += tc;
-
-                  if(border[indexNeigh])
-                  {
-                    pthread_mutex_lock(&mutex[indexNeigh][iparNeigh % MUTEXES_PER_CELL]);
-                    neigh->density[iparNeigh % PARTICLES_PER_CELL] += tc;
-                    pthread_mutex_unlock(&mutex[indexNeigh][iparNeigh % MUTEXES_PER_CELL]);
-                  }
-                  else
+                  cell->density[ipar % PARTICLES_PER_CELL] += tc;
+                  if(local)
                     neigh->density[iparNeigh % PARTICLES_PER_CELL] += tc;
                 }
               }
@@ -762,8 +1534,11 @@ void ComputeDensitiesMT(int tid)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ComputeDensities2MT(int tid)
+//Only touches the particles of the thread, so it directly follows ComputeDensitiesMT.
+//Returns the number of particles in the partition of the thread.
+int ComputeDensities2MT(int tid)
 {
+  int count = 0;
   const fptype tc = hSq*hSq*hSq;
   for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
     for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
@@ -781,7 +1556,9 @@ void ComputeDensities2MT(int tid)
             cell = cell->next;
           }
         }
+        count += np;
       }
+  return count;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -799,7 +1576,8 @@ void ComputeForcesMT(int tid)
         if(np == 0)
           continue;
 
-        int numNeighCells = InitNeighCellList(ix, iy, iz, neighCells);
+        int numLocal;
+        int numNeighCells = InitNeighCellListMT(tid, ix, iy, iz, neighCells, &numLocal);
 
         Cell *cell = &cells[index];
         for(int ipar = 0; ipar < np; ++ipar)
@@ -807,12 +1585,14 @@ void ComputeForcesMT(int tid)
           for(int inc = 0; inc < numNeighCells; ++inc)
           {
             int indexNeigh = neighCells[inc];
+            bool local = inc < numLocal;
             Cell *neigh = &cells[indexNeigh];
             int numNeighPars = cnumPars[indexNeigh];
             for(int iparNeigh = 0; iparNeigh < numNeighPars; ++iparNeigh)
             {
-              //Check address to make sure forces are computed only once per pair
-              if(&neigh->p[iparNeigh % PARTICLES_PER_CELL] < &cell->p[ipar % PARTICLES_PER_CELL])
+              //Check address to make sure forces are computed only once per pair,
+              //pairs with other partitions are computed once from each side
+              if(!local || &neigh->p[iparNeigh % PARTICLES_PER_CELL] < &cell->p[ipar % PARTICLES_PER_CELL])
               {
                 Vec3 disp = cell->p[ipar % PARTICLES_PER_CELL] - neigh->p[iparNeigh % PARTICLES_PER_CELL];
                 fptype distSq = disp.GetLengthSq();
@@ -829,22 +1609,8 @@ void ComputeForcesMT(int tid)
                   acc += (neigh->v[iparNeigh % PARTICLES_PER_CELL] - cell->v[ipar % PARTICLES_PER_CELL]) * viscosityCoeff * hmr;
                   acc /= cell->density[ipar % PARTICLES_PER_CELL] * neigh->density[iparNeigh % PARTICLES_PER_CELL];
 
-                  if( border[index])
-                  {
-                    pthread_mutex_lock(&mutex[index][ipar % MUTEXES_PER_CELL]);
-                    cell->a[ipar % PARTICLES_PER_CELL] += acc;
-                    pthread_mutex_unlock(&mutex[index][ipar % MUTEXES_PER_CELL]);
-                  }
-                  else
-                    cell->a[ipar % PARTICLES_PER_CELL] += acc;
-
-                  if( border[indexNeigh])
-                  {
-                    pthread_mutex_lock(&mutex[indexNeigh][iparNeigh % MUTEXES_PER_CELL]);
-                    neigh->a[iparNeigh % PARTICLES_PER_CELL] -= acc;
-                    pthread_mutex_unlock(&mutex[indexNeigh][iparNeigh % MUTEXES_PER_CELL]);
-                  }
-                  else
+                  cell->a[ipar % PARTICLES_PER_CELL] += acc;
+                  if(local)
                     neigh->a[iparNeigh % PARTICLES_PER_CELL] -= acc;
                 }
               }
@@ -916,176 +1682,166 @@ void ProcessCollisionsMT(int tid)
       }
 }
 #else
-void ProcessCollisionsMT(int tid)
+//Collisions of the particles of cell (ix, iy, iz) with the walls
+static inline void ProcessCollisionsCell(int ix, int iy, int iz)
 {
-  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+  if(!((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1))))
+    return;	// not on domain wall
+  int index = (iz*ny + iy)*nx + ix;
+  Cell *cell = &cells[index];
+  int np = cnumPars[index];
+  for(int j = 0; j < np; ++j)
   {
-    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
-	{
-      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
-      {
-	    if(!((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1))))
-			continue;	// not on domain wall
-        int index = (iz*ny + iy)*nx + ix;
-        Cell *cell = &cells[index];
-        int np = cnumPars[index];
-        for(int j = 0; j < np; ++j)
-        {
-		  int ji = j % PARTICLES_PER_CELL;
-          Vec3 pos = cell->p[ji] + cell->hv[ji] * timeStep;
-
-		  if(ix==0)
-		  {
-            fptype diff = parSize - (pos.x - domainMin.x);
-		    if(diff > epsilon)
-              cell->a[ji].x += stiffnessCollisions*diff - damping*cell->v[ji].x;
-		  }
-		  if(ix==(nx-1))
-		  {
-            fptype diff = parSize - (domainMax.x - pos.x);
-            if(diff > epsilon)
-              cell->a[ji].x -= stiffnessCollisions*diff + damping*cell->v[ji].x;
-		  }
-		  if(iy==0)
-		  {
-            fptype diff = parSize - (pos.y - domainMin.y);
-            if(diff > epsilon)
-              cell->a[ji].y += stiffnessCollisions*diff - damping*cell->v[ji].y;
-		  }
-		  if(iy==(ny-1))
-		  {
-            fptype diff = parSize - (domainMax.y - pos.y);
-            if(diff > epsilon)
-              cell->a[ji].y -= stiffnessCollisions*diff + damping*cell->v[ji].y;
-		  }
-		  if(iz==0)
-		  {
-            fptype diff = parSize - (pos.z - domainMin.z);
-            if(diff > epsilon)
-              cell->a[ji].z += stiffnessCollisions*diff - damping*cell->v[ji].z;
-		  }
-		  if(iz==(nz-1))
-		  {
-            fptype diff = parSize - (domainMax.z - pos.z);
-            if(diff > epsilon)
-              cell->a[ji].z -= stiffnessCollisions*diff + damping*cell->v[ji].z;
-		  }
-          //move pointer to next cell in list if end of array is reached
-          if(ji == PARTICLES_PER_CELL-1) {
-            cell = cell->next;
-          }
-        }
-      }
-	}
+    int ji = j % PARTICLES_PER_CELL;
+    Vec3 pos = cell->p[ji] + cell->hv[ji] * timeStep;
+
+    if(ix==0)
+    {
+      fptype diff = parSize - (pos.x - domainMin.x);
+      if(diff > epsilon)
+        cell->a[ji].x += stiffnessCollisions*diff - damping*cell->v[ji].x;
+    }
+    if(ix==(nx-1))
+    {
+      fptype diff = parSize - (domainMax.x - pos.x);
+      if(diff > epsilon)
+        cell->a[ji].x -= stiffnessCollisions*diff + damping*cell->v[ji].x;
+    }
+    if(iy==0)
+    {
+      fptype diff = parSize - (pos.y - domainMin.y);
+      if(diff > epsilon)
+        cell->a[ji].y += stiffnessCollisions*diff - damping*cell->v[ji].y;
+    }
+    if(iy==(ny-1))
+    {
+      fptype diff = parSize - (domainMax.y - pos.y);
+      if(diff > epsilon)
+        cell->a[ji].y -= stiffnessCollisions*diff + damping*cell->v[ji].y;
+    }
+    if(iz==0)
+    {
+      fptype diff = parSize - (pos.z - domainMin.z);
+      if(diff > epsilon)
+        cell->a[ji].z += stiffnessCollisions*diff - damping*cell->v[ji].z;
+    }
+    if(iz==(nz-1))
+    {
+      fptype diff = parSize - (domainMax.z - pos.z);
+      if(diff > epsilon)
+        cell->a[ji].z -= stiffnessCollisions*diff + damping*cell->v[ji].z;
+    }
+    //move pointer to next cell in list if end of array is reached
+    if(ji == PARTICLES_PER_CELL-1) {
+      cell = cell->next;
+    }
   }
 }
 #endif
 
 #define USE_ImpeneratableWall
 #if defined(USE_ImpeneratableWall)
-void ProcessCollisions2MT(int tid)
+//Reflects the particles of cell (ix, iy, iz) that left the domain
+static inline void ProcessCollisions2Cell(int ix, int iy, int iz)
 {
-  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
-  {
-    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
-	{
-      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
-      {
 #if 0
 // Chris, the following test should be valid
 // *** provided that a particle does not migrate more than 1 cell
 // *** per integration step. This does not appear to be the case
 // *** in the pthreads version. Serial version it seems to be OK
-	    if(!((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1))))
-			continue;	// not on domain wall
+  if(!((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1))))
+    return;	// not on domain wall
 #endif
-        int index = (iz*ny + iy)*nx + ix;
-        Cell *cell = &cells[index];
-        int np = cnumPars[index];
-        for(int j = 0; j < np; ++j)
-        {
-		  int ji = j % PARTICLES_PER_CELL;
-          Vec3 pos = cell->p[ji];
-
-		  if(ix==0)
-		  {
-            fptype diff = pos.x - domainMin.x;
-		    if(diff < Zero)
-			{
-				cell->p[ji].x = domainMin.x - diff;
-				cell->v[ji].x = -cell->v[ji].x;
-				cell->hv[ji].x = -cell->hv[ji].x;
-			}
-		  }
-		  if(ix==(nx-1))
-		  {
-            fptype diff = domainMax.x - pos.x;
- 			if(diff < Zero)
-			{
-				cell->p[ji].x = domainMax.x + diff;
-				cell->v[ji].x = -cell->v[ji].x;
-				cell->hv[ji].x = -cell->hv[ji].x;
-			}
-		  }
-		  if(iy==0)
-		  {
-            fptype diff = pos.y - domainMin.y;
-		    if(diff < Zero)
-			{
-				cell->p[ji].y = domainMin.y - diff;
-				cell->v[ji].y = -cell->v[ji].y;
-				cell->hv[ji].y = -cell->hv[ji].y;
-			}
-		  }
-		  if(iy==(ny-1))
-		  {
-            fptype diff = domainMax.y - pos.y;
- 			if(diff < Zero)
-			{
-				cell->p[ji].y = domainMax.y + diff;
-				cell->v[ji].y = -cell->v[ji].y;
-				cell->hv[ji].y = -cell->hv[ji].y;
-			}
-		  }
-		  if(iz==0)
-		  {
-            fptype diff = pos.z - domainMin.z;
-		    if(diff < Zero)
-			{
-				cell->p[ji].z = domainMin.z - diff;
-				cell->v[ji].z = -cell->v[ji].z;
-				cell->hv[ji].z = -cell->hv[ji].z;
-			}
-		  }
-		  if(iz==(nz-1))
-		  {
-            fptype diff = domainMax.z - pos.z;
- 			if(diff < Zero)
-			{
-				cell->p[ji].z = domainMax.z + diff;
-				cell->v[ji].z = -cell->v[ji].z;
-				cell->hv[ji].z = -cell->hv[ji].z;
-			}
-		  }
-          //move pointer to next cell in list if end of array is reached
-          if(ji == PARTICLES_PER_CELL-1) {
-            cell = cell->next;
-          }
-        }
+  int index = (iz*ny + iy)*nx + ix;
+  Cell *cell = &cells[index];
+  int np = cnumPars[index];
+  for(int j = 0; j < np; ++j)
+  {
+    int ji = j % PARTICLES_PER_CELL;
+    Vec3 pos = cell->p[ji];
+
+    if(ix==0)
+    {
+      fptype diff = pos.x - domainMin.x;
+      if(diff < Zero)
+      {
+        cell->p[ji].x = domainMin.x - diff;
+        cell->v[ji].x = -cell->v[ji].x;
+        cell->hv[ji].x = -cell->hv[ji].x;
       }
-	}
+    }
+    if(ix==(nx-1))
+    {
+      fptype diff = domainMax.x - pos.x;
+      if(diff < Zero)
+      {
+        cell->p[ji].x = domainMax.x + diff;
+        cell->v[ji].x = -cell->v[ji].x;
+        cell->hv[ji].x = -cell->hv[ji].x;
+      }
+    }
+    if(iy==0)
+    {
+      fptype diff = pos.y - domainMin.y;
+      if(diff < Zero)
+      {
+        cell->p[ji].y = domainMin.y - diff;
+        cell->v[ji].y = -cell->v[ji].y;
+        cell->hv[ji].y = -cell->hv[ji].y;
+      }
+    }
+    if(iy==(ny-1))
+    {
+      fptype diff = domainMax.y - pos.y;
+      if(diff < Zero)
+      {
+        cell->p[ji].y = domainMax.y + diff;
+        cell->v[ji].y = -cell->v[ji].y;
+        cell->hv[ji].y = -cell->hv[ji].y;
+      }
+    }
+    if(iz==0)
+    {
+      fptype diff = pos.z - domainMin.z;
+      if(diff < Zero)
+      {
+        cell->p[ji].z = domainMin.z - diff;
+        cell->v[ji].z = -cell->v[ji].z;
+        cell->hv[ji].z = -cell->hv[ji].z;
+      }
+    }
+    if(iz==(nz-1))
+    {
+      fptype diff = domainMax.z - pos.z;
+      if(diff < Zero)
+      {
+        cell->p[ji].z = domainMax.z + diff;
+        cell->v[ji].z = -cell->v[ji].z;
+        cell->hv[ji].z = -cell->hv[ji].z;
+      }
+    }
+    //move pointer to next cell in list if end of array is reached
+    if(ji == PARTICLES_PER_CELL-1) {
+      cell = cell->next;
+    }
   }
 }
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void AdvanceParticlesMT(int tid)
+// Wall collisions, integration and, with USE_ImpeneratableWall, reflection of
+// the particles that left the domain, in one sweep over the cells of the
+// thread. All three only touch the particles of the cell at hand. If chunk is
+// not NULL the final state of the particles is also copied to it.
+void AdvanceParticlesMT(int tid, snapshot_chunk *chunk)
 {
   for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
     for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
       for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
       {
+        ProcessCollisionsCell(ix, iy, iz);
+
         int index = (iz*ny + iy)*nx + ix;
         Cell *cell = &cells[index];
         int np = cnumPars[index];
@@ -1111,52 +1867,540 @@ void AdvanceParticlesMT(int tid)
             cell = cell->next;
           }
         }
+
+#if defined(USE_ImpeneratableWall)
+        // N.B. The integration of the position can place the particle
+        // outside the domain. We now make a pass on the perimiter cells
+        // to account for particle migration beyond domain.
+        ProcessCollisions2Cell(ix, iy, iz);
+#endif
+        if(chunk)
+          SnapshotCell(chunk, index);
+      }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Structure-of-arrays storage (--soa)
+//
+// Instead of Cell lists the particles are kept in flat arrays, one per component,
+// sorted by cell. The particles of cell i are [cellStart[i], cellStart[i]+cnumPars[i]).
+// The cells of each thread are stored together, in the order in which the thread
+// visits them, so that every thread owns one contiguous range of particles.
+//
+// The arrays are rebuilt every frame by a counting sort from the arrays of the
+// previous frame (pars2):
+//   1. every thread finds the direction in which each of its particles moves (at
+//      most one cell, as in RebuildGridMT) and counts the particles moving in
+//      each of the 27 directions out of each of its cells
+//   2. every thread turns the counts of the cells moving into its cells into
+//      offsets, which also yields the size of its cells and of its range
+//   3. every thread moves its particles to their new places
+// Inside a cell the particles stay sorted by the index of the cell they came
+// from and by their previous order. This order, and with it the result, does
+// not depend on the number of threads.
+//
+// The density and force kernels visit all pairs of a particle with its
+// neighbors (including itself, which adds the self density and a zero force)
+// and only update that particle. They do twice the arithmetic of the pair
+// loops above but read contiguous arrays, never write to other particles
+// and vectorize.
+
+//Wall test of ProcessCollisionsMT, kept identical so both storage modes agree
+static inline bool OnCollisionWall(int ix, int iy, int iz)
+{
+  return ((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1)));
+}
+
+//Direction of a move by (di, dj, dk) cells, each in [-1, 1]
+static inline int MoveDir(int di, int dj, int dk)
+{
+  return ((dk+1)*3 + (dj+1))*3 + (di+1);
+}
+
+void SortParticlesSoAMT(int tid)
+{
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index2 = (iz*ny + iy)*nx + ix;
+        int *moves = &moveOffset[index2 * MOVE_DIRS];
+        for(int d = 0; d < MOVE_DIRS; ++d)
+          moves[d] = 0;
+        int end = cellStart2[index2] + cnumPars2[index2];
+        for(int j = cellStart2[index2]; j < end; ++j)
+        {
+          //get destination for source particle
+          int ci = (int)((pars2.px[j] - domainMin.x) / delta.x);
+          int cj = (int)((pars2.py[j] - domainMin.y) / delta.y);
+          int ck = (int)((pars2.pz[j] - domainMin.z) / delta.z);
+
+          if(ci < 0) ci = 0; else if(ci > (nx-1)) ci = nx-1;
+          if(cj < 0) cj = 0; else if(cj > (ny-1)) cj = ny-1;
+          if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
+
+#ifdef ENABLE_CFL_CHECK
+          if(abs(ci-ix) > 1 || abs(cj-iy) > 1 || abs(ck-iz) > 1)
+          {
+            std::cerr << "FATAL ERROR: Courant–Friedrichs–Lewy condition not satisfied." << std::endl;
+            exit(1);
+          }
+#endif //ENABLE_CFL_CHECK
+          //a particle that moved further than one cell is kept in the nearest neighbor cell
+          int di = ci > ix ? 1 : (ci < ix ? -1 : 0);
+          int dj = cj > iy ? 1 : (cj < iy ? -1 : 0);
+          int dk = ck > iz ? 1 : (ck < iz ? -1 : 0);
+          int dir = MoveDir(di, dj, dk);
+          moveDir[j] = (unsigned char)dir;
+          ++moves[dir];
+        }
+      }
+}
+
+//returns the number of particles in the partition of the thread
+int CountParticlesSoAMT(int tid)
+{
+  int count = 0;
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index = (iz*ny + iy)*nx + ix;
+        int np = 0;
+        //source cells in a fixed order
+        for(int dk = -1; dk <= 1; ++dk)
+          for(int dj = -1; dj <= 1; ++dj)
+            for(int di = -1; di <= 1; ++di)
+            {
+              int si = ix - di;
+              int sj = iy - dj;
+              int sk = iz - dk;
+              if(si < 0 || si >= nx || sj < 0 || sj >= ny || sk < 0 || sk >= nz)
+                continue;
+              int *moves = &moveOffset[((sk*ny + sj)*nx + si) * MOVE_DIRS + MoveDir(di, dj, dk)];
+              int n = *moves;
+              *moves = np;
+              np += n;
+            }
+        cnumPars[index] = np;
+        localStart[index] = count;
+        count += np;
+      }
+  threadCount[tid] = count;
+  return count;
+}
+
+//Also initializes the accelerations, the densities are set by ComputeDensitiesSoAMT
+void MoveParticlesSoAMT(int tid)
+{
+  //start of the range of every thread
+  int *starts = &threadStarts[tid * NUM_GRIDS];
+  int start = 0;
+  for(int i = 0; i < NUM_GRIDS; ++i)
+  {
+    starts[i] = start;
+    start += threadCount[i];
+  }
+
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index2 = (iz*ny + iy)*nx + ix;
+        cellStart[index2] = starts[tid] + localStart[index2];
+
+        int *moves = &moveOffset[index2 * MOVE_DIRS];
+        int end = cellStart2[index2] + cnumPars2[index2];
+        for(int j = cellStart2[index2]; j < end; ++j)
+        {
+          int dir = moveDir[j];
+          int di = dir % 3 - 1;
+          int dj = (dir / 3) % 3 - 1;
+          int dk = dir / 9 - 1;
+          int index = ((iz+dk)*ny + (iy+dj))*nx + (ix+di);
+          int k = starts[owner[index]] + localStart[index] + moves[dir]++;
+
+          pars.px[k]  = pars2.px[j];
+          pars.py[k]  = pars2.py[j];
+          pars.pz[k]  = pars2.pz[j];
+          pars.hvx[k] = pars2.hvx[j];
+          pars.hvy[k] = pars2.hvy[j];
+          pars.hvz[k] = pars2.hvz[j];
+          pars.vx[k]  = pars2.vx[j];
+          pars.vy[k]  = pars2.vy[j];
+          pars.vz[k]  = pars2.vz[j];
+          pars.ax[k]  = externalAcceleration.x;
+          pars.ay[k]  = externalAcceleration.y;
+          pars.az[k]  = externalAcceleration.z;
+        }
+      }
+}
+
+//Particle ranges of the non-empty cells around (ci, cj, ck), in a fixed order
+int InitNeighRangesSoA(int ci, int cj, int ck, int *first, int *last)
+{
+  int numNeighCells = 0;
+  for(int dk = -1; dk <= 1; ++dk)
+    for(int dj = -1; dj <= 1; ++dj)
+      for(int di = -1; di <= 1; ++di)
+      {
+        int ii = ci + di;
+        int jj = cj + dj;
+        int kk = ck + dk;
+        if(ii >= 0 && ii < nx && jj >= 0 && jj < ny && kk >= 0 && kk < nz)
+        {
+          int index = (kk*ny + jj)*nx + ii;
+          if(cnumPars[index] != 0)
+          {
+            first[numNeighCells] = cellStart[index];
+            last[numNeighCells] = cellStart[index] + cnumPars[index];
+            ++numNeighCells;
+          }
+        }
+      }
+  return numNeighCells;
+}
+
+//Copies the particles of the neighbor cells of (ci, cj, ck) into the neighbor buffer of
+//thread tid and returns their number. The density phase only needs the positions.
+int GatherNeighborsSoA(int tid, int ci, int cj, int ck, bool forces)
+{
+  int first[3*3*3], last[3*3*3];
+  int numNeighCells = InitNeighRangesSoA(ci, cj, ck, first, last);
+  int count = 0;
+  for(int inc = 0; inc < numNeighCells; ++inc)
+    count += last[inc] - first[inc];
+
+  NeighborBuffer &buf = neighBufs[tid];
+  if(count > buf.capacity)
+  {
+    FreeNeighborBuffer(&buf);
+    AllocNeighborBuffer(&buf, std::max(count, 2*buf.capacity));
+  }
+
+  const fptype *src[] = { pars.px, pars.py, pars.pz, pars.vx, pars.vy, pars.vz, pars.density };
+  fptype *dst[] = { buf.px, buf.py, buf.pz, buf.vx, buf.vy, buf.vz, buf.density };
+  int numFields = forces ? 7 : 3;
+  int k = 0;
+  for(int inc = 0; inc < numNeighCells; ++inc)
+  {
+    int n = last[inc] - first[inc];
+    for(int f = 0; f < numFields; ++f)
+      memcpy(dst[f] + k, src[f] + first[inc], n * sizeof(fptype));
+    k += n;
+  }
+  return count;
+}
+
+//Final densities, including the self density hSq^3 and the factor of ComputeDensities2MT
+void ComputeDensitiesSoAMT(int tid)
+{
+  NeighborArrays p = { pars.px, pars.py, pars.pz, pars.vx, pars.vy, pars.vz, pars.density };
+  const NeighborBuffer &buf = neighBufs[tid];
+
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index = (iz*ny + iy)*nx + ix;
+        int np = cnumPars[index];
+        if(np == 0)
+          continue;
+
+        int count = GatherNeighborsSoA(tid, ix, iy, iz, false);
+        NeighborArrays n = { buf.px, buf.py, buf.pz, buf.vx, buf.vy, buf.vz, buf.density };
+        int end = cellStart[index] + np;
+        for(int i = cellStart[index]; i < end; ++i)
+          pars.density[i] = DensityKernel(p, i, n, count, hSq) * densityCoeff;
+      }
+}
+
+void ComputeForcesSoAMT(int tid)
+{
+  NeighborArrays p = { pars.px, pars.py, pars.pz, pars.vx, pars.vy, pars.vz, pars.density };
+  ForceCoeffs c = { h, hSq, pressureCoeff, viscosityCoeff, doubleRestDensity };
+  const NeighborBuffer &buf = neighBufs[tid];
+
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index = (iz*ny + iy)*nx + ix;
+        int np = cnumPars[index];
+        if(np == 0)
+          continue;
+
+        int count = GatherNeighborsSoA(tid, ix, iy, iz, true);
+        NeighborArrays n = { buf.px, buf.py, buf.pz, buf.vx, buf.vy, buf.vz, buf.density };
+        int end = cellStart[index] + np;
+        for(int i = cellStart[index]; i < end; ++i)
+          ForceKernel(p, i, n, count, c, &pars.ax[i], &pars.ay[i], &pars.az[i]);
+      }
+}
+
+//Collisions of particle j in cell (ix, iy, iz) with the walls
+static inline void ProcessCollisionsSoA(int j, int ix, int iy, int iz)
+{
+  fptype posx = pars.px[j] + pars.hvx[j] * timeStep;
+  fptype posy = pars.py[j] + pars.hvy[j] * timeStep;
+  fptype posz = pars.pz[j] + pars.hvz[j] * timeStep;
+
+  if(ix==0)
+  {
+    fptype diff = parSize - (posx - domainMin.x);
+    if(diff > epsilon)
+      pars.ax[j] += stiffnessCollisions*diff - damping*pars.vx[j];
+  }
+  if(ix==(nx-1))
+  {
+    fptype diff = parSize - (domainMax.x - posx);
+    if(diff > epsilon)
+      pars.ax[j] -= stiffnessCollisions*diff + damping*pars.vx[j];
+  }
+  if(iy==0)
+  {
+    fptype diff = parSize - (posy - domainMin.y);
+    if(diff > epsilon)
+      pars.ay[j] += stiffnessCollisions*diff - damping*pars.vy[j];
+  }
+  if(iy==(ny-1))
+  {
+    fptype diff = parSize - (domainMax.y - posy);
+    if(diff > epsilon)
+      pars.ay[j] -= stiffnessCollisions*diff + damping*pars.vy[j];
+  }
+  if(iz==0)
+  {
+    fptype diff = parSize - (posz - domainMin.z);
+    if(diff > epsilon)
+      pars.az[j] += stiffnessCollisions*diff - damping*pars.vz[j];
+  }
+  if(iz==(nz-1))
+  {
+    fptype diff = parSize - (domainMax.z - posz);
+    if(diff > epsilon)
+      pars.az[j] -= stiffnessCollisions*diff + damping*pars.vz[j];
+  }
+}
+
+//Reflects a particle that left the domain through the wall at lo or hi
+static inline void ReflectSoA(fptype *p, fptype *v, fptype *hv, bool atLo, bool atHi, fptype lo, fptype hi)
+{
+  if(atLo)
+  {
+    fptype diff = *p - lo;
+    if(diff < Zero)
+    {
+      *p = lo - diff;
+      *v = -*v;
+      *hv = -*hv;
+    }
+  }
+  if(atHi)
+  {
+    fptype diff = hi - *p;
+    if(diff < Zero)
+    {
+      *p = hi + diff;
+      *v = -*v;
+      *hv = -*hv;
+    }
+  }
+}
+
+//Wall collisions, integration, reflections and the snapshot copy in one sweep, as in AdvanceParticlesMT
+void AdvanceParticlesSoAMT(int tid, snapshot_chunk *chunk)
+{
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index = (iz*ny + iy)*nx + ix;
+        bool collisions = OnCollisionWall(ix, iy, iz);
+#if defined(USE_ImpeneratableWall)
+        bool reflections = ix == 0 || iy == 0 || iz == 0 || ix == nx-1 || iy == ny-1 || iz == nz-1;
+#endif
+        int end = cellStart[index] + cnumPars[index];
+        for(int j = cellStart[index]; j < end; ++j)
+        {
+          if(collisions)
+            ProcessCollisionsSoA(j, ix, iy, iz);
+
+          fptype hx = pars.hvx[j] + pars.ax[j]*timeStep;
+          fptype hy = pars.hvy[j] + pars.ay[j]*timeStep;
+          fptype hz = pars.hvz[j] + pars.az[j]*timeStep;
+          pars.px[j] += hx * timeStep;
+          pars.py[j] += hy * timeStep;
+          pars.pz[j] += hz * timeStep;
+          pars.vx[j] = (pars.hvx[j] + hx) * (fptype)0.5;
+          pars.vy[j] = (pars.hvy[j] + hy) * (fptype)0.5;
+          pars.vz[j] = (pars.hvz[j] + hz) * (fptype)0.5;
+          pars.hvx[j] = hx;
+          pars.hvy[j] = hy;
+          pars.hvz[j] = hz;
+
+#if defined(USE_ImpeneratableWall)
+          if(reflections)
+          {
+            ReflectSoA(&pars.px[j], &pars.vx[j], &pars.hvx[j], ix==0, ix==(nx-1), domainMin.x, domainMax.x);
+            ReflectSoA(&pars.py[j], &pars.vy[j], &pars.hvy[j], iy==0, iy==(ny-1), domainMin.y, domainMax.y);
+            ReflectSoA(&pars.pz[j], &pars.vz[j], &pars.hvz[j], iz==0, iz==(nz-1), domainMin.z, domainMax.z);
+          }
+#endif
+        }
+        if(chunk)
+          SnapshotCell(chunk, index);
       }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void AdvanceFrameMT(int tid)
+//Progress counter value of a step of a frame
+static inline int StepId(int frame, int step)
 {
+  return frame*NUM_STEPS + step + 1;
+}
+
+static inline void ReportProgressMT(int tid, int frame, int step)
+{
+  progress[tid].step.store(StepId(frame, step), std::memory_order_release);
+}
+
+//Waits until the given threads reached a step of a frame, keeps track of the time
+//the thread was busy
+static inline void WaitForThreadsMT(int tid, int frame, int step, const int *threads, int n)
+{
+  int parity = frame & 1;
+  int id = StepId(frame, step);
+  double now = WallTime();
+  tstats[tid].busy[parity] += now - tstats[tid].mark;
+  for(int i = 0; i < n; ++i)
+  {
+    const std::atomic<int> &s = progress[threads[i]].step;
+    for(int spin = 0; s.load(std::memory_order_acquire) < id; ++spin)
+    {
+      //spin briefly, then give up the processor
+      if(spin >= 1000)
+#if defined(WIN32)
+        SwitchToThread();
+#else
+        sched_yield();
+#endif
+    }
+  }
+  tstats[tid].mark = WallTime();
+}
+
+//Finishes a step: reports it and waits for the threads owning neighbor cells
+static inline void SyncNeighborsMT(int tid, int frame, int step)
+{
+  ReportProgressMT(tid, frame, step);
+  WaitForThreadsMT(tid, frame, step, &nearThreads[tid*NUM_GRIDS], numNear[tid]);
+}
+
+//Finishes a step: reports it and waits for all threads
+static inline void SyncAllMT(int tid, int frame, int step)
+{
+  ReportProgressMT(tid, frame, step);
+  WaitForThreadsMT(tid, frame, step, allThreads, NUM_GRIDS);
+}
+
+// One frame has these steps, a thread finishes each one for its partition:
+//   1. thread 0 waits for all threads to finish the previous frame, swaps the
+//      grids and repartitions them, the others wait for thread 0
+//   2. rebuild the grid, also initializing densities and accelerations and
+//      emptying the old grid. Particles may move into any cell, so all threads
+//      wait for each other
+//   3. densities, then their final scaling
+//   4. forces, which read the densities of the neighbor cells
+//   5. wall collisions, integration and reflections of the own particles
+// Steps 3 and 4 only read the particles of the neighbor cells and only write
+// the particles of the thread, so a thread waits only for the threads owning
+// neighbor cells before the next step. A thread moves its particles in step 5
+// only after all those threads read them in step 4.
+//
+// With --soa step 2 is split into the three steps of the counting sort. Sizing
+// the cells only needs the counts of the neighbor cells, but the particles can
+// only be moved once the ranges of all threads are known.
+void AdvanceFrameMT(int tid, int frame)
+{
+  int parity = frame & 1;
+  tstats[tid].mark = WallTime();
+  tstats[tid].busy[parity] = 0.0;
+
   //swap src and dest arrays with particles
   if(tid==0) {
+    if(frame > firstFrame) {
+      WaitForThreadsMT(tid, frame-1, STEP_DONE, allThreads, NUM_GRIDS);
+      if(curSnapshot) {
+        snapshot_writer_submit(&snapshots, curSnapshot);
+        curSnapshot = NULL;
+      }
+      if(checkpointInterval > 0 && frame % checkpointInterval == 0)
+        SaveCheckpoint(checkpointFile, frame);
+      bool repartitioned = false;
+      if(rebalanceInterval > 0 && frame % rebalanceInterval == 0)
+        repartitioned = RepartitionGrid();
+      RecordBalance(frame-1, repartitioned);
+    }
     std::swap(cells, cells2);
     std::swap(cnumPars, cnumPars2);
+    std::swap(pars, pars2);
+    std::swap(cellStart, cellStart2);
+    //only waits if the writer is still busy with the two previous snapshots
+    if(snapshotInterval > 0 && (frame+1) % snapshotInterval == 0)
+      curSnapshot = snapshot_writer_acquire(&snapshots, frame+1);
+    ReportProgressMT(tid, frame, STEP_START);
   }
-  pthread_barrier_wait(&barrier);
-
-  ClearParticlesMT(tid);
-  pthread_barrier_wait(&barrier);
-  RebuildGridMT(tid);
-  pthread_barrier_wait(&barrier);
-  InitDensitiesAndForcesMT(tid);
-  pthread_barrier_wait(&barrier);
-  ComputeDensitiesMT(tid);
-  pthread_barrier_wait(&barrier);
-  ComputeDensities2MT(tid);
-  pthread_barrier_wait(&barrier);
-  ComputeForcesMT(tid);
-  pthread_barrier_wait(&barrier);
-  ProcessCollisionsMT(tid);
-  pthread_barrier_wait(&barrier);
-  AdvanceParticlesMT(tid);
-  pthread_barrier_wait(&barrier);
-#if defined(USE_ImpeneratableWall)
-  // N.B. The integration of the position can place the particle
-  // outside the domain. We now make a pass on the perimiter cells
-  // to account for particle migration beyond domain.
-  ProcessCollisions2MT(tid);
-  pthread_barrier_wait(&barrier);
-#endif
+  else
+    WaitForThreadsMT(tid, frame, STEP_START, allThreads, 1);
+
+  snapshot_chunk *chunk = NULL;
+
+  if(useSoA) {
+    SortParticlesSoAMT(tid);
+    SyncNeighborsMT(tid, frame, STEP_SORTED);
+    tstats[tid].particles[parity] = CountParticlesSoAMT(tid);
+    SyncAllMT(tid, frame, STEP_COUNTED);
+    MoveParticlesSoAMT(tid);
+    SyncAllMT(tid, frame, STEP_REBUILT);
+    ComputeDensitiesSoAMT(tid);
+    SyncNeighborsMT(tid, frame, STEP_DENSITIES);
+    ComputeForcesSoAMT(tid);
+    SyncNeighborsMT(tid, frame, STEP_FORCES);
+    if(curSnapshot) {
+      chunk = &curSnapshot->chunks[tid];
+      snapshot_chunk_reserve(chunk, tstats[tid].particles[parity]);
+    }
+    AdvanceParticlesSoAMT(tid, chunk);
+  } else {
+    RebuildGridMT(tid);
+    SyncAllMT(tid, frame, STEP_REBUILT);
+    ComputeDensitiesMT(tid);
+    tstats[tid].particles[parity] = ComputeDensities2MT(tid);
+    SyncNeighborsMT(tid, frame, STEP_DENSITIES);
+    ComputeForcesMT(tid);
+    SyncNeighborsMT(tid, frame, STEP_FORCES);
+    if(curSnapshot) {
+      chunk = &curSnapshot->chunks[tid];
+      snapshot_chunk_reserve(chunk, tstats[tid].particles[parity]);
+    }
+    AdvanceParticlesMT(tid, chunk);
+  }
+
+  tstats[tid].busy[parity] += WallTime() - tstats[tid].mark;
+  ReportProgressMT(tid, frame, STEP_DONE);
 }
 
 #ifndef ENABLE_VISUALIZATION
 void *AdvanceFramesMT(void *args)
 {
   thread_args *targs = (thread_args *)args;
+  PinThread(targs->tid);
 
-  for(int i = 0; i < targs->frames; ++i) {
-    AdvanceFrameMT(targs->tid);
+  for(int i = firstFrame; i < firstFrame + targs->frames; ++i) {
+    AdvanceFrameMT(targs->tid, i);
   }
   
   return NULL;
@@ -1166,16 +2410,17 @@ void *AdvanceFramesMT(void *args)
 void *AdvanceFramesMT(void *args)
 {
   thread_args *targs = (thread_args *)args;
+  PinThread(targs->tid);
 
 #if 1
-  while(1)
+  for(int i = firstFrame; ; ++i)
 #else
-  for(int i = 0; i < targs->frames; ++i)
+  for(int i = firstFrame; i < firstFrame + targs->frames; ++i)
 #endif
   {
     pthread_barrier_wait(&visualization_barrier);
     //Phase 1: Compute frame, visualization code blocked
-    AdvanceFrameMT(targs->tid);
+    AdvanceFrameMT(targs->tid, i);
     pthread_barrier_wait(&visualization_barrier);
     //Phase 2: Visualize, worker threads blocked
   }
@@ -1209,14 +2454,55 @@ int main(int argc, char *argv[])
   __parsec_bench_begin(__parsec_fluidanimate);
 #endif
 
-  if(argc < 4 || argc >= 6)
+  //Options may appear anywhere, everything else is positional
+  char *args[4];
+  int nargs = 0;
+  bool usage = false;
+  for(int i = 1; i < argc && !usage; ++i)
+  {
+    if(!strcmp(argv[i], "--rebalance") && i+1 < argc)
+      rebalanceInterval = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--balance-report"))
+      balanceReport = true;
+    else if(!strcmp(argv[i], "--soa"))
+      useSoA = true;
+    else if(!strcmp(argv[i], "--snapshot") && i+1 < argc)
+      snapshotInterval = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--snapshot-prefix") && i+1 < argc)
+      snapshotPrefix = argv[++i];
+    else if(!strcmp(argv[i], "--snapshot-format") && i+1 < argc)
+      snapshotSinks = snapshot_parse_sinks(argv[++i]);
+    else if(!strcmp(argv[i], "--checkpoint") && i+1 < argc)
+      checkpointInterval = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--checkpoint-file") && i+1 < argc)
+      checkpointFile = argv[++i];
+    else if(!strcmp(argv[i], "--pin"))
+      pinThreads = true;
+    else if(argv[i][0] == '-' && argv[i][1] == '-')
+      usage = true;
+    else if(nargs < 4)
+      args[nargs++] = argv[i];
+    else
+      usage = true;
+  }
+  if(usage || nargs < 3)
   {
-    std::cout << "Usage: " << argv[0] << " <threadnum> <framenum> <.fluid input file> [.fluid output file]" << std::endl;
+    std::cout << "Usage: " << argv[0] << " <threadnum> <framenum> <.fluid input file or checkpoint> [.fluid output file] [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --rebalance N     Repartition the grid by particle count every N frames (default " << rebalanceInterval << ", 0 disables)" << std::endl;
+    std::cout << "  --balance-report  Print the load imbalance between the threads after every frame" << std::endl;
+    std::cout << "  --soa             Keep the particles in flat arrays sorted by cell instead of Cell lists" << std::endl;
+    std::cout << "  --snapshot N      Write the particles every N frames from a separate I/O thread (default 0, disabled)" << std::endl;
+    std::cout << "  --snapshot-prefix P  File name prefix of the snapshots (default " << snapshotPrefix << ")" << std::endl;
+    std::cout << "  --snapshot-format F  Comma separated sinks of the snapshots: fluid, raw, quant (default fluid)" << std::endl;
+    std::cout << "  --checkpoint N    Save the full simulation state every N frames, pass it as input file to restart (default 0, disabled)" << std::endl;
+    std::cout << "  --checkpoint-file F  File name of the checkpoint (default " << checkpointFile << ")" << std::endl;
+    std::cout << "  --pin             Pin every thread to one CPU, keeping its memory on the local NUMA node" << std::endl;
     return -1;
   }
 
-  int threadnum = atoi(argv[1]);
-  int framenum = atoi(argv[2]);
+  int threadnum = atoi(args[0]);
+  int framenum = atoi(args[1]);
 
   //Check arguments
   if(threadnum < 1) {
@@ -1227,12 +2513,42 @@ int main(int argc, char *argv[])
     std::cerr << "<framenum> must at least be 1" << std::endl;
     return -1;
   }
+  if(rebalanceInterval < 0) {
+    std::cerr << "--rebalance must not be negative" << std::endl;
+    return -1;
+  }
+  if(checkpointInterval < 0) {
+    std::cerr << "--checkpoint must not be negative" << std::endl;
+    return -1;
+  }
+  if(snapshotInterval < 0) {
+    std::cerr << "--snapshot must not be negative" << std::endl;
+    return -1;
+  }
+  if(!snapshotSinks) {
+    std::cerr << "--snapshot-format must be a list of fluid, raw and quant" << std::endl;
+    return -1;
+  }
+#ifdef ENABLE_VISUALIZATION
+  if(useSoA) {
+    std::cerr << "--soa is not supported with visualization" << std::endl;
+    return -1;
+  }
+#endif
 
 #ifdef ENABLE_CFL_CHECK
   std::cout << "WARNING: Check for Courant–Friedrichs–Lewy condition enabled. Do not use for performance measurements." << std::endl;
 #endif
 
-  InitSim(argv[3], threadnum);
+  if(pinThreads)
+    InitPinning();
+  InitSim(args[2], threadnum);
+  if(useSoA) {
+    sph_kernels_init();
+    std::cout << "Neighbor kernels: " << sphKernelName << std::endl;
+  }
+  if(snapshotInterval > 0)
+    snapshot_writer_init(&snapshots, snapshotSinks, snapshotPrefix, NUM_GRIDS, (float)restParticlesPerMeter);
 #ifdef ENABLE_VISUALIZATION
   InitVisualizationMode(&argc, argv, &AdvanceFrameVisualization, &numCells, &cells, &cnumPars);
 #endif
@@ -1263,8 +2579,37 @@ int main(int argc, char *argv[])
   __parsec_roi_end();
 #endif
 
-  if(argc > 4)
-    SaveFile(argv[4]);
+  int lastFrame = firstFrame + framenum;
+  RecordBalance(lastFrame-1, false);
+  std::cout << "Load imbalance (max/mean busy time): average " << sumImbalance / framenum
+            << ", worst " << maxImbalance << ", " << numRepartitions << " repartitionings" << std::endl;
+  if(!useSoA) {
+    //cells move between pools, so the cells in use are only known for all pools together
+    int blocks = 0, allocated = 0, used = 0, foreign = 0;
+    for(int i = 0; i < NUM_GRIDS; ++i)
+    {
+      blocks += pools[i].blocks;
+      allocated += pools[i].alloc;
+      used += pools[i].taken - pools[i].returned;
+      foreign += pools[i].foreign;
+    }
+    std::cout << "Cell pools: " << blocks << " blocks with " << allocated << " cells, " << used
+              << " cells in use at the end, " << foreign << " cells returned to the pool of another thread" << std::endl;
+  }
+
+  if(curSnapshot) {
+    snapshot_writer_submit(&snapshots, curSnapshot);
+    curSnapshot = NULL;
+  }
+  if(checkpointInterval > 0 && lastFrame % checkpointInterval == 0)
+    SaveCheckpoint(checkpointFile, lastFrame);
+  if(nargs > 3)
+    SaveFile(args[3]);
+  if(snapshotInterval > 0) {
+    snapshot_writer_destroy(&snapshots);
+    std::cout << "Snapshots: " << snapshots.written << " written, simulation waited " << snapshots.stalls
+              << " times for the writer (" << snapshots.stallTime << " s)" << std::endl;
+  }
   CleanUpSim();
 
 #ifdef ENABLE_PARSEC_HOOKS
@@ -0,0 +1,357 @@
+// The code in this file implements the snapshot writer. Snapshots are written by
+// a dedicated I/O thread to one or more sinks:
+//
+//   fluid  <prefix>.<frame>.fluid  same format as the output file of the benchmark
+//   raw    <prefix>.<frame>.fsnp   positions and velocities as 32 bit floats
+//   quant  <prefix>.<frame>.fsnp   positions and velocities quantized to 16 bits
+//                                  (<prefix>.<frame>.q.fsnp if raw is written too)
+//
+// The .fsnp files are always little-endian and have the following layout:
+//
+//   | "FSNP" | version | encoding | frame | particles |   5 x 4 bytes
+//   | domain min x,y,z | domain max x,y,z | velocity scale |   7 x 4 bytes (float)
+//   | positions x,y,z of all particles |   particles x 3 x (4 or 2) bytes
+//   | velocities x,y,z of all particles |   particles x 3 x (4 or 2) bytes
+//
+// With encoding 1 (quant) a position is stored as unsigned 16 bit fraction of the
+// domain and a velocity as signed 16 bit fraction of the velocity scale, which is
+// the largest velocity component of the frame. The half-step velocities are only
+// needed to continue the simulation and are only written to .fluid files.
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+
+#include "fluid.hpp"
+#include "snapshot.hpp"
+
+
+
+#define FSNP_VERSION 1
+#define FSNP_HEADER_SIZE 48
+
+//States of a snapshot buffer
+enum { SNAPSHOT_FREE, SNAPSHOT_FILLING, SNAPSHOT_QUEUED, SNAPSHOT_WRITING };
+
+static inline double snapshot_time()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Store values little-endian independent of the host byte order
+static inline void put_u16(unsigned char *out, uint16_t x)
+{
+  out[0] = (unsigned char)x;
+  out[1] = (unsigned char)(x >> 8);
+}
+
+static inline void put_u32(unsigned char *out, uint32_t x)
+{
+  out[0] = (unsigned char)x;
+  out[1] = (unsigned char)(x >> 8);
+  out[2] = (unsigned char)(x >> 16);
+  out[3] = (unsigned char)(x >> 24);
+}
+
+static inline void put_f32(unsigned char *out, float x)
+{
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  put_u32(out, u);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int snapshot_parse_sinks(char const *names)
+{
+  int sinks = 0;
+  while(*names)
+  {
+    size_t len = strcspn(names, ",");
+    if(len == 5 && !strncmp(names, "fluid", len))
+      sinks |= SNAPSHOT_FLUID;
+    else if(len == 3 && !strncmp(names, "raw", len))
+      sinks |= SNAPSHOT_RAW;
+    else if(len == 5 && !strncmp(names, "quant", len))
+      sinks |= SNAPSHOT_QUANT;
+    else
+      return 0;
+    names += len;
+    if(*names == ',')
+      ++names;
+  }
+  return sinks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void snapshot_write_fluid(char const *fileName, float restParticlesPerMeter, snapshot_chunk const *chunks, int numChunks)
+{
+  int numParticles = 0;
+  for(int i = 0; i < numChunks; ++i)
+    numParticles += chunks[i].count;
+
+  std::ofstream file(fileName, std::ios::binary);
+  assert(file);
+
+  //Always use single precision float variables b/c file format uses single precision
+  if(!isLittleEndian()) {
+    float restParticlesPerMeter_le = bswap_float(restParticlesPerMeter);
+    int   numParticles_le          = bswap_int32(numParticles);
+    file.write((char *)&restParticlesPerMeter_le, FILE_SIZE_FLOAT);
+    file.write((char *)&numParticles_le,          FILE_SIZE_INT);
+  } else {
+    file.write((char *)&restParticlesPerMeter, FILE_SIZE_FLOAT);
+    file.write((char *)&numParticles,          FILE_SIZE_INT);
+  }
+
+  //Chunks are in the file layout already, write them as a whole
+  for(int i = 0; i < numChunks; ++i)
+  {
+    int n = chunks[i].count * SNAPSHOT_VALUES;
+    if(!isLittleEndian()) {
+      for(int j = 0; j < n; ++j) {
+        float value = bswap_float(chunks[i].values[j]);
+        file.write((char *)&value, FILE_SIZE_FLOAT);
+      }
+    } else {
+      file.write((char *)chunks[i].values, (std::streamsize)n * FILE_SIZE_FLOAT);
+    }
+  }
+}
+
+//Write a snapshot as .fsnp file, either with floats or quantized
+static void snapshot_write_fsnp(char const *fileName, snapshot const *s, bool quantize)
+{
+  int numParticles = 0;
+  float scale = 0.0f;
+  for(int i = 0; i < s->numChunks; ++i)
+  {
+    numParticles += s->chunks[i].count;
+    if(!quantize)
+      continue;
+    float const *values = s->chunks[i].values;
+    for(int j = 0; j < s->chunks[i].count; ++j)
+      for(int k = 6; k < 9; ++k)
+        scale = std::max(scale, fabsf(values[j*SNAPSHOT_VALUES + k]));
+  }
+  if(scale == 0.0f)
+    scale = 1.0f;
+
+  int valueSize = quantize ? 2 : 4;
+  size_t size = FSNP_HEADER_SIZE + (size_t)numParticles * 6 * valueSize;
+  unsigned char *data = (unsigned char *)malloc(size);
+  assert(data);
+
+  unsigned char *out = data;
+  memcpy(out, "FSNP", 4);
+  put_u32(out + 4,  FSNP_VERSION);
+  put_u32(out + 8,  quantize ? 1 : 0);
+  put_u32(out + 12, s->frame);
+  put_u32(out + 16, numParticles);
+  put_f32(out + 20, (float)domainMin.x);
+  put_f32(out + 24, (float)domainMin.y);
+  put_f32(out + 28, (float)domainMin.z);
+  put_f32(out + 32, (float)domainMax.x);
+  put_f32(out + 36, (float)domainMax.y);
+  put_f32(out + 40, (float)domainMax.z);
+  put_f32(out + 44, scale);
+  out += FSNP_HEADER_SIZE;
+
+  //Positions of all particles, then velocities of all particles
+  float lo[3]    = { (float)domainMin.x, (float)domainMin.y, (float)domainMin.z };
+  float range[3] = { (float)(domainMax.x - domainMin.x), (float)(domainMax.y - domainMin.y), (float)(domainMax.z - domainMin.z) };
+  for(int field = 0; field < 2; ++field)
+  {
+    int first = field == 0 ? 0 : 6;
+    for(int i = 0; i < s->numChunks; ++i)
+    {
+      float const *values = s->chunks[i].values;
+      for(int j = 0; j < s->chunks[i].count; ++j)
+        for(int k = 0; k < 3; ++k)
+        {
+          float x = values[j*SNAPSHOT_VALUES + first + k];
+          if(!quantize) {
+            put_f32(out, x);
+          } else if(field == 0) {
+            float f = std::min(std::max((x - lo[k]) / range[k], 0.0f), 1.0f);
+            put_u16(out, (uint16_t)lrintf(f * 65535.0f));
+          } else {
+            put_u16(out, (uint16_t)(int16_t)lrintf(x / scale * 32767.0f));
+          }
+          out += valueSize;
+        }
+    }
+  }
+  assert(out == data + size);
+
+  std::ofstream file(fileName, std::ios::binary);
+  assert(file);
+  file.write((char *)data, size);
+  free(data);
+}
+
+static void snapshot_write(snapshot_writer *w, snapshot const *s)
+{
+  size_t len = strlen(w->prefix) + 32;
+  char *fileName = (char *)malloc(len);
+  assert(fileName);
+
+  if(w->sinks & SNAPSHOT_FLUID) {
+    snprintf(fileName, len, "%s.%06d.fluid", w->prefix, s->frame);
+    snapshot_write_fluid(fileName, w->restParticlesPerMeter, s->chunks, s->numChunks);
+  }
+  //Both .fsnp sinks would use the same name, the quantized one gets a suffix if both are requested
+  if(w->sinks & SNAPSHOT_RAW) {
+    snprintf(fileName, len, "%s.%06d.fsnp", w->prefix, s->frame);
+    snapshot_write_fsnp(fileName, s, false);
+  }
+  if(w->sinks & SNAPSHOT_QUANT) {
+    snprintf(fileName, len, (w->sinks & SNAPSHOT_RAW) ? "%s.%06d.q.fsnp" : "%s.%06d.fsnp", w->prefix, s->frame);
+    snapshot_write_fsnp(fileName, s, true);
+  }
+  free(fileName);
+}
+
+//Main loop of the I/O thread, writes queued snapshots in the order they were submitted
+static void *snapshot_thread(void *arg)
+{
+  snapshot_writer *w = (snapshot_writer *)arg;
+
+  pthread_mutex_lock(&w->mutex);
+  while(true)
+  {
+    snapshot *s = NULL;
+    for(int i = 0; i < 2; ++i)
+      if(w->buffers[i].state == SNAPSHOT_QUEUED && (!s || w->buffers[i].seq < s->seq))
+        s = &w->buffers[i];
+    if(!s) {
+      if(w->quit)
+        break;
+      pthread_cond_wait(&w->cond, &w->mutex);
+      continue;
+    }
+
+    s->state = SNAPSHOT_WRITING;
+    pthread_mutex_unlock(&w->mutex);
+    snapshot_write(w, s);
+    pthread_mutex_lock(&w->mutex);
+    s->state = SNAPSHOT_FREE;
+    w->written++;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void snapshot_writer_init(snapshot_writer *w, int sinks, char const *prefix, int numChunks, float restParticlesPerMeter)
+{
+  assert(w);
+  assert(sinks);
+  assert(numChunks > 0);
+
+  for(int i = 0; i < 2; ++i)
+  {
+    snapshot *s = &w->buffers[i];
+    s->frame = 0;
+    s->numChunks = numChunks;
+    s->chunks = (snapshot_chunk *)calloc(numChunks, sizeof(snapshot_chunk));
+    assert(s->chunks);
+    s->state = SNAPSHOT_FREE;
+    s->seq = 0;
+  }
+  w->submitted = 0;
+  w->quit = false;
+  w->sinks = sinks;
+  w->prefix = strdup(prefix);
+  assert(w->prefix);
+  w->restParticlesPerMeter = restParticlesPerMeter;
+  w->written = 0;
+  w->stalls = 0;
+  w->stallTime = 0.0;
+
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  pthread_create(&w->thread, NULL, snapshot_thread, w);
+}
+
+snapshot *snapshot_writer_acquire(snapshot_writer *w, int frame)
+{
+  snapshot *s = NULL;
+  double start = 0.0;
+
+  pthread_mutex_lock(&w->mutex);
+  while(true)
+  {
+    for(int i = 0; i < 2 && !s; ++i)
+      if(w->buffers[i].state == SNAPSHOT_FREE)
+        s = &w->buffers[i];
+    if(s)
+      break;
+    if(start == 0.0) {
+      start = snapshot_time();
+      w->stalls++;
+    }
+    pthread_cond_wait(&w->cond, &w->mutex);
+  }
+  if(start != 0.0)
+    w->stallTime += snapshot_time() - start;
+  s->state = SNAPSHOT_FILLING;
+  pthread_mutex_unlock(&w->mutex);
+
+  s->frame = frame;
+  return s;
+}
+
+void snapshot_chunk_reserve(snapshot_chunk *chunk, int count)
+{
+  if(count > chunk->capacity) {
+    //leave some room since the number of particles of a thread changes every frame
+    int capacity = count + count / 8;
+    free(chunk->values);
+    chunk->values = (float *)malloc((size_t)capacity * SNAPSHOT_VALUES * sizeof(float));
+    assert(chunk->values);
+    chunk->capacity = capacity;
+  }
+  chunk->count = 0;
+}
+
+void snapshot_writer_submit(snapshot_writer *w, snapshot *s)
+{
+  pthread_mutex_lock(&w->mutex);
+  assert(s->state == SNAPSHOT_FILLING);
+  s->state = SNAPSHOT_QUEUED;
+  s->seq = w->submitted++;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+void snapshot_writer_destroy(snapshot_writer *w)
+{
+  pthread_mutex_lock(&w->mutex);
+  w->quit = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->thread, NULL);
+
+  for(int i = 0; i < 2; ++i)
+  {
+    for(int j = 0; j < w->buffers[i].numChunks; ++j)
+      free(w->buffers[i].chunks[j].values);
+    free(w->buffers[i].chunks);
+  }
+  free(w->prefix);
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+}
@@ -0,0 +1,88 @@
+// The code in this file defines the interface for writing snapshots of the particle
+// state while the simulation is running. The simulation threads copy the state of a
+// frame into one of two buffers while a dedicated I/O thread writes the other one
+// to the requested sinks, so the simulation only waits for the disk if the writer
+// falls behind by two snapshots.
+
+#ifndef __SNAPSHOT_HPP__
+#define __SNAPSHOT_HPP__ 1
+
+#include <pthread.h>
+
+#include "fluid.hpp"
+
+
+
+//Values per particle in a snapshot, in the order of the .fluid format:
+//position, half-step velocity and velocity
+#define SNAPSHOT_VALUES 9
+
+//Sinks a snapshot can be written to, can be combined
+#define SNAPSHOT_FLUID 1  // .fluid file as written by SaveFile
+#define SNAPSHOT_RAW   2  // .fsnp file with positions and velocities as floats
+#define SNAPSHOT_QUANT 4  // .fsnp file with positions and velocities quantized to 16 bits
+
+//Particles of one thread in a snapshot
+typedef struct {
+  union {
+    struct {
+      float *values;  // SNAPSHOT_VALUES per particle
+      int count;
+      int capacity;
+    };
+    unsigned char pp[CACHELINE_SIZE];
+  };
+} snapshot_chunk;
+
+//State of all particles after a frame, in chunks that are written in order
+typedef struct {
+  int frame;                // number of frames computed
+  int numChunks;
+  snapshot_chunk *chunks;
+  int state;                // internal, see snapshot.cpp
+  long seq;                 // internal, order of submission
+} snapshot;
+
+//The snapshot writer
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  snapshot buffers[2];
+  long submitted;
+  bool quit;
+  int sinks;                // SNAPSHOT_* flags
+  char *prefix;             // file names are <prefix>.<frame>.<extension>
+  float restParticlesPerMeter;
+  //statistics
+  int written;              // snapshots written
+  int stalls;               // times the simulation had to wait for a free buffer
+  double stallTime;         // seconds it waited
+} snapshot_writer;
+
+
+
+//Parse a comma separated list of sink names (fluid, raw, quant)
+//returns the SNAPSHOT_* flags, or 0 if a name is unknown
+int snapshot_parse_sinks(char const *names);
+
+//Initialize the writer and start its I/O thread
+//numChunks should be the number of simulation threads
+void snapshot_writer_init(snapshot_writer *w, int sinks, char const *prefix, int numChunks, float restParticlesPerMeter);
+
+//Get a free snapshot buffer for the given frame, blocks while both buffers are in use
+snapshot *snapshot_writer_acquire(snapshot_writer *w, int frame);
+
+//Make room for count particles in a chunk and empty it, called by the thread owning the chunk
+void snapshot_chunk_reserve(snapshot_chunk *chunk, int count);
+
+//Hand a filled snapshot buffer to the I/O thread
+void snapshot_writer_submit(snapshot_writer *w, snapshot *s);
+
+//Write all submitted snapshots, stop the I/O thread and free the buffers
+void snapshot_writer_destroy(snapshot_writer *w);
+
+//Write the particles in the given chunks as .fluid file
+void snapshot_write_fluid(char const *fileName, float restParticlesPerMeter, snapshot_chunk const *chunks, int numChunks);
+
+#endif //__SNAPSHOT_HPP__
@@ -0,0 +1,312 @@
+// Neighbor interaction kernels for the structure-of-arrays storage (--soa)
+//
+// Each kernel evaluates particle i of the particle arrays against the first
+// count particles of a neighbor buffer, which holds copies of the particles of
+// all neighbor cells of the cell of i (including that cell and i itself) in a
+// fixed order. The density kernel returns
+// the sum of (hSq - distSq)^3 over all neighbors closer than h, the force kernel
+// the sum of the pressure and viscosity accelerations. The particle itself
+// adds its self density hSq^3 and a zero force.
+//
+// The scalar kernels are plain loops. The vector kernels load 8 (AVX2) or 16
+// (AVX-512) neighbors at once, mask out the lanes with distSq >= hSq and the
+// lanes past count, and reduce the lanes once per particle. They add the same
+// terms in a different order, so their results differ from the scalar ones by
+// rounding only. Since the buffer layout does not depend on the partitioning,
+// for a given kernel the result does not depend on the number of threads.
+//
+// The kernel is picked by sph_kernels_init() based on the CPU; the environment
+// variable FLUIDANIMATE_SIMD (scalar, avx2 or avx512) caps the choice. The
+// vector kernels need single precision.
+
+#ifndef __SPH_KERNELS_HPP__
+#define __SPH_KERNELS_HPP__ 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "fluid.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(ENABLE_DOUBLE_PRECISION)
+#define ENABLE_SIMD_SPH_KERNELS
+#include <immintrin.h>
+#endif
+
+//Particle fields read by the kernels
+struct NeighborArrays {
+  const fptype *px, *py, *pz;
+  const fptype *vx, *vy, *vz;
+  const fptype *density;
+};
+
+//Constants of the force computation
+struct ForceCoeffs {
+  fptype h, hSq;
+  fptype pressureCoeff, viscosityCoeff;
+  fptype doubleRestDensity;
+};
+
+typedef fptype (*density_kernel_fn)(const NeighborArrays &p, int i, const NeighborArrays &n, int count, fptype hSq);
+typedef void (*force_kernel_fn)(const NeighborArrays &p, int i, const NeighborArrays &n, int count,
+                                const ForceCoeffs &c, fptype *ax, fptype *ay, fptype *az);
+
+static inline fptype DensityKernelScalar(const NeighborArrays &p, int i, const NeighborArrays &n, int count, fptype hSq)
+{
+  fptype x = p.px[i], y = p.py[i], z = p.pz[i];
+  fptype density = 0.0;
+  for(int j = 0; j < count; ++j)
+  {
+    fptype dx = x - n.px[j];
+    fptype dy = y - n.py[j];
+    fptype dz = z - n.pz[j];
+    fptype distSq = dx*dx + dy*dy + dz*dz;
+    fptype t = hSq - distSq;
+    density += distSq < hSq ? t*t*t : (fptype)0.0;
+  }
+  return density;
+}
+
+static inline void ForceKernelScalar(const NeighborArrays &p, int i, const NeighborArrays &n, int count,
+                                     const ForceCoeffs &c, fptype *ax, fptype *ay, fptype *az)
+{
+  fptype x = p.px[i], y = p.py[i], z = p.pz[i];
+  fptype sx = 0.0, sy = 0.0, sz = 0.0;
+  for(int j = 0; j < count; ++j)
+  {
+    fptype dx = x - n.px[j];
+    fptype dy = y - n.py[j];
+    fptype dz = z - n.pz[j];
+    fptype distSq = dx*dx + dy*dy + dz*dz;
+    //the particle itself has dx == dy == dz == 0 and equal velocities, so it adds nothing
+    if(distSq < c.hSq)
+    {
+#ifndef ENABLE_DOUBLE_PRECISION
+      fptype dist = sqrtf(std::max(distSq, (fptype)1e-12));
+#else
+      fptype dist = sqrt(std::max(distSq, 1e-12));
+#endif //ENABLE_DOUBLE_PRECISION
+      fptype hmr = c.h - dist;
+      fptype pressure = c.pressureCoeff * (hmr*hmr/dist) * (p.density[i]+n.density[j] - c.doubleRestDensity);
+      fptype visc = c.viscosityCoeff * hmr;
+      fptype scale = (fptype)1.0 / (p.density[i]*n.density[j]);
+      sx += (dx*pressure + (n.vx[j]-p.vx[i])*visc) * scale;
+      sy += (dy*pressure + (n.vy[j]-p.vy[i])*visc) * scale;
+      sz += (dz*pressure + (n.vz[j]-p.vz[i])*visc) * scale;
+    }
+  }
+  *ax += sx;
+  *ay += sy;
+  *az += sz;
+}
+
+#ifdef ENABLE_SIMD_SPH_KERNELS
+
+__attribute__((target("avx2")))
+static inline float HorizontalSumAVX2(__m256 v)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+//Lanes [0, count) of a load at j
+__attribute__((target("avx2")))
+static inline __m256i TailMaskAVX2(int count)
+{
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+__attribute__((target("avx2,fma")))
+static inline fptype DensityKernelAVX2(const NeighborArrays &p, int i, const NeighborArrays &n, int count, fptype hSq)
+{
+  const __m256 x = _mm256_set1_ps(p.px[i]);
+  const __m256 y = _mm256_set1_ps(p.py[i]);
+  const __m256 z = _mm256_set1_ps(p.pz[i]);
+  const __m256 hSqv = _mm256_set1_ps(hSq);
+  __m256 density = _mm256_setzero_ps();
+  for(int j = 0; j < count; j += 8)
+  {
+    __m256i tail = TailMaskAVX2(count - j);
+    __m256 dx = _mm256_sub_ps(x, _mm256_maskload_ps(n.px + j, tail));
+    __m256 dy = _mm256_sub_ps(y, _mm256_maskload_ps(n.py + j, tail));
+    __m256 dz = _mm256_sub_ps(z, _mm256_maskload_ps(n.pz + j, tail));
+    __m256 distSq = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(distSq, hSqv, _CMP_LT_OQ), _mm256_castsi256_ps(tail));
+    __m256 t = _mm256_sub_ps(hSqv, distSq);
+    __m256 tc = _mm256_mul_ps(_mm256_mul_ps(t, t), t);
+    density = _mm256_add_ps(density, _mm256_and_ps(tc, mask));
+  }
+  return HorizontalSumAVX2(density);
+}
+
+__attribute__((target("avx2,fma")))
+static inline void ForceKernelAVX2(const NeighborArrays &p, int i, const NeighborArrays &n, int count,
+                                   const ForceCoeffs &c, fptype *ax, fptype *ay, fptype *az)
+{
+  const __m256 x = _mm256_set1_ps(p.px[i]);
+  const __m256 y = _mm256_set1_ps(p.py[i]);
+  const __m256 z = _mm256_set1_ps(p.pz[i]);
+  const __m256 vxi = _mm256_set1_ps(p.vx[i]);
+  const __m256 vyi = _mm256_set1_ps(p.vy[i]);
+  const __m256 vzi = _mm256_set1_ps(p.vz[i]);
+  const __m256 densityi = _mm256_set1_ps(p.density[i]);
+  const __m256 hv = _mm256_set1_ps(c.h);
+  const __m256 hSqv = _mm256_set1_ps(c.hSq);
+  const __m256 minDistSq = _mm256_set1_ps(1e-12f);
+  const __m256 pressureCoeff = _mm256_set1_ps(c.pressureCoeff);
+  const __m256 viscosityCoeff = _mm256_set1_ps(c.viscosityCoeff);
+  const __m256 restDensity = _mm256_set1_ps(c.doubleRestDensity);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  __m256 sx = _mm256_setzero_ps();
+  __m256 sy = _mm256_setzero_ps();
+  __m256 sz = _mm256_setzero_ps();
+  for(int j = 0; j < count; j += 8)
+  {
+    __m256i tail = TailMaskAVX2(count - j);
+    __m256 dx = _mm256_sub_ps(x, _mm256_maskload_ps(n.px + j, tail));
+    __m256 dy = _mm256_sub_ps(y, _mm256_maskload_ps(n.py + j, tail));
+    __m256 dz = _mm256_sub_ps(z, _mm256_maskload_ps(n.pz + j, tail));
+    __m256 distSq = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+    __m256 mask = _mm256_and_ps(_mm256_cmp_ps(distSq, hSqv, _CMP_LT_OQ), _mm256_castsi256_ps(tail));
+    if(_mm256_testz_ps(mask, mask))
+      continue;
+
+    //masked out lanes load density 1 so that nothing below divides by zero
+    __m256 densityj = _mm256_blendv_ps(one, _mm256_maskload_ps(n.density + j, tail), _mm256_castsi256_ps(tail));
+    __m256 dist = _mm256_sqrt_ps(_mm256_max_ps(distSq, minDistSq));
+    __m256 hmr = _mm256_sub_ps(hv, dist);
+    __m256 pressure = _mm256_mul_ps(_mm256_mul_ps(pressureCoeff, _mm256_div_ps(_mm256_mul_ps(hmr, hmr), dist)),
+                                    _mm256_sub_ps(_mm256_add_ps(densityi, densityj), restDensity));
+    __m256 visc = _mm256_mul_ps(viscosityCoeff, hmr);
+    __m256 scale = _mm256_and_ps(_mm256_div_ps(one, _mm256_mul_ps(densityi, densityj)), mask);
+    __m256 dvx = _mm256_sub_ps(_mm256_maskload_ps(n.vx + j, tail), vxi);
+    __m256 dvy = _mm256_sub_ps(_mm256_maskload_ps(n.vy + j, tail), vyi);
+    __m256 dvz = _mm256_sub_ps(_mm256_maskload_ps(n.vz + j, tail), vzi);
+    sx = _mm256_fmadd_ps(_mm256_fmadd_ps(dx, pressure, _mm256_mul_ps(dvx, visc)), scale, sx);
+    sy = _mm256_fmadd_ps(_mm256_fmadd_ps(dy, pressure, _mm256_mul_ps(dvy, visc)), scale, sy);
+    sz = _mm256_fmadd_ps(_mm256_fmadd_ps(dz, pressure, _mm256_mul_ps(dvz, visc)), scale, sz);
+  }
+  *ax += HorizontalSumAVX2(sx);
+  *ay += HorizontalSumAVX2(sy);
+  *az += HorizontalSumAVX2(sz);
+}
+
+//the AVX-512 reductions of GCC 12 trip -Wuninitialized on their own
+//placeholder operands
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static inline fptype DensityKernelAVX512(const NeighborArrays &p, int i, const NeighborArrays &n, int count, fptype hSq)
+{
+  const __m512 x = _mm512_set1_ps(p.px[i]);
+  const __m512 y = _mm512_set1_ps(p.py[i]);
+  const __m512 z = _mm512_set1_ps(p.pz[i]);
+  const __m512 hSqv = _mm512_set1_ps(hSq);
+  __m512 density = _mm512_setzero_ps();
+  for(int j = 0; j < count; j += 16)
+  {
+    int left = count - j;
+    __mmask16 tail = left >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << left) - 1);
+    __m512 dx = _mm512_sub_ps(x, _mm512_maskz_loadu_ps(tail, n.px + j));
+    __m512 dy = _mm512_sub_ps(y, _mm512_maskz_loadu_ps(tail, n.py + j));
+    __m512 dz = _mm512_sub_ps(z, _mm512_maskz_loadu_ps(tail, n.pz + j));
+    __m512 distSq = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+    __mmask16 mask = _mm512_mask_cmp_ps_mask(tail, distSq, hSqv, _CMP_LT_OQ);
+    __m512 t = _mm512_sub_ps(hSqv, distSq);
+    density = _mm512_mask_add_ps(density, mask, density, _mm512_mul_ps(_mm512_mul_ps(t, t), t));
+  }
+  return _mm512_reduce_add_ps(density);
+}
+
+__attribute__((target("avx512f")))
+static inline void ForceKernelAVX512(const NeighborArrays &p, int i, const NeighborArrays &n, int count,
+                                     const ForceCoeffs &c, fptype *ax, fptype *ay, fptype *az)
+{
+  const __m512 x = _mm512_set1_ps(p.px[i]);
+  const __m512 y = _mm512_set1_ps(p.py[i]);
+  const __m512 z = _mm512_set1_ps(p.pz[i]);
+  const __m512 vxi = _mm512_set1_ps(p.vx[i]);
+  const __m512 vyi = _mm512_set1_ps(p.vy[i]);
+  const __m512 vzi = _mm512_set1_ps(p.vz[i]);
+  const __m512 densityi = _mm512_set1_ps(p.density[i]);
+  const __m512 hv = _mm512_set1_ps(c.h);
+  const __m512 hSqv = _mm512_set1_ps(c.hSq);
+  const __m512 minDistSq = _mm512_set1_ps(1e-12f);
+  const __m512 pressureCoeff = _mm512_set1_ps(c.pressureCoeff);
+  const __m512 viscosityCoeff = _mm512_set1_ps(c.viscosityCoeff);
+  const __m512 restDensity = _mm512_set1_ps(c.doubleRestDensity);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  __m512 sx = _mm512_setzero_ps();
+  __m512 sy = _mm512_setzero_ps();
+  __m512 sz = _mm512_setzero_ps();
+  for(int j = 0; j < count; j += 16)
+  {
+    int left = count - j;
+    __mmask16 tail = left >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << left) - 1);
+    __m512 dx = _mm512_sub_ps(x, _mm512_maskz_loadu_ps(tail, n.px + j));
+    __m512 dy = _mm512_sub_ps(y, _mm512_maskz_loadu_ps(tail, n.py + j));
+    __m512 dz = _mm512_sub_ps(z, _mm512_maskz_loadu_ps(tail, n.pz + j));
+    __m512 distSq = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+    __mmask16 mask = _mm512_mask_cmp_ps_mask(tail, distSq, hSqv, _CMP_LT_OQ);
+    if(mask == 0)
+      continue;
+
+    //masked out lanes load density 1 so that nothing below divides by zero
+    __m512 densityj = _mm512_mask_loadu_ps(one, mask, n.density + j);
+    __m512 dist = _mm512_sqrt_ps(_mm512_max_ps(distSq, minDistSq));
+    __m512 hmr = _mm512_sub_ps(hv, dist);
+    __m512 pressure = _mm512_mul_ps(_mm512_mul_ps(pressureCoeff, _mm512_div_ps(_mm512_mul_ps(hmr, hmr), dist)),
+                                    _mm512_sub_ps(_mm512_add_ps(densityi, densityj), restDensity));
+    __m512 visc = _mm512_mul_ps(viscosityCoeff, hmr);
+    __m512 scale = _mm512_maskz_div_ps(mask, one, _mm512_mul_ps(densityi, densityj));
+    __m512 dvx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, n.vx + j), vxi);
+    __m512 dvy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, n.vy + j), vyi);
+    __m512 dvz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, n.vz + j), vzi);
+    sx = _mm512_fmadd_ps(_mm512_fmadd_ps(dx, pressure, _mm512_mul_ps(dvx, visc)), scale, sx);
+    sy = _mm512_fmadd_ps(_mm512_fmadd_ps(dy, pressure, _mm512_mul_ps(dvy, visc)), scale, sy);
+    sz = _mm512_fmadd_ps(_mm512_fmadd_ps(dz, pressure, _mm512_mul_ps(dvz, visc)), scale, sz);
+  }
+  *ax += _mm512_reduce_add_ps(sx);
+  *ay += _mm512_reduce_add_ps(sy);
+  *az += _mm512_reduce_add_ps(sz);
+}
+
+#pragma GCC diagnostic pop
+#endif //ENABLE_SIMD_SPH_KERNELS
+
+inline density_kernel_fn DensityKernel = DensityKernelScalar;
+inline force_kernel_fn ForceKernel = ForceKernelScalar;
+inline const char *sphKernelName = "scalar";
+
+//Select the widest kernels supported by the CPU
+inline void sph_kernels_init()
+{
+#ifdef ENABLE_SIMD_SPH_KERNELS
+  const char *cap = getenv("FLUIDANIMATE_SIMD");
+  int level = 2;
+  if(cap != NULL) {
+    if(!strcmp(cap, "scalar"))
+      level = 0;
+    else if(!strcmp(cap, "avx2"))
+      level = 1;
+  }
+
+  __builtin_cpu_init();
+  if(level >= 2 && __builtin_cpu_supports("avx512f")) {
+    DensityKernel = DensityKernelAVX512;
+    ForceKernel = ForceKernelAVX512;
+    sphKernelName = "avx512";
+  } else if(level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    DensityKernel = DensityKernelAVX2;
+    ForceKernel = ForceKernelAVX2;
+    sphKernelName = "avx2";
+  }
+#endif //ENABLE_SIMD_SPH_KERNELS
+}
+
+#endif //__SPH_KERNELS_HPP__
@@ -0,0 +1,80 @@
+// anneal_stats.cpp
+//
+// Per temperature step statistics of the annealer
+
+#include <iomanip>
+#include <sstream>
+
+#include "anneal_stats.h"
+
+using namespace std;
+
+void step_stats::clear()
+{
+	moves = 0;
+	accepted_good = 0;
+	accepted_bad = 0;
+	delta_cost = 0;
+	for (int bin = 0; bin < DELTA_BINS; bin++){
+		delta_hist[bin] = 0;
+	}
+}
+
+//*****************************************************************************************
+// Moves that lower the cost are always accepted, so an accepted move is bad if its
+// delta is not negative. cost_change is the exact change of an accepted move, see
+// netlist::swap_cost_correction.
+//*****************************************************************************************
+void step_stats::record(routing_cost_t delta, bool accepted, routing_cost_t cost_change)
+{
+	moves++;
+	delta_hist[delta_bin(delta)]++;
+	if (accepted){
+		if (delta < 0){
+			accepted_good++;
+		} else {
+			accepted_bad++;
+		}
+		delta_cost += cost_change;
+	}
+}
+
+void step_stats::add(const step_stats& other)
+{
+	moves += other.moves;
+	accepted_good += other.accepted_good;
+	accepted_bad += other.accepted_bad;
+	delta_cost += other.delta_cost;
+	for (int bin = 0; bin < DELTA_BINS; bin++){
+		delta_hist[bin] += other.delta_hist[bin];
+	}
+}
+
+double step_stats::acceptance() const
+{
+	return moves > 0 ? (double)(accepted_good + accepted_bad) / moves : 0;
+}
+
+void print_step_header(std::ostream& out)
+{
+	out << setw(6) << "step" << setw(12) << "T" << setw(10) << "moves" << setw(8) << "good%" << setw(8) << "bad%"
+	    << setw(14) << "delta" << setw(14) << "cost" << setw(10) << "ms" << "  deltas <-256 <-32 <-4 <0 0 >0 >4 >32 >256" << endl;
+}
+
+// The line is formatted in its own stream so that the precision and float format
+// of out are left alone
+void print_step(std::ostream& out, int step, double T, const step_stats& stats, routing_cost_t cost, double seconds)
+{
+	double moves = stats.moves > 0 ? stats.moves : 1;
+	ostringstream line;
+	line << setw(6) << step << setw(12) << setprecision(4) << T << setw(10) << stats.moves
+	    << setw(8) << fixed << setprecision(2) << 100.0 * stats.accepted_good / moves
+	    << setw(8) << 100.0 * stats.accepted_bad / moves << defaultfloat
+	    << setw(14) << setprecision(6) << stats.delta_cost << setw(14) << setprecision(9) << cost
+	    << setw(10) << fixed << setprecision(2) << seconds * 1e3 << defaultfloat << "  [";
+	for (int bin = 0; bin < DELTA_BINS; bin++){
+		line << (bin > 0 ? " " : "") << stats.delta_hist[bin];
+	}
+	line << "]";
+	out << line.str() << endl;
+}
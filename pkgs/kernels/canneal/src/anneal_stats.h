@@ -0,0 +1,49 @@
+// anneal_stats.h
+//
+// Per temperature step statistics of the annealer
+//
+// Every thread counts its moves of a step in its own step_stats. After the
+// barrier at the end of the step all threads add up the same slots in the same
+// order, so they all see identical totals and take identical decisions about
+// the next temperature and about stopping. The slots are double buffered by
+// step parity: a thread can only start writing the slots of step k+2 after all
+// threads passed the barrier of step k+1, i.e. after they read step k.
+
+#ifndef ANNEAL_STATS_H
+#define ANNEAL_STATS_H
+
+#include <iostream>
+
+#include "annealer_types.h"
+
+//buckets of the proposed cost deltas, see delta_bin()
+const int DELTA_BINS = 9;
+
+struct step_stats {
+	long moves;
+	long accepted_good;
+	long accepted_bad;
+	routing_cost_t delta_cost;//exact change of the total routing cost by the accepted moves
+	long delta_hist[DELTA_BINS];//proposed moves by cost delta
+
+	void clear();
+	void record(routing_cost_t delta, bool accepted, routing_cost_t cost_change);
+	void add(const step_stats& other);
+	double acceptance() const;
+} __attribute__ ((aligned (64)));
+
+//bucket of a cost delta: < -256, < -32, < -4, < 0, 0, <= 4, <= 32, <= 256, > 256
+inline int delta_bin(routing_cost_t delta)
+{
+	if (delta < 0){
+		return delta < -256 ? 0 : delta < -32 ? 1 : delta < -4 ? 2 : 3;
+	} else if (delta == 0){
+		return 4;
+	}
+	return delta <= 4 ? 5 : delta <= 32 ? 6 : delta <= 256 ? 7 : 8;
+}
+
+void print_step_header(std::ostream& out);
+void print_step(std::ostream& out, int step, double T, const step_stats& stats, routing_cost_t cost, double seconds);
+
+#endif
@@ -34,7 +34,9 @@
 #include "annealer_thread.h"
 #include "location_t.h"
 #include "annealer_types.h"
-#include "netlist_elem.h"
+#include "netlist.h"
+#include <algorithm>
+#include <chrono>
 #include <math.h>
 #include <iostream>
 #include <fstream>
@@ -42,6 +44,17 @@
 
 using std::cout;
 using std::endl;
+using std::max;
+
+//adaptive schedule: stop after STALL_STEPS consecutive steps that accepted less than
+//STALL_ACCEPTANCE of the moves and reduced the cost by less than STALL_FRACTION of the
+//best step
+const int STALL_STEPS = 3;
+const double STALL_ACCEPTANCE = 0.05;
+const double STALL_FRACTION = 0.01;
+
+//ratio of the moves per temperature step of a thread to its cross-region moves
+const int CROSS_MOVE_FRACTION = 8;
 
 
 //*****************************************************************************************
@@ -49,47 +62,158 @@ using std::endl;
 //*****************************************************************************************
 void annealer_thread::Run()
 {
-	int accepted_good_moves=0;
-	int accepted_bad_moves=-1;
 	double T = _start_temp;
-	Rng rng; //store of randomness
+	int thread_id = _next_thread_id++;
+	Rng rng(thread_id); //store of randomness, one stream per thread id
+	candidate_buffer candidates;
+	candidates.pos = CANDIDATE_BLOCK;
+
+	//in partitioned mode the thread id is also the region the thread works on
+	chip_partition::region_stats* region_stats = NULL;
+	bool region_moves = true;
+	if (_partition != NULL){
+		region_stats = &_partition->stats(thread_id);
+		region_moves = _partition->region_size(thread_id) >= 2;
+	}
 	
-	long a_id;
-	long b_id;
-	netlist_elem* a = _netlist->get_random_element(&a_id, NO_MATCHING_ELEMENT, &rng);
-	netlist_elem* b = _netlist->get_random_element(&b_id, NO_MATCHING_ELEMENT, &rng);
+	long a = NO_MATCHING_ELEMENT;
+	long b = NO_MATCHING_ELEMENT;
+	if (_partition == NULL){
+		a = _netlist->get_random_element(NO_MATCHING_ELEMENT, &rng);
+		b = _netlist->get_random_element(NO_MATCHING_ELEMENT, &rng);
+	} else if (region_moves){
+		b = _partition->random_element(thread_id, NO_MATCHING_ELEMENT, &rng);
+	}
+
+	if (thread_id == 0 && _print_stats){
+		print_step_header(cout);
+	}
 
+	step_stats last; //totals of the previous step over all threads
+	last.clear();
+	routing_cost_t cost = _initial_cost; //same running total in every thread
+	convergence_t state = {0, 0};
 	int temp_steps_completed=0; 
-	while(keep_going(temp_steps_completed, accepted_good_moves, accepted_bad_moves)){
-		T = T / 1.5;
-		accepted_good_moves = 0;
-		accepted_bad_moves = 0;
+	while(keep_going(temp_steps_completed, last, &state)){
+		T = next_temperature(T, temp_steps_completed, last);
+		std::chrono::steady_clock::time_point step_start = std::chrono::steady_clock::now();
+		step_stats& stats = _step_stats[temp_steps_completed % 2][thread_id];
+		stats.clear();
+
+		if (_partition != NULL && temp_steps_completed > 0){
+			//the epoch boundary: move elements between pairs of regions
+			stats.delta_cost += exchange_across_regions(thread_id, temp_steps_completed, T, &rng);
+#ifdef ENABLE_THREADS
+			pthread_barrier_wait(&_barrier);
+#endif
+			if (region_moves){
+				b = _partition->random_element(thread_id, NO_MATCHING_ELEMENT, &rng);
+			}
+		}
 		
-		for (int i = 0; i < _moves_per_thread_temp; i++){
+		for (int i = 0; region_moves && i < _moves_per_thread_temp; i++){
 			//get a new element. Only get one new element, so that reuse should help the cache
 			a = b;
-			a_id = b_id;
-			b = _netlist->get_random_element(&b_id, a_id, &rng);
+			b = next_candidate(&candidates, thread_id, a, &rng);
 			
 			routing_cost_t delta_cost = calculate_delta_routing_cost(a,b);
 			move_decision_t is_good_move = accept_move(delta_cost, T, &rng);
 
 			//make the move, and update stats:
-			if (is_good_move == move_decision_accepted_bad){
-				accepted_bad_moves++;
-				_netlist->swap_locations(a,b);
-			} else if (is_good_move == move_decision_accepted_good){
-				accepted_good_moves++;
+			routing_cost_t cost_change = 0;
+			if (is_good_move != move_decision_rejected){
+				cost_change = delta_cost + _netlist->swap_cost_correction(a, b, _netlist->location(a), _netlist->location(b));
 				_netlist->swap_locations(a,b);
-			} else if (is_good_move == move_decision_rejected){
-				//no need to do anything for a rejected move
+			}
+			stats.record(delta_cost, is_good_move != move_decision_rejected, cost_change);
+			if (region_stats != NULL){
+				region_stats->moves++;
+				if (is_good_move != move_decision_rejected){
+					region_stats->accepted++;
+					region_stats->delta_cost += cost_change;
+				}
 			}
 		}
-		temp_steps_completed++;
 #ifdef ENABLE_THREADS
 		pthread_barrier_wait(&_barrier);
 #endif
+		//every thread adds up the same slots, so all of them take the same decisions
+		last.clear();
+		for (int t = 0; t < _nthreads; t++){
+			last.add(_step_stats[temp_steps_completed % 2][t]);
+		}
+		cost += last.delta_cost;
+		if (thread_id == 0 && _print_stats){
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - step_start;
+			print_step(cout, temp_steps_completed, T, last, cost, elapsed.count());
+		}
+		temp_steps_completed++;
+	}
+	if (thread_id == 0){
+		_steps_run = temp_steps_completed;
+		_tracked_cost = cost;
+	}
+}
+
+//*****************************************************************************************
+//  Next random element, different from different_from. The candidates are drawn from
+//  the whole chip, or from the region of the thread in partitioned mode, in blocks of
+//  CANDIDATE_BLOCK.
+//*****************************************************************************************
+long annealer_thread::next_candidate(candidate_buffer* candidates, int region, long different_from, Rng* rng)
+{
+	long id;
+	do {
+		if (candidates->pos == CANDIDATE_BLOCK){
+			long range = _partition == NULL ? _netlist->chip_size() : _partition->region_size(region);
+			rng->rand_fill(candidates->index, CANDIDATE_BLOCK, range);
+			candidates->pos = 0;
+		}
+		id = candidates->index[candidates->pos++];
+		if (_partition != NULL){
+			id = _partition->element(region, id);
+		}
+	} while (id == different_from);
+	return id;
+}
+
+//*****************************************************************************************
+//  Swaps proposed by the lower numbered region of each pair between the two regions,
+//  moves_per_thread_temp / CROSS_MOVE_FRACTION of them per temperature step. Returns
+//  the change of the total routing cost.
+//*****************************************************************************************
+routing_cost_t annealer_thread::exchange_across_regions(int region, int epoch, double T, Rng* rng)
+{
+	int other = _partition->partner(region, epoch);
+	if (other < region){
+		return 0; //no partner, or the partner does the work
+	}
+	long size = _partition->region_size(region);
+	long other_size = _partition->region_size(other);
+	if (size == 0 || other_size == 0){
+		return 0;
 	}
+	routing_cost_t cost_change = 0;
+	chip_partition::region_stats& stats = _partition->stats(region);
+	int moves = max(1, _moves_per_thread_temp / CROSS_MOVE_FRACTION);
+	for (int i = 0; i < moves; i++){
+		long index_a = rng->rand(size);
+		long index_b = rng->rand(other_size);
+		long a = _partition->element(region, index_a);
+		long b = _partition->element(other, index_b);
+
+		routing_cost_t delta_cost = calculate_delta_routing_cost(a,b);
+		stats.cross_moves++;
+		if (accept_move(delta_cost, T, rng) != move_decision_rejected){
+			routing_cost_t change = delta_cost + _netlist->swap_cost_correction(a, b, _netlist->location(a), _netlist->location(b));
+			_netlist->swap_locations(a,b);
+			_partition->exchange(region, index_a, other, index_b);
+			stats.cross_accepted++;
+			stats.cross_delta_cost += change;
+			cost_change += change;
+		}
+	}
+	return cost_change;
 }
 
 //*****************************************************************************************
@@ -113,35 +237,71 @@ annealer_thread::move_decision_t annealer_thread::accept_move(routing_cost_t del
 
 
 //*****************************************************************************************
-//  If get turns out to be expensive, I can reduce the # by passing it into the swap cost fcn
+//  The locations of a and b are read once and passed into the swap cost fcn
 //*****************************************************************************************
-routing_cost_t annealer_thread::calculate_delta_routing_cost(netlist_elem* a, netlist_elem* b)
+routing_cost_t annealer_thread::calculate_delta_routing_cost(long a, long b)
 {
-	location_t* a_loc = a->present_loc.Get();
-	location_t* b_loc = b->present_loc.Get();
+	location_t a_loc = _netlist->location(a);
+	location_t b_loc = _netlist->location(b);
 	
-	routing_cost_t delta_cost = a->swap_cost(a_loc, b_loc);
-	delta_cost += b->swap_cost(b_loc, a_loc);
+	routing_cost_t delta_cost = _netlist->swap_cost(a, a_loc, b_loc);
+	delta_cost += _netlist->swap_cost(b, b_loc, a_loc);
 
 	return delta_cost;
 }
 
 //*****************************************************************************************
-//  Check whether design has converged or maximum number of steps has reached
+//  Check whether design has converged or maximum number of steps has reached.
+//  Only looks at the totals of the last step, so every thread decides the same.
 //*****************************************************************************************
-bool annealer_thread::keep_going(int temp_steps_completed, int accepted_good_moves, int accepted_bad_moves)
+bool annealer_thread::keep_going(int temp_steps_completed, const step_stats& last, convergence_t* state)
 {
-	bool rv;
-
-	if(_number_temp_steps == -1) {
-		//run until design converges
-		rv = _keep_going_global_flag && (accepted_good_moves > accepted_bad_moves);
-		if(!rv) _keep_going_global_flag = false; // signal we have converged
-	} else {
+	if (_number_temp_steps != -1 && temp_steps_completed >= _number_temp_steps){
 		//run a fixed amount of steps
-		rv = temp_steps_completed < _number_temp_steps;
+		return false;
+	}
+	if (temp_steps_completed == 0){
+		return true;
 	}
 
-	return rv;
+	if (_adaptive){
+		//stop once the cost reduction per step has been tiny for a few steps
+		routing_cost_t gain = -last.delta_cost;
+		if (gain > state->best_gain){
+			state->best_gain = gain;
+		}
+		if (state->best_gain > 0 && gain < STALL_FRACTION * state->best_gain &&
+		    last.acceptance() < STALL_ACCEPTANCE){
+			state->stalled++;
+		} else {
+			state->stalled = 0;
+		}
+		return state->stalled < STALL_STEPS;
+	}
+	if (_number_temp_steps == -1){
+		//run until design converges
+		return last.accepted_good > last.accepted_bad;
+	}
+	return true;
 }
 
+//*****************************************************************************************
+//  Temperature of the next step. The adaptive schedule cools fast while almost every
+//  move is accepted or almost none is, and slowly in between where the placement
+//  improves the most (same rule as the VPR placer).
+//*****************************************************************************************
+double annealer_thread::next_temperature(double T, int temp_steps_completed, const step_stats& last)
+{
+	if (!_adaptive || temp_steps_completed == 0){
+		return T / 1.5;
+	}
+	double acceptance = last.acceptance();
+	if (acceptance > 0.96){
+		return T * 0.5;
+	} else if (acceptance > 0.8){
+		return T * 0.9;
+	} else if (acceptance > 0.15){
+		return T * 0.95;
+	}
+	return T * 0.8;
+}
@@ -36,10 +36,13 @@
 #endif
 
 #include <assert.h>
+#include <atomic>
+#include <vector>
 
+#include "anneal_stats.h"
 #include "annealer_types.h"
+#include "chip_partition.h"
 #include "netlist.h"
-#include "netlist_elem.h"
 #include "rng.h"
 
 class annealer_thread 
@@ -56,15 +59,28 @@ public:
 		int nthreads,
 		int swaps_per_temp,
 		int start_temp,
-		int number_temp_steps
+		int number_temp_steps,
+		routing_cost_t initial_cost,
+		chip_partition* partition = NULL,
+		bool adaptive = false,
+		bool print_stats = false
 	)
 	:_netlist(netlist),
-	_keep_going_global_flag(true),
+	_partition(partition),
+	_next_thread_id(0),
+	_nthreads(nthreads),
 	_moves_per_thread_temp(swaps_per_temp/nthreads),
 	_start_temp(start_temp),
-	_number_temp_steps(number_temp_steps)
+	_number_temp_steps(number_temp_steps),
+	_adaptive(adaptive),
+	_print_stats(print_stats),
+	_steps_run(0),
+	_initial_cost(initial_cost),
+	_tracked_cost(initial_cost)
 	{
 		assert(_netlist != NULL);
+		_step_stats[0].resize(nthreads);
+		_step_stats[1].resize(nthreads);
 #ifdef ENABLE_THREADS
 		pthread_barrier_init(&_barrier, NULL, nthreads);
 #endif
@@ -76,18 +92,46 @@ public:
 #endif
 	}					
 	void Run();
+	int steps_run() const { return _steps_run; }
+	//total routing cost before the run and after it, as tracked from the accepted moves
+	routing_cost_t initial_cost() const { return _initial_cost; }
+	routing_cost_t tracked_cost() const { return _tracked_cost; }
 					
 protected:
+	//a block of random element indices, consumed from pos on
+	static const int CANDIDATE_BLOCK = 256;
+	struct candidate_buffer {
+		uint32_t index[CANDIDATE_BLOCK];
+		int pos;
+	};
+
+	//state of the stall detection of the adaptive schedule
+	struct convergence_t {
+		routing_cost_t best_gain;//largest cost reduction of a single step so far
+		int stalled;//consecutive steps with a much smaller reduction
+	};
+
 	move_decision_t accept_move(routing_cost_t delta_cost, double T, Rng* rng);
-	routing_cost_t calculate_delta_routing_cost(netlist_elem* a, netlist_elem* b);
-	bool keep_going(int temp_steps_completed, int accepted_good_moves, int accepted_bad_moves);
+	routing_cost_t calculate_delta_routing_cost(long a, long b);
+	long next_candidate(candidate_buffer* candidates, int region, long different_from, Rng* rng);
+	routing_cost_t exchange_across_regions(int region, int epoch, double T, Rng* rng);
+	bool keep_going(int temp_steps_completed, const step_stats& last, convergence_t* state);
+	double next_temperature(double T, int temp_steps_completed, const step_stats& last);
 
 protected:
 	netlist* _netlist;		
-	bool _keep_going_global_flag;
+	chip_partition* _partition;//NULL unless running in partitioned mode
+	std::atomic<int> _next_thread_id;
+	int _nthreads;
 	int _moves_per_thread_temp;
 	int _start_temp;
 	int _number_temp_steps;
+	bool _adaptive;//adaptive cooling and early termination
+	bool _print_stats;
+	int _steps_run;
+	routing_cost_t _initial_cost;
+	routing_cost_t _tracked_cost;
+	std::vector<step_stats> _step_stats[2];//one slot per thread, double buffered by step parity
 #ifdef ENABLE_THREADS
 	pthread_barrier_t _barrier;
 #endif
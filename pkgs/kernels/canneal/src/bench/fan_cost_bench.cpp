@@ -0,0 +1,125 @@
+// fan_cost_bench.cpp
+//
+// Microbenchmark for the routing cost kernels of canneal
+//
+// Builds a random netlist in the same CSR form as netlist.cpp, with elements
+// scattered over a square chip and a fixed fan-in/fan-out count per element,
+// and evaluates swap costs of random element pairs the way
+// annealer_thread::calculate_delta_routing_cost does. Every kernel supported
+// by the CPU is timed on the same pairs and checked against the scalar one.
+//
+// Usage: fan_cost_bench [elements] [fanout] [swaps]
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../fan_cost.h"
+
+using namespace std;
+
+struct bench_netlist {
+	long num;
+	int fanout;
+	vector<uint32_t> fan;//fanout neighbours of element i at [i*fanout, (i+1)*fanout)
+	unique_ptr<atomic<uint64_t>[]> locs;
+};
+
+static void build(bench_netlist* net, long num, int fanout)
+{
+	mt19937 gen(3);
+	long side = 1;
+	while (side * side < num){
+		side++;
+	}
+	net->num = num;
+	net->fanout = fanout;
+	net->fan.resize(num * fanout);
+	for (size_t i = 0; i < net->fan.size(); ++i){
+		net->fan[i] = gen() % num;
+	}
+	net->locs.reset(new atomic<uint64_t>[num]);
+	for (long i = 0; i < num; ++i){
+		location_t loc;
+		loc.x = gen() % side;
+		loc.y = gen() % side;
+		net->locs[i].store(pack_loc(loc), memory_order_relaxed);
+	}
+}
+
+//Time swaps delta costs with kernel, return the seconds and the sum of all deltas
+static double run(const bench_netlist& net, const vector<uint32_t>& pairs, fan_cost_fn kernel, double* checksum)
+{
+	double sum = 0;
+	auto start = chrono::steady_clock::now();
+	for (size_t p = 0; p + 1 < pairs.size(); p += 2){
+		uint32_t a = pairs[p];
+		uint32_t b = pairs[p + 1];
+		location_t a_loc = unpack_loc(net.locs[a].load(memory_order_relaxed));
+		location_t b_loc = unpack_loc(net.locs[b].load(memory_order_relaxed));
+		routing_cost_t no, yes;
+		kernel(&net.fan[(size_t)a * net.fanout], net.fanout, net.locs.get(), a_loc, b_loc, &no, &yes);
+		sum += yes - no;
+		kernel(&net.fan[(size_t)b * net.fanout], net.fanout, net.locs.get(), b_loc, a_loc, &no, &yes);
+		sum += yes - no;
+	}
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	*checksum = sum;
+	return elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+	long num = argc > 1 ? atol(argv[1]) : 1000000;
+	int fanout = argc > 2 ? atoi(argv[2]) : 16;
+	long swaps = argc > 3 ? atol(argv[3]) : 2000000;
+	if (num < 2 || fanout < 1 || swaps < 1){
+		cerr << "Usage: " << argv[0] << " [elements] [fanout] [swaps]" << endl;
+		return 1;
+	}
+
+	bench_netlist net;
+	build(&net, num, fanout);
+	mt19937 gen(7);
+	vector<uint32_t> pairs(2 * swaps);
+	for (size_t i = 0; i < pairs.size(); ++i){
+		pairs[i] = gen() % num;
+	}
+
+	struct { const char* name; fan_cost_fn kernel; } kernels[] = {
+		{"scalar", fan_cost_scalar},
+#ifdef ENABLE_SIMD_FAN_COST
+		{"avx2", fan_cost_avx2},
+		{"avx512", fan_cost_avx512},
+#endif
+	};
+
+	cout << "elements: " << num << ", fanout: " << fanout << ", swaps: " << swaps << endl;
+	cout << setw(8) << "kernel" << setw(14) << "ns/neighbour" << setw(10) << "speedup" << "  result" << endl;
+	double t_scalar = 0;
+	double ref = 0;
+	__builtin_cpu_init();
+	for (auto& k : kernels){
+		string name(k.name);
+		if ((name == "avx2" && !__builtin_cpu_supports("avx2")) ||
+		    (name == "avx512" && !__builtin_cpu_supports("avx512f"))){
+			continue;
+		}
+		double checksum;
+		double t = run(net, pairs, k.kernel, &checksum);
+		if (name == "scalar"){
+			t_scalar = t;
+			ref = checksum;
+		}
+		double neighbours = 2.0 * swaps * fanout;
+		cout << setw(8) << name << setw(14) << fixed << setprecision(3) << t * 1e9 / neighbours
+		     << setw(9) << setprecision(2) << t_scalar / t << "x  "
+		     << (checksum == ref ? "ok" : "MISMATCH") << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+// chip_partition.cpp
+//
+// Spatial partition of the chip for the partitioned annealing mode
+
+#include <iomanip>
+#include <math.h>
+
+#include "chip_partition.h"
+#include "location_t.h"
+#include "rng.h"
+
+using namespace std;
+
+//*****************************************************************************************
+// Splits the chip into tiles_x * tiles_y == nregions tiles, as close to square as the
+// number of regions allows, and sorts the elements into them by present location
+//*****************************************************************************************
+chip_partition::chip_partition(netlist* netlist, int nregions)
+:_nregions(nregions),
+_elems(nregions),
+_stats(nregions)
+{
+	_tiles_x = 1;
+	for (int d = 1; d * d <= nregions; d++){
+		if (nregions % d == 0){
+			_tiles_x = d;
+		}
+	}
+	_tiles_y = nregions / _tiles_x;
+
+	long max_x = netlist->max_x();
+	long max_y = netlist->max_y();
+	for (long elem = 0; elem < netlist->chip_size(); elem++){
+		location_t loc = netlist->location(elem);
+		int region = (loc.x * _tiles_x / max_x) * _tiles_y + loc.y * _tiles_y / max_y;
+		_elems[region].push_back(elem);
+	}
+	for (int region = 0; region < nregions; region++){
+		_stats[region] = region_stats();
+	}
+}
+
+//*****************************************************************************************
+// Same retry loop as netlist::get_random_element
+//*****************************************************************************************
+long chip_partition::random_element(int region, long different_from, Rng* rng)
+{
+	const std::vector<uint32_t>& elems = _elems[region];
+	long id = elems[rng->rand(elems.size())];
+	while (id == different_from){
+		id = elems[rng->rand(elems.size())];
+	}
+	return id;
+}
+
+//*****************************************************************************************
+// Round robin pairing (circle method). With an odd number of regions one of them sits
+// out each step.
+//*****************************************************************************************
+int chip_partition::partner(int region, int epoch) const
+{
+	int slots = _nregions + (_nregions % 2);
+	if (slots < 2){
+		return -1;
+	}
+	int round = epoch % (slots - 1);
+	int other;
+	if (region == slots - 1){
+		other = round;
+	} else if (region == round){
+		other = slots - 1;
+	} else {
+		other = ((2 * round - region) % (slots - 1) + (slots - 1)) % (slots - 1);
+	}
+	return other < _nregions ? other : -1;
+}
+
+//*****************************************************************************************
+//
+//*****************************************************************************************
+void chip_partition::exchange(int region_a, long index_a, int region_b, long index_b)
+{
+	std::swap(_elems[region_a][index_a], _elems[region_b][index_b]);
+}
+
+//*****************************************************************************************
+//  not threadsafe, call after the annealing
+//*****************************************************************************************
+void chip_partition::print_report(std::ostream& out) const
+{
+	out << "partitioned annealing: " << _nregions << " regions (" << _tiles_x << " x " << _tiles_y << " tiles)" << endl;
+	out << setw(7) << "region" << setw(10) << "elements" << setw(11) << "moves" << setw(10) << "accepted"
+	    << setw(14) << "delta" << setw(10) << "cross" << setw(10) << "accepted" << setw(14) << "cross delta" << endl;
+	long moves = 0, cross_moves = 0;
+	routing_cost_t delta = 0, cross_delta = 0;
+	for (int region = 0; region < _nregions; region++){
+		const region_stats& st = _stats[region];
+		out << setw(7) << region << setw(10) << _elems[region].size() << setw(11) << st.moves
+		    << setw(10) << st.accepted << setw(14) << st.delta_cost << setw(10) << st.cross_moves
+		    << setw(10) << st.cross_accepted << setw(14) << st.cross_delta_cost << endl;
+		moves += st.moves;
+		cross_moves += st.cross_moves;
+		delta += st.delta_cost;
+		cross_delta += st.cross_delta_cost;
+	}
+	out << "cross-region moves: " << cross_moves << " of " << moves + cross_moves
+	    << ", cost change inside regions: " << delta << ", across regions: " << cross_delta << endl;
+}
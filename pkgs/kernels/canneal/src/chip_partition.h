@@ -0,0 +1,67 @@
+// chip_partition.h
+//
+// Spatial partition of the chip for the partitioned annealing mode
+//
+// The locations of the chip are split into nregions rectangular tiles, one
+// per annealer thread. Each region keeps the list of elements that are
+// presently located in it. During a temperature step a thread only proposes
+// swaps between two elements of its own region, so the list does not change
+// and the threads mostly touch disjoint parts of the location array.
+//
+// At the end of every temperature step the regions are paired up (round robin
+// over the steps, so that every region meets every other one) and the lower
+// numbered thread of each pair proposes swaps between the two regions. Only
+// that thread touches the lists of the pair, and accepted swaps exchange the
+// two elements between the lists.
+
+#ifndef CHIP_PARTITION_H
+#define CHIP_PARTITION_H
+
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+
+#include "annealer_types.h"
+#include "netlist.h"
+
+class Rng;
+
+class chip_partition
+{
+public:
+	//per region counters, each on its own cache line
+	struct region_stats {
+		long moves;
+		long accepted;
+		routing_cost_t delta_cost;//sum of the accepted swaps inside the region
+		long cross_moves;
+		long cross_accepted;
+		routing_cost_t cross_delta_cost;//sum of the accepted swaps with other regions
+	} __attribute__ ((aligned (64)));
+
+	chip_partition(netlist* netlist, int nregions);
+
+	int num_regions() const { return _nregions; }
+	long region_size(int region) const { return _elems[region].size(); }
+
+	//random element of region that is not different_from, the region must have two elements
+	long random_element(int region, long different_from, Rng* rng);
+	//region that trades elements with region after temperature step epoch, or -1
+	int partner(int region, int epoch) const;
+	//the element at index of the list of region
+	long element(int region, long index) const { return _elems[region][index]; }
+	//record that the elements at index_a of region_a and index_b of region_b swapped locations
+	void exchange(int region_a, long index_a, int region_b, long index_b);
+
+	region_stats& stats(int region) { return _stats[region]; }
+	void print_report(std::ostream& out) const;
+
+protected:
+	int _nregions;
+	int _tiles_x;
+	int _tiles_y;
+	std::vector< std::vector<uint32_t> > _elems;//elements presently located in each region
+	std::vector<region_stats> _stats;
+};
+
+#endif
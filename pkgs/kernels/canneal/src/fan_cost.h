@@ -0,0 +1,222 @@
+// fan_cost.h
+//
+// Routing cost kernels for canneal
+//
+// fan_cost(fan, count, locs, old_loc, new_loc, &no_swap, &yes_swap) sums the
+// Manhattan distances from old_loc and from new_loc to the present locations
+// of the count elements fan[0..count-1]. locs is the packed location array of
+// the netlist, see location_t.h.
+//
+// The scalar kernel is the original loop. The vector kernels gather 4 (AVX2)
+// or 8 (AVX-512) packed locations at once and work on the x and y halves as
+// independent 32-bit lanes. All distances are integers, so the sums are exact
+// and every kernel returns the same costs. A gathered word that is LOC_BUSY
+// belongs to an element that is being swapped; that group is loaded again
+// element by element, which spins like netlist::location().
+//
+// The kernel is picked by fan_cost_init() based on the CPU; the environment
+// variable CANNEAL_SIMD (scalar, avx2 or avx512) caps the choice.
+
+#ifndef FAN_COST_H
+#define FAN_COST_H
+
+#include <atomic>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+#include "annealer_types.h"
+#include "location_t.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENABLE_SIMD_FAN_COST
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "packed locations must be plain words");
+
+typedef void (*fan_cost_fn)(const uint32_t* fan, long count, const std::atomic<uint64_t>* locs,
+                            location_t old_loc, location_t new_loc,
+                            routing_cost_t* no_swap, routing_cost_t* yes_swap);
+
+inline location_t fan_cost_load(const std::atomic<uint64_t>* locs, uint32_t elem)
+{
+	uint64_t packed = locs[elem].load(std::memory_order_acquire);
+#ifdef ENABLE_THREADS
+	while (packed == LOC_BUSY){
+		packed = locs[elem].load(std::memory_order_acquire);
+	}
+#endif
+	return unpack_loc(packed);
+}
+
+//Reference kernel, same operation order as the original swap_cost
+inline void fan_cost_scalar(const uint32_t* fan, long count, const std::atomic<uint64_t>* locs,
+                            location_t old_loc, location_t new_loc,
+                            routing_cost_t* no_swap, routing_cost_t* yes_swap)
+{
+	routing_cost_t no = 0;
+	routing_cost_t yes = 0;
+	for (long i = 0; i < count; ++i){
+		location_t fan_loc = fan_cost_load(locs, fan[i]);
+		no += fabs(old_loc.x - fan_loc.x);
+		no += fabs(old_loc.y - fan_loc.y);
+
+		yes += fabs(new_loc.x - fan_loc.x);
+		yes += fabs(new_loc.y - fan_loc.y);
+	}
+	*no_swap = no;
+	*yes_swap = yes;
+}
+
+#ifdef ENABLE_SIMD_FAN_COST
+//The 32-bit lane sums are flushed into 64-bit totals after this many vector
+//steps, which keeps them from overflowing for any chip that fits in memory
+const long FAN_COST_FLUSH = 256;
+
+//Distances of the elements fan[begin..count-1], summed into no and yes
+inline void fan_cost_tail(const uint32_t* fan, long begin, long count, const std::atomic<uint64_t>* locs,
+                          location_t old_loc, location_t new_loc, int64_t* no, int64_t* yes)
+{
+	for (long i = begin; i < count; ++i){
+		location_t fan_loc = fan_cost_load(locs, fan[i]);
+		*no += abs(old_loc.x - fan_loc.x) + abs(old_loc.y - fan_loc.y);
+		*yes += abs(new_loc.x - fan_loc.x) + abs(new_loc.y - fan_loc.y);
+	}
+}
+
+__attribute__((target("avx2")))
+inline int64_t fan_cost_hsum_avx2(__m256i v)
+{
+	__m256i lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v));
+	__m256i hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1));
+	__m256i s = _mm256_add_epi64(lo, hi);
+	__m128i t = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+	return _mm_cvtsi128_si64(t) + _mm_extract_epi64(t, 1);
+}
+
+__attribute__((target("avx2")))
+inline void fan_cost_avx2(const uint32_t* fan, long count, const std::atomic<uint64_t>* locs,
+                          location_t old_loc, location_t new_loc,
+                          routing_cost_t* no_swap, routing_cost_t* yes_swap)
+{
+	if (count < 4){
+		fan_cost_scalar(fan, count, locs, old_loc, new_loc, no_swap, yes_swap);
+		return;
+	}
+	const long long* base = reinterpret_cast<const long long*>(locs);
+	const __m256i old_v = _mm256_set1_epi64x((long long)pack_loc(old_loc));
+	const __m256i new_v = _mm256_set1_epi64x((long long)pack_loc(new_loc));
+	const __m256i busy = _mm256_set1_epi64x(-1);
+	int64_t no = 0;
+	int64_t yes = 0;
+	long i = 0;
+	while (i + 4 <= count){
+		__m256i acc_no = _mm256_setzero_si256();
+		__m256i acc_yes = _mm256_setzero_si256();
+		for (long step = 0; step < FAN_COST_FLUSH && i + 4 <= count; ++step, i += 4){
+			__m128i idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fan + i));
+			__m256i v = _mm256_i32gather_epi64(base, idx, 8);
+			if (!_mm256_testz_si256(_mm256_cmpeq_epi64(v, busy), busy)){
+				v = _mm256_setr_epi64x((long long)pack_loc(fan_cost_load(locs, fan[i])),
+				                       (long long)pack_loc(fan_cost_load(locs, fan[i + 1])),
+				                       (long long)pack_loc(fan_cost_load(locs, fan[i + 2])),
+				                       (long long)pack_loc(fan_cost_load(locs, fan[i + 3])));
+			}
+			acc_no = _mm256_add_epi32(acc_no, _mm256_abs_epi32(_mm256_sub_epi32(v, old_v)));
+			acc_yes = _mm256_add_epi32(acc_yes, _mm256_abs_epi32(_mm256_sub_epi32(v, new_v)));
+		}
+		no += fan_cost_hsum_avx2(acc_no);
+		yes += fan_cost_hsum_avx2(acc_yes);
+	}
+	fan_cost_tail(fan, i, count, locs, old_loc, new_loc, &no, &yes);
+	*no_swap = (routing_cost_t)no;
+	*yes_swap = (routing_cost_t)yes;
+}
+
+//the AVX-512 intrinsics of GCC 12 trip -Wmaybe-uninitialized on their own
+//placeholder operands
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+inline int64_t fan_cost_hsum_avx512(__m512i v)
+{
+	__m512i lo = _mm512_cvtepu32_epi64(_mm512_castsi512_si256(v));
+	__m512i hi = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v, 1));
+	return _mm512_reduce_add_epi64(_mm512_add_epi64(lo, hi));
+}
+
+__attribute__((target("avx512f")))
+inline void fan_cost_avx512(const uint32_t* fan, long count, const std::atomic<uint64_t>* locs,
+                            location_t old_loc, location_t new_loc,
+                            routing_cost_t* no_swap, routing_cost_t* yes_swap)
+{
+	const long long* base = reinterpret_cast<const long long*>(locs);
+	const __m512i old_v = _mm512_set1_epi64((long long)pack_loc(old_loc));
+	const __m512i new_v = _mm512_set1_epi64((long long)pack_loc(new_loc));
+	const __m512i busy = _mm512_set1_epi64(-1);
+	int64_t no = 0;
+	int64_t yes = 0;
+	long i = 0;
+	while (i + 8 <= count){
+		__m512i acc_no = _mm512_setzero_si512();
+		__m512i acc_yes = _mm512_setzero_si512();
+		for (long step = 0; step < FAN_COST_FLUSH && i + 8 <= count; ++step, i += 8){
+			__m256i idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(fan + i));
+			__m512i v = _mm512_mask_i32gather_epi64(_mm512_setzero_si512(), 0xff, idx, base, 8);
+			__mmask8 busy_lanes = _mm512_cmpeq_epi64_mask(v, busy);
+			if (busy_lanes){
+				long long reload[8];
+				for (int k = 0; k < 8; ++k){
+					reload[k] = (long long)pack_loc(fan_cost_load(locs, fan[i + k]));
+				}
+				v = _mm512_loadu_si512(reload);
+			}
+			acc_no = _mm512_add_epi32(acc_no, _mm512_abs_epi32(_mm512_sub_epi32(v, old_v)));
+			acc_yes = _mm512_add_epi32(acc_yes, _mm512_abs_epi32(_mm512_sub_epi32(v, new_v)));
+		}
+		no += fan_cost_hsum_avx512(acc_no);
+		yes += fan_cost_hsum_avx512(acc_yes);
+	}
+	//the last up to 7 neighbours, most elements have only a few
+	routing_cost_t tail_no, tail_yes;
+	fan_cost_avx2(fan + i, count - i, locs, old_loc, new_loc, &tail_no, &tail_yes);
+	*no_swap = (routing_cost_t)no + tail_no;
+	*yes_swap = (routing_cost_t)yes + tail_yes;
+}
+
+#pragma GCC diagnostic pop
+#endif //ENABLE_SIMD_FAN_COST
+
+inline fan_cost_fn fan_cost = fan_cost_scalar;
+inline const char* fan_cost_name = "scalar";
+
+//Select the widest kernel supported by the CPU
+inline void fan_cost_init()
+{
+#ifdef ENABLE_SIMD_FAN_COST
+	const char* cap = getenv("CANNEAL_SIMD");
+	int level = 2;
+	if (cap != NULL){
+		std::string s(cap);
+		if (s == "scalar"){
+			level = 0;
+		} else if (s == "avx2"){
+			level = 1;
+		}
+	}
+
+	__builtin_cpu_init();
+	if (level >= 2 && __builtin_cpu_supports("avx512f")){
+		fan_cost = fan_cost_avx512;
+		fan_cost_name = "avx512";
+	} else if (level >= 1 && __builtin_cpu_supports("avx2")){
+		fan_cost = fan_cost_avx2;
+		fan_cost_name = "avx2";
+	}
+#endif //ENABLE_SIMD_FAN_COST
+}
+
+#endif
@@ -30,11 +30,30 @@
 #ifndef LOCATION_T_H
 #define LOCATION_T_H
 
+#include <stdint.h>
+
 class location_t {
 public:
 	int x;
 	int y;
 };
 
+//a location packed into one word, x in the low and y in the high half
+inline uint64_t pack_loc(location_t loc)
+{
+	return (uint64_t)(uint32_t)loc.x | ((uint64_t)(uint32_t)loc.y << 32);
+}
+
+inline location_t unpack_loc(uint64_t packed)
+{
+	location_t loc;
+	loc.x = (int)(uint32_t)packed;
+	loc.y = (int)(uint32_t)(packed >> 32);
+	return loc;
+}
+
+//packed value of a location that is being swapped, not a valid location
+const uint64_t LOC_BUSY = ~(uint64_t)0;
+
 #endif
 
@@ -28,9 +28,11 @@
 // SUCH DAMAGE.
 
 
+#include <chrono>
 #include <iostream>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <vector>
 
@@ -44,12 +46,20 @@
 
 #include "annealer_types.h"
 #include "annealer_thread.h"
+#include "chip_partition.h"
+#include "fan_cost.h"
 #include "netlist.h"
 #include "rng.h"
 
 using namespace std;
 
 void* entry_pt(void*);
+struct anneal_options {
+	bool adaptive;
+	bool print_stats;
+	bool verify;
+};
+double anneal(netlist* my_netlist, int num_threads, int swaps_per_temp, int start_temp, int number_temp_steps, routing_cost_t initial_cost, chip_partition* partition, const anneal_options& options);
 
 
 
@@ -67,13 +77,40 @@ int main (int argc, char * const argv[]) {
 
 	srandom(3);
 
+	//options may appear anywhere, the remaining arguments are positional
+	bool partitioned = false;
+	bool compare = false;
+	anneal_options options = {false, false, false};
+	std::vector<char*> args;
+	for (int i = 0; i < argc; i++){
+		if (strcmp(argv[i], "--partition") == 0){
+			partitioned = true;
+		} else if (strcmp(argv[i], "--compare") == 0){
+			compare = true;
+		} else if (strcmp(argv[i], "--adaptive") == 0){
+			options.adaptive = true;
+		} else if (strcmp(argv[i], "--stats") == 0){
+			options.print_stats = true;
+		} else if (strcmp(argv[i], "--verify") == 0){
+			options.verify = true;
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+	argc = args.size();
+
 	if(argc != 5 && argc != 6) {
-		cout << "Usage: " << argv[0] << " NTHREADS NSWAPS TEMP NETLIST [NSTEPS]" << endl;
+		cout << "Usage: " << argv[0] << " [--partition] [--compare] [--adaptive] [--stats] [--verify] NTHREADS NSWAPS TEMP NETLIST [NSTEPS]" << endl;
+		cout << "  --partition  each thread anneals its own region of the chip" << endl;
+		cout << "  --compare    run the default and the partitioned mode from the same placement and seeds" << endl;
+		cout << "  --adaptive   cool by acceptance ratio and stop when the cost stops improving" << endl;
+		cout << "  --stats      print the statistics of every temperature step" << endl;
+		cout << "  --verify     recompute the routing cost after the run and compare it with the tracked one" << endl;
 		exit(1);
 	}	
 	
 	//argument 1 is numthreads
-	int num_threads = atoi(argv[1]);
+	int num_threads = atoi(args[1]);
 	cout << "Threadcount: " << num_threads << endl;
 #ifndef ENABLE_THREADS
 	if (num_threads != 1){
@@ -83,32 +120,75 @@ int main (int argc, char * const argv[]) {
 #endif
 		
 	//argument 2 is the num moves / temp
-	int swaps_per_temp = atoi(argv[2]);
+	int swaps_per_temp = atoi(args[2]);
 	cout << swaps_per_temp << " swaps per temperature step" << endl;
 
 	//argument 3 is the start temp
-	int start_temp =  atoi(argv[3]);
+	int start_temp =  atoi(args[3]);
 	cout << "start temperature: " << start_temp << endl;
 	
 	//argument 4 is the netlist filename
-	string filename(argv[4]);
+	string filename(args[4]);
 	cout << "netlist filename: " << filename << endl;
 	
 	//argument 5 (optional) is the number of temperature steps before termination
 	int number_temp_steps = -1;
         if(argc == 6) {
-		number_temp_steps = atoi(argv[5]);
+		number_temp_steps = atoi(args[5]);
 		cout << "number of temperature steps: " << number_temp_steps << endl;
         }
 
+	fan_cost_init();
+	cout << "routing cost kernel: " << fan_cost_name << endl;
+
 	//now that we've read in the commandline, run the program
-	netlist my_netlist(filename);
-	
-	annealer_thread a_thread(&my_netlist,num_threads,swaps_per_temp,start_temp,number_temp_steps);
+	netlist my_netlist(filename, num_threads);
+	//the full cost pass stays outside the region of interest
+	routing_cost_t initial_cost = my_netlist.total_routing_cost(num_threads);
 	
 #ifdef ENABLE_PARSEC_HOOKS
 	__parsec_roi_begin();
 #endif
+	if (compare){
+		std::vector<uint64_t> placement;
+		my_netlist.save_locations(&placement);
+		double time_default = anneal(&my_netlist, num_threads, swaps_per_temp, start_temp, number_temp_steps, initial_cost, NULL, options);
+		routing_cost_t cost_default = my_netlist.total_routing_cost(num_threads);
+
+		my_netlist.restore_locations(placement);
+		chip_partition partition(&my_netlist, num_threads);
+		double time_partitioned = anneal(&my_netlist, num_threads, swaps_per_temp, start_temp, number_temp_steps, initial_cost, &partition, options);
+		routing_cost_t cost_partitioned = my_netlist.total_routing_cost(num_threads);
+		partition.print_report(cout);
+
+		cout << "default:     routing " << cost_default << ", " << time_default << " s" << endl;
+		cout << "partitioned: routing " << cost_partitioned << ", " << time_partitioned << " s, "
+		     << 100.0 * (cost_partitioned - cost_default) / cost_default << "% cost" << endl;
+	} else if (partitioned){
+		chip_partition partition(&my_netlist, num_threads);
+		anneal(&my_netlist, num_threads, swaps_per_temp, start_temp, number_temp_steps, initial_cost, &partition, options);
+		partition.print_report(cout);
+	} else {
+		anneal(&my_netlist, num_threads, swaps_per_temp, start_temp, number_temp_steps, initial_cost, NULL, options);
+	}
+#ifdef ENABLE_PARSEC_HOOKS
+	__parsec_roi_end();
+#endif
+	
+	cout << "Final routing is: " << my_netlist.total_routing_cost(num_threads) << endl;
+
+#ifdef ENABLE_PARSEC_HOOKS
+	__parsec_bench_end();
+#endif
+
+	return 0;
+}
+
+//runs the annealer and returns the wall time in seconds
+double anneal(netlist* my_netlist, int num_threads, int swaps_per_temp, int start_temp, int number_temp_steps, routing_cost_t initial_cost, chip_partition* partition, const anneal_options& options)
+{
+	annealer_thread a_thread(my_netlist,num_threads,swaps_per_temp,start_temp,number_temp_steps,initial_cost,partition,options.adaptive,options.print_stats);
+	auto start = std::chrono::steady_clock::now();
 #ifdef ENABLE_THREADS
 	std::vector<pthread_t> threads(num_threads);
 	void* thread_in = static_cast<void*>(&a_thread);
@@ -121,17 +201,15 @@ int main (int argc, char * const argv[]) {
 #else
 	a_thread.Run();
 #endif
-#ifdef ENABLE_PARSEC_HOOKS
-	__parsec_roi_end();
-#endif
-	
-	cout << "Final routing is: " << my_netlist.total_routing_cost() << endl;
-
-#ifdef ENABLE_PARSEC_HOOKS
-	__parsec_bench_end();
-#endif
-
-	return 0;
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	cout << "temperature steps: " << a_thread.steps_run() << ", " << elapsed.count() << " s" << endl;
+	cout << "routing cost: " << a_thread.initial_cost() << " -> " << a_thread.tracked_cost() << endl;
+	if (options.verify){
+		routing_cost_t recomputed = my_netlist->total_routing_cost(num_threads);
+		cout << "cost check: tracked " << a_thread.tracked_cost() << ", recomputed " << recomputed
+		     << ", drift " << a_thread.tracked_cost() - recomputed << endl;
+	}
+	return elapsed.count();
 }
 
 void* entry_pt(void* data)
@@ -27,37 +27,138 @@
 // SUCH DAMAGE.
 
 
+#include "fan_cost.h"
 #include "location_t.h"
 #include "netlist.h"
-#include "netlist_elem.h"
 #include "rng.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 using namespace std;
 
-void netlist::release(netlist_elem* elem)
+//*****************************************************************************************
+// Calculates the routing cost using the manhatten distance
+//*****************************************************************************************
+routing_cost_t netlist::routing_cost_given_loc(long elem, location_t loc) const
 {
-	return;
+	routing_cost_t total_cost, unused;
+	fan_cost(_fan.data() + _fan_start[elem], _fan_start[elem + 1] - _fan_start[elem], _locs.get(),
+	         loc, loc, &total_cost, &unused);
+	return total_cost;
 }
 
+//*****************************************************************************************
+//  Get the cost change of moving elem from old_loc to new_loc
+//*****************************************************************************************
+routing_cost_t netlist::swap_cost(long elem, location_t old_loc, location_t new_loc) const
+{
+	routing_cost_t no_swap, yes_swap;
+	fan_cost(_fan.data() + _fan_start[elem], _fan_start[elem + 1] - _fan_start[elem], _locs.get(),
+	         old_loc, new_loc, &no_swap, &yes_swap);
+	return yes_swap - no_swap;
+}
+
+
+//*****************************************************************************************
+// Correction that turns swap_cost(a) + swap_cost(b) into the exact change of the total
+// routing cost. swap_cost reads the present location of every neighbour, which is wrong
+// for the neighbours that move too: an edge between a and b keeps its length but counts
+// as shortened twice, and an edge from an element to itself counts as the swap
+// distance. Only scans the two adjacency lists, so call it for accepted moves.
+//*****************************************************************************************
+routing_cost_t netlist::swap_cost_correction(long a, long b, location_t a_loc, location_t b_loc) const
+{
+	long a_to_b = 0;
+	long self = 0;
+	for (uint32_t i = _fan_start[a]; i < _fan_start[a + 1]; ++i){
+		a_to_b += _fan[i] == b;
+		self += _fan[i] == a;
+	}
+	for (uint32_t i = _fan_start[b]; i < _fan_start[b + 1]; ++i){
+		self += _fan[i] == b;
+	}
+	routing_cost_t distance = fabs(a_loc.x - b_loc.x) + fabs(a_loc.y - b_loc.y);
+	return (2 * a_to_b - self) * distance;
+}
 
 //*****************************************************************************************
 //not thread safe, tho i could make it so if i needed to
 //only look at the non_blank elements:  this saves some time
 //*****************************************************************************************
 routing_cost_t netlist::total_routing_cost()
+{
+	return routing_cost_range(0, _num_named) / 2; //since routing_cost calculates both input and output routing, we have double counted
+}
+
+routing_cost_t netlist::routing_cost_range(long begin, long end)
 {
 	routing_cost_t rval = 0;
-	for (std::map<std::string, netlist_elem*>::iterator iter = _elem_names.begin();
-		 iter != _elem_names.end();
-		 ++iter){
-		netlist_elem* elem = iter->second;
-		rval += elem->routing_cost_given_loc(*(elem->present_loc.Get()));
+	for (long elem = begin; elem < end; ++elem){
+		rval += routing_cost_given_loc(elem, location(elem));
 	}
-	return rval / 2; //since routing_cost calculates both input and output routing, we have double counted
+	return rval;
+}
+
+#ifdef ENABLE_THREADS
+struct routing_cost_job {
+	netlist* net;
+	long begin;
+	long end;
+	routing_cost_t cost;
+};
+
+static void* routing_cost_thread(void* arg)
+{
+	routing_cost_job* job = static_cast<routing_cost_job*>(arg);
+	job->cost = job->net->routing_cost_range(job->begin, job->end);
+	return NULL;
+}
+#endif
+
+//*****************************************************************************************
+// Same as total_routing_cost, with the elements split into nthreads contiguous ranges.
+// Used to verify the cost tracked by the annealer, must not run during the annealing.
+//*****************************************************************************************
+routing_cost_t netlist::total_routing_cost(int nthreads)
+{
+#ifdef ENABLE_THREADS
+	if (nthreads > 1){
+		std::vector<routing_cost_job> jobs(nthreads);
+		std::vector<pthread_t> threads(nthreads);
+		for (int t = 0; t < nthreads; t++){
+			jobs[t].net = this;
+			jobs[t].begin = (long)_num_named * t / nthreads;
+			jobs[t].end = (long)_num_named * (t + 1) / nthreads;
+			if (t > 0){
+				pthread_create(&threads[t], NULL, routing_cost_thread, &jobs[t]);
+			}
+		}
+		routing_cost_thread(&jobs[0]);
+		routing_cost_t rval = jobs[0].cost;
+		for (int t = 1; t < nthreads; t++){
+			pthread_join(threads[t], NULL);
+			rval += jobs[t].cost;
+		}
+		return rval / 2;
+	}
+#else
+	(void)nthreads;
+#endif
+	return total_routing_cost();
 }
 
 
@@ -68,7 +169,7 @@ routing_cost_t netlist::total_routing_cost()
 void netlist::shuffle(Rng* rng)
 {
 	for (int i = 0; i < _max_x * _max_y * 1000; i++){
-		netlist_elem *a, *b;
+		long a, b;
 		get_random_pair(&a, &b, rng);
 		swap_locations(a, b);
 	}
@@ -76,12 +177,33 @@ void netlist::shuffle(Rng* rng)
 
 
 //*****************************************************************************************
-//  SYNC need chris' atomic swap algorithm
+// Waits until elem is not being swapped and replaces its location, returns the old one
+//*****************************************************************************************
+uint64_t netlist::replace_loc(long elem, uint64_t packed)
+{
+	uint64_t val;
+#ifdef ENABLE_THREADS
+	do {
+		val = pack_loc(location(elem));
+	} while(!_locs[elem].compare_exchange_weak(val, packed, std::memory_order_acq_rel));
+#else
+	val = _locs[elem].load(std::memory_order_relaxed);
+	_locs[elem].store(packed, std::memory_order_relaxed);
+#endif //ENABLE_THREADS
+	return val;
+}
+
+//*****************************************************************************************
+//  Same protocol as AtomicPtr::Swap: the element with the lower id is checked out
+//  first, so that two threads swapping overlapping pairs cannot deadlock
 //*****************************************************************************************
-void netlist::swap_locations(netlist_elem* elem_a, netlist_elem* elem_b)
+void netlist::swap_locations(long elem_a, long elem_b)
 {
-	//and swap the locations stored in the actual netlist_elem
-	elem_a->present_loc.Swap(elem_b->present_loc);
+	long first = min(elem_a, elem_b);
+	long second = max(elem_a, elem_b);
+	uint64_t loc_first = replace_loc(first, LOC_BUSY);
+	uint64_t loc_second = replace_loc(second, loc_first);
+	_locs[first].store(loc_second, std::memory_order_release);
 }
 
 
@@ -89,155 +211,336 @@ void netlist::swap_locations(netlist_elem* elem_a, netlist_elem* elem_b)
 //returns an elemment that is different from the different_from element
 // if different_from == NO_MATCHING_ELEMENT then returns any element
 //*****************************************************************************************
-netlist_elem* netlist::get_random_element(long* elem_id, long different_from, Rng* rng)
+long netlist::get_random_element(long different_from, Rng* rng)
 {
 	long id = rng->rand(_chip_size);
-	netlist_elem* elem = &(_elements[id]);
-	
+
 	//loop until we get a non duplicate element
 	//-1 is not a possible element, will never enter this loop in that case
 	//if it doesn't work, try a new one
 	while (id == different_from){ 
 		id = rng->rand(_chip_size);
-		elem = &(_elements[id]);
 	}
-	*elem_id=id;
-	return elem;
+	return id;
 }
 
 
 //*****************************************************************************************
-//assumption: will return elements a, b which we can get a valid lock on
+//returns two different random elements
 //*****************************************************************************************
-void netlist::get_random_pair(netlist_elem** a, netlist_elem** b, Rng* rng)
+void netlist::get_random_pair(long* a, long* b, Rng* rng)
 {
 	//get a random element
 	long id_a = rng->rand(_chip_size);
-	netlist_elem* elem_a = &(_elements[id_a]);
 	
 	//now do the same for b
 	long id_b = rng->rand(_chip_size);
-	netlist_elem* elem_b = &(_elements[id_b]);
 
 	//keep trying new elements until we get one that works
-	//get required locks automatically rolls back if it fails
-	//keep going until we get
 	while (id_b == id_a){ //no duplicate elements
 		//if it doesn't work, try a new one
 		id_b = rng->rand(_chip_size);
-		elem_b = &(_elements[id_b]);
 	}
 
-	*a = elem_a;
-	*b = elem_b;
+	*a = id_a;
+	*b = id_b;
 	return;
 }
 
 //*****************************************************************************************
-//  No longer easy to implement
+//  Linear search of the name table, not meant for the annealing loop
+//*****************************************************************************************
+long netlist::netlist_elem_from_name(const std::string& name)
+{
+	for (long elem = 0; elem < _num_named; ++elem){
+		if (this->name(elem) == name){
+			return elem;
+		}
+	}
+	return NO_MATCHING_ELEMENT;
+}
+
+//*****************************************************************************************
+//  Blank elements have no name
+//*****************************************************************************************
+std::string netlist::name(long elem) const
+{
+	if (elem >= _num_named){
+		return std::string();
+	}
+	return std::string(&_name_chars[_name_start[elem]], _name_start[elem + 1] - _name_start[elem]);
+}
+
+//*****************************************************************************************
+// Loader. The file is memory-mapped and split into one chunk per thread at record
+// boundaries (right after an END token). The chunks are tokenized and their names
+// hashed in parallel; the tokens point into the mapped file. Ids are then handed out
+// in one pass over the tokens in file order, so every element gets the same id as
+// with a sequential reader, and the names are resolved with an open addressing hash
+// table instead of a map.
 //*****************************************************************************************
-netlist_elem* netlist::netlist_elem_from_loc(location_t& loc)
+struct load_token {
+	const char* str;
+	uint32_t len;
+	uint32_t hash;
+};
+
+struct load_chunk {
+	const char* begin;
+	const char* end;
+	std::vector<load_token> names;//each record's name followed by its fanins
+	std::vector<uint32_t> fanins;//number of fanins of each record
+};
+
+static inline bool is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+//reads the token at p, or returns false if there is none before end
+static inline bool next_token(const char** p, const char* end, load_token* tok)
+{
+	const char* q = *p;
+	while (q < end && is_blank(*q)){
+		q++;
+	}
+	if (q == end){
+		*p = q;
+		return false;
+	}
+	const char* start = q;
+	uint32_t hash = 2166136261u;//FNV-1a
+	while (q < end && !is_blank(*q)){
+		hash = (hash ^ (unsigned char)*q) * 16777619u;
+		q++;
+	}
+	tok->str = start;
+	tok->len = q - start;
+	tok->hash = hash;
+	*p = q;
+	return true;
+}
+
+static inline bool is_end(const load_token& tok)
 {
-	assert(false);
+	return tok.len == 3 && tok.str[0] == 'E' && tok.str[1] == 'N' && tok.str[2] == 'D';
+}
+
+static void* tokenize_chunk(void* arg)
+{
+	load_chunk* chunk = static_cast<load_chunk*>(arg);
+	const char* p = chunk->begin;
+	load_token tok;
+	while (next_token(&p, chunk->end, &tok)){
+		chunk->names.push_back(tok);//the element
+		uint32_t fanins = 0;
+		if (next_token(&p, chunk->end, &tok)){//its type, presently not used
+			while (next_token(&p, chunk->end, &tok) && !is_end(tok)){
+				chunk->names.push_back(tok);
+				fanins++;
+			}
+		}
+		chunk->fanins.push_back(fanins);
+	}
 	return NULL;
 }
 
+//first position after the record that contains pos
+static const char* record_boundary(const char* body, const char* pos, const char* end)
+{
+	//do not start in the middle of a token
+	while (pos > body && pos < end && !is_blank(pos[-1])){
+		pos++;
+	}
+	load_token tok;
+	while (next_token(&pos, end, &tok)){
+		if (is_end(tok)){
+			break;
+		}
+	}
+	return pos;
+}
+
 //*****************************************************************************************
-//
+// Returns the id of the element with the name of tok, creating it if necessary.
+// An element can have fanin from an element that occurs both earlier and later in the
+// input file, so this is used for names and fanins alike.
 //*****************************************************************************************
-netlist_elem* netlist::netlist_elem_from_name(std::string& name)
+uint32_t netlist::id_of(const load_token& tok, std::vector<uint64_t>& table)
 {
-	return (_elem_names[name]);
+	size_t mask = table.size() - 1;
+	for (size_t slot = tok.hash & mask; ; slot = (slot + 1) & mask){
+		uint64_t entry = table[slot];
+		if (entry == 0){
+			if (_num_named >= _chip_size){
+				cerr << "netlist: more elements than locations on the chip" << endl;
+				exit(1);
+			}
+			_name_chars.insert(_name_chars.end(), tok.str, tok.str + tok.len);
+			_name_start.push_back(_name_chars.size());
+			table[slot] = ((uint64_t)tok.hash << 32) | (_num_named + 1);
+			return _num_named++;
+		}
+		uint32_t id = (uint32_t)entry - 1;
+		if ((uint32_t)(entry >> 32) == tok.hash &&
+		    _name_start[id + 1] - _name_start[id] == tok.len &&
+		    memcmp(&_name_chars[_name_start[id]], tok.str, tok.len) == 0){
+			return id;
+		}
+	}
 }
 
 //*****************************************************************************************
-//  TODO add errorchecking
-// ctor.  Takes a properly formatted input file, and converts it into a 
+// ctor.  Takes a properly formatted input file, and converts it into a CSR netlist
+// using nthreads threads
 //*****************************************************************************************
-netlist::netlist(const std::string& filename)
+netlist::netlist(const std::string& filename, int nthreads)
 {
-	ifstream fin (filename.c_str());
-	assert(fin.is_open()); // were there any errors on opening?
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0){
+		cerr << "netlist: cannot open " << filename << endl;
+		exit(1);
+	}
+	size_t size = st.st_size;
+	const char* data = NULL;
+	if (size > 0){
+		data = static_cast<const char*>(mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
+		if (data == MAP_FAILED){
+			cerr << "netlist: cannot map " << filename << endl;
+			exit(1);
+		}
+		madvise((void*)data, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	const char* end = data + size;
 
 	//read the chip_array paramaters
-	fin >> _num_elements >> _max_x >> _max_y;
+	const char* p = data;
+	load_token tok;
+	unsigned header[3] = {0, 0, 0};
+	for (int i = 0; i < 3 && next_token(&p, end, &tok); i++){
+		header[i] = strtoul(std::string(tok.str, tok.len).c_str(), NULL, 10);
+	}
+	_num_elements = header[0];
+	_max_x = header[1];
+	_max_y = header[2];
 	_chip_size = _max_x * _max_y;
 	assert(_num_elements < _chip_size);
 	
-	//create a chip of the right size
-	_elements.resize(_chip_size);
-	
-	cout << "locs created" << endl;
-	//create the location elements
-	vector<location_t> y_vec(_max_y); 
-	_locations.resize(_max_x, y_vec);
-	
-	//and set each one to its correct value
+	//every element starts at the location matching its id
+	_locs.reset(new std::atomic<uint64_t>[_chip_size]);
 	unsigned i_elem = 0;
 	for (int x = 0; x < _max_x; x++){
 		for (int y = 0; y < _max_y; y++){
-			location_t* loc = &_locations.at(x).at(y);
-			loc->x = x;
-			loc->y = y;
-			_elements.at(i_elem).present_loc.Set(loc);
+			location_t loc;
+			loc.x = x;
+			loc.y = y;
+			_locs[i_elem].store(pack_loc(loc), std::memory_order_relaxed);
 			i_elem++;
 		}//for (int y = 0; y < _max_y; y++)
 	}//for (int x = 0; x < _max_x; x++)
 	cout << "locs assigned" << endl;
 
-	int i=0;
-	while (!fin.eof()){
-		i++;
-		if ((i % 100000) == 0){
-			cout << "Just saw element: " << i << endl;
+	//split the records into chunks and tokenize them
+#ifndef ENABLE_THREADS
+	nthreads = 1;
+#endif
+	if (nthreads < 1){
+		nthreads = 1;
+	}
+	std::vector<load_chunk> chunks(nthreads);
+	const char* chunk_begin = p;
+	for (int t = 0; t < nthreads; t++){
+		chunks[t].begin = chunk_begin;
+		if (t == nthreads - 1){
+			chunks[t].end = end;
+		} else {
+			const char* pos = p + (end - p) / nthreads * (t + 1);
+			chunks[t].end = record_boundary(p, max(pos, chunk_begin), end);
 		}
-		std::string name;
-		fin >> name;
-		netlist_elem* present_elem = create_elem_if_necessary(name); // the element that we are presently working on
-		//use create if necessary because it might have been created as a previous elements fanin
-
-		//set the basic info for the element
-		present_elem->item_name = name; //its name
-
-		int type; //its type TODO errorcheck here
-		fin >> type; // presently, don't actually use this 
-
-		std::string fanin_name;
-		while (fin >> fanin_name){
-			if (fanin_name == "END"){
-				break; //last element in fanin
-			} //otherwise, make present elem the fanout of fanin_elem, and vice versa
-			netlist_elem* fanin_elem = create_elem_if_necessary(fanin_name);
-			present_elem->fanin.push_back(fanin_elem);
-			fanin_elem->fanout.push_back(present_elem);
-		}//while (fin >> fanin_name)
-	}//while (!fin.eof())
-		cout << "netlist created. " << i-1 << " elements." << endl;
-}
-
-//*****************************************************************************************
-// Used in the ctor.  Since an element have fanin from an element that can occur both
-// earlier and later in the input file, we must handle both cases
-//*****************************************************************************************
-netlist_elem* netlist::create_elem_if_necessary(std::string& name)
-{
-	static unsigned unused_elem = 0;//the first unused element
-	netlist_elem* rval;
-	//check whether we already have a netlist element with that name
-	std::map<std::string, netlist_elem*>::iterator iter = _elem_names.find(name);
-	if (iter == _elem_names.end()){
-		rval = &_elements.at(unused_elem);//if not, get one from the _elements pool
-		_elem_names[name] = rval;//put it in the map
-		unused_elem++;
-	} else {
-		//if it is in the map, just get a pointer to it
-		rval = iter->second;
+		chunk_begin = chunks[t].end;
 	}
-	return rval;
+#ifdef ENABLE_THREADS
+	std::vector<pthread_t> threads(nthreads);
+	for (int t = 1; t < nthreads; t++){
+		pthread_create(&threads[t], NULL, tokenize_chunk, &chunks[t]);
+	}
+	tokenize_chunk(&chunks[0]);
+	for (int t = 1; t < nthreads; t++){
+		pthread_join(threads[t], NULL);
+	}
+#else
+	tokenize_chunk(&chunks[0]);
+#endif
+
+	//hand out the ids in file order
+	size_t num_tokens = 0;
+	size_t num_records = 0;
+	for (int t = 0; t < nthreads; t++){
+		num_tokens += chunks[t].names.size();
+		num_records += chunks[t].fanins.size();
+	}
+	size_t table_size = 1024;
+	while (table_size < 2 * min((size_t)_chip_size, num_tokens)){
+		table_size *= 2;
+	}
+	std::vector<uint64_t> table(table_size, 0);//hash << 32 | (id + 1), 0 is empty
+	std::vector<uint32_t> ids;
+	ids.reserve(num_tokens);
+	_num_named = 0;
+	_name_start.assign(1, 0);
+	for (int t = 0; t < nthreads; t++){
+		for (size_t i = 0; i < chunks[t].names.size(); ++i){
+			ids.push_back(id_of(chunks[t].names[i], table));
+		}
+		std::vector<load_token>().swap(chunks[t].names);
+	}
+	std::vector<uint64_t>().swap(table);
+	if (size > 0){
+		munmap((void*)data, size);
+	}
+
+	//every fanin is an edge from its element, which also becomes a fanout of the fanin
+	size_t num_edges = num_tokens - num_records;
+	assert(2 * num_edges <= UINT32_MAX);
+	_fan_start.assign(_chip_size + 1, 0);
+	size_t k = 0;
+	for (int t = 0; t < nthreads; t++){
+		for (size_t r = 0; r < chunks[t].fanins.size(); ++r){
+			uint32_t present_elem = ids[k++];
+			_fan_start[present_elem + 1] += chunks[t].fanins[r];
+			for (uint32_t f = 0; f < chunks[t].fanins[r]; ++f){
+				_fan_start[ids[k++] + 1]++;
+			}
+		}
+	}
+	for (unsigned elem = 0; elem < _chip_size; ++elem){
+		_fan_start[elem + 1] += _fan_start[elem];
+	}
+	_fan.resize(_fan_start[_chip_size]);
+	std::vector<uint32_t> fill(_fan_start.begin(), _fan_start.end() - 1);
+	for (int pass = 0; pass < 2; pass++){//fanins first, then fanouts
+		k = 0;
+		for (int t = 0; t < nthreads; t++){
+			for (size_t r = 0; r < chunks[t].fanins.size(); ++r){
+				uint32_t present_elem = ids[k++];
+				for (uint32_t f = 0; f < chunks[t].fanins[r]; ++f){
+					uint32_t fanin_elem = ids[k++];
+					if (pass == 0){
+						_fan[fill[present_elem]++] = fanin_elem;
+					} else {
+						_fan[fill[fanin_elem]++] = present_elem;
+					}
+				}
+			}
+		}
+	}
+	cout << "netlist created. " << num_records << " elements." << endl;
 }
 
 //*****************************************************************************************
-// simple dump file
+// simple dump file, sorted by name
 // not threadsafe
 //*****************************************************************************************
 void netlist::print_locations(const std::string& filename)
@@ -245,10 +548,36 @@ void netlist::print_locations(const std::string& filename)
 	ofstream fout(filename.c_str());
 	assert(fout.is_open());
 
-	for (std::map<std::string, netlist_elem*>::iterator iter = _elem_names.begin();
-		 iter != _elem_names.end();
-		 ++iter){
-		netlist_elem* elem = iter->second;
-		fout << elem->item_name << "\t" << elem->present_loc.Get()->x << "\t" << elem->present_loc.Get()->y << std::endl;
+	std::vector<std::string> names(_num_named);
+	std::vector<uint32_t> order(_num_named);
+	for (long elem = 0; elem < _num_named; ++elem){
+		names[elem] = name(elem);
+		order[elem] = elem;
+	}
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+
+	for (size_t i = 0; i < order.size(); ++i){
+		location_t loc = location(order[i]);
+		fout << names[order[i]] << "\t" << loc.x << "\t" << loc.y << std::endl;
+	}
+}
+
+//*****************************************************************************************
+// copy of the placement, so that several runs can start from the same one
+// not threadsafe
+//*****************************************************************************************
+void netlist::save_locations(std::vector<uint64_t>* locs) const
+{
+	locs->resize(_chip_size);
+	for (unsigned elem = 0; elem < _chip_size; ++elem){
+		(*locs)[elem] = _locs[elem].load(std::memory_order_relaxed);
+	}
+}
+
+void netlist::restore_locations(const std::vector<uint64_t>& locs)
+{
+	assert(locs.size() == _chip_size);
+	for (unsigned elem = 0; elem < _chip_size; ++elem){
+		_locs[elem].store(locs[elem], std::memory_order_relaxed);
 	}
 }
@@ -30,45 +30,81 @@
 #ifndef NETLIST_H
 #define NETLIST_H
 
+#include <atomic>
+#include <memory>
+#include <stdint.h>
 #include <vector>
-#include <map>
 #include <string>
 
 #include "annealer_types.h"
+#include "location_t.h"
 
 const long NO_MATCHING_ELEMENT = -1;
 
-class netlist_elem;
-class location_t;
 class Rng;
+struct load_token;
 
+//*****************************************************************************************
+// The netlist is stored in compressed sparse row form. Elements are identified by a
+// 32-bit id in [0, chip_size). The fan-ins followed by the fan-outs of element i are
+// _fan[_fan_start[i]] .. _fan[_fan_start[i+1]-1]. The present location of every element
+// is one packed 64-bit word in _locs, so the routing cost of an element only reads its
+// adjacency range and the locations of its neighbours. Names are only needed to load
+// and print the netlist and live in a separate side table.
+//*****************************************************************************************
 class netlist
 {
 public:
-	netlist(const std::string& filename); //ctor
-	void get_random_pair(netlist_elem** a, netlist_elem** b, Rng* rng); // will return an element that we have a valid mutex on
-	void swap_locations(netlist_elem* elem_a, netlist_elem* elem_b);
+	netlist(const std::string& filename, int nthreads = 1); //ctor
+	void get_random_pair(long* a, long* b, Rng* rng);
+	void swap_locations(long elem_a, long elem_b);
 	void shuffle(Rng* rng);
-	netlist_elem* netlist_elem_from_loc(location_t& loc);
-	netlist_elem* netlist_elem_from_name(std::string& name);
+	long netlist_elem_from_name(const std::string& name);
 	routing_cost_t total_routing_cost();
+	routing_cost_t total_routing_cost(int nthreads);
+	routing_cost_t routing_cost_range(long begin, long end);//sum over the elements [begin, end)
 	void print_locations(const std::string& filename);
-	void release(netlist_elem* elem);
-	netlist_elem* get_random_element(long* elem_id, long different_from, Rng* rng);
-	
+	void save_locations(std::vector<uint64_t>* locs) const;
+	void restore_locations(const std::vector<uint64_t>& locs);
+	long get_random_element(long different_from, Rng* rng);
+
+	unsigned chip_size() const { return _chip_size; }
+	unsigned max_x() const { return _max_x; }
+	unsigned max_y() const { return _max_y; }
+	location_t location(long elem) const;
+	std::string name(long elem) const;
+	routing_cost_t routing_cost_given_loc(long elem, location_t loc) const;
+	routing_cost_t swap_cost(long elem, location_t old_loc, location_t new_loc) const;
+	routing_cost_t swap_cost_correction(long a, long b, location_t a_loc, location_t b_loc) const;
+
 protected:
 	unsigned _num_elements;
 	unsigned _max_x;
 	unsigned _max_y;
 	unsigned _chip_size;
-	std::vector<netlist_elem> _elements;//store the actual elements here
-	std::vector< std::vector<location_t> > _locations;//store the actual locations here
-	std::map<std::string, netlist_elem*> _elem_names;
-	netlist_elem* create_elem_if_necessary(std::string& name);
-	//due to the pointers, perhaps I should make the copy operator protected to prevent copying
-};
-
+	unsigned _num_named;//elements [0, _num_named) appear in the netlist file, the rest are blank
+	std::vector<uint32_t> _fan_start;//chip_size + 1 offsets into _fan
+	std::vector<uint32_t> _fan;//fan-in and fan-out ids of all elements
+	std::unique_ptr<std::atomic<uint64_t>[]> _locs;//packed present location of each element
+	std::vector<char> _name_chars;//names of the named elements, back to back
+	std::vector<size_t> _name_start;//_num_named + 1 offsets into _name_chars
 
+	uint64_t replace_loc(long elem, uint64_t packed);
+	uint32_t id_of(const load_token& tok, std::vector<uint64_t>& table);
+};
 
+//*****************************************************************************************
+// Spins while another thread is swapping the element, like AtomicPtr::Get
+//*****************************************************************************************
+inline location_t netlist::location(long elem) const
+{
+	uint64_t packed = _locs[elem].load(std::memory_order_acquire);
+#ifdef ENABLE_THREADS
+	while (packed == LOC_BUSY){
+		packed = _locs[elem].load(std::memory_order_acquire);
+	}
 #endif
+	return unpack_loc(packed);
+}
 
+#endif
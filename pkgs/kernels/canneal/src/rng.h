@@ -30,38 +30,82 @@
 #ifndef RNG_H
 #define RNG_H
 
-#include <vector>
-
-#ifdef ENABLE_THREADS
-#include <pthread.h>
-#endif
-
-#include "MersenneTwister.h"
+#include <stdint.h>
 
+//*****************************************************************************************
+// xoshiro256** generator. Each thread owns one Rng on its stack and seeds it from its
+// thread id, so a run with the same number of threads repeats the same random
+// streams per thread id, and creating one needs neither the heap nor a lock.
+// The state is expanded from the seed with splitmix64.
+//*****************************************************************************************
 class Rng
 {
 public:
-	Rng() {
-#ifdef ENABLE_THREADS
-		pthread_mutex_lock(&seed_lock);
-		_rng = new MTRand(seed++);
-		pthread_mutex_unlock(&seed_lock);
-#else
-		_rng = new MTRand(seed++);
-#endif //ENABLE_THREADS
+	Rng(uint64_t stream = 0) {
+		uint64_t x = RNG_SEED ^ (stream * 0x9e3779b97f4a7c15ull);
+		for (int i = 0; i < 4; i++){
+			x += 0x9e3779b97f4a7c15ull;
+			uint64_t z = x;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+			_s[i] = z ^ (z >> 31);
+		}
+	}
+
+	//64 random bits
+	inline uint64_t next() {
+		uint64_t result = rotl(_s[1] * 5, 7) * 9;
+		uint64_t t = _s[1] << 17;
+		_s[2] ^= _s[0];
+		_s[3] ^= _s[1];
+		_s[1] ^= _s[2];
+		_s[0] ^= _s[3];
+		_s[2] ^= t;
+		_s[3] = rotl(_s[3], 45);
+		return result;
+	}
+
+	inline long rand() {
+		return (long)(next() >> 33);
+	}
+
+	//uniform in [0, max), max must be positive
+	inline long rand(long max) {
+		return bounded(next(), max);
+	}
+
+	//uniform in [0, 1)
+	inline double drand() {
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
 	}
-	~Rng() {
-		delete _rng;
+
+	//fills out[0..n-1] with uniform values in [0, max), e.g. a batch of candidate elements
+	inline void rand_fill(uint32_t* out, long n, long max) {
+		for (long i = 0; i < n; i++){
+			out[i] = (uint32_t)bounded(next(), max);
+		}
 	}
-	long rand();
-	long rand(int max);
-	double drand();
+
+	//fills out[0..n-1] with uniform values in [0, 1)
+	inline void drand_fill(double* out, long n) {
+		for (long i = 0; i < n; i++){
+			out[i] = drand();
+		}
+	}
+
 protected:
 	//use same random seed for each run
-	static unsigned int seed;
-	static pthread_mutex_t seed_lock;
-	MTRand *_rng;
+	static const uint64_t RNG_SEED = 0x243f6a8885a308d3ull;
+	uint64_t _s[4];
+
+	static inline uint64_t rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+	//multiply-shift range reduction, the bias is below max / 2^64
+	static inline long bounded(uint64_t r, long max) {
+		return (long)(((unsigned __int128)r * (uint64_t)max) >> 64);
+	}
 };
 
 #endif
-
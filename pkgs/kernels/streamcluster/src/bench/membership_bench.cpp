@@ -0,0 +1,171 @@
+/*
+ * Scaling benchmark for the membership bitmaps of streamcluster
+ *
+ * Every thread repeatedly does what pgain does with switch_membership: it
+ * clears its block k1..k2, marks about half of its points, waits at a
+ * barrier and reads its marks back. Two layouts are compared:
+ *
+ *   shared   bits packed densely into shared words, as the former
+ *            vector<bool> did. Updates are plain read-modify-writes of the
+ *            word (relaxed atomics keep the benchmark well-defined), so
+ *            threads at block boundaries ping-pong cache lines and can
+ *            overwrite each other's bits.
+ *   blocked  BlockBitmap, where every block owns its words and cache lines,
+ *            accessed through the block view as pgain does.
+ *
+ * "lost" counts marks that were missing when the owner read them back.
+ * Small point counts (the final clustering of the centers, or many threads)
+ * make almost every word a boundary word and show the difference best.
+ *
+ * Usage: membership_bench [points] [max threads] [rounds]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+#define FMT_HEADER_ONLY
+#include <fmt/format.h>
+
+#include "../membership.hpp"
+#include "../parsec_barrier.hpp"
+
+using namespace std;
+
+//Dense bit array with the update semantics of vector<bool>
+class SharedBitmap {
+public:
+  void reset(long n) {
+    num = n;
+    nwords = (n + 63) / 64;
+    words.reset(new atomic<uint64_t>[nwords]);
+    for( long w = 0; w < nwords; w++ ) {
+      words[w].store(0, memory_order_relaxed);
+    }
+  }
+  bool operator[](long i) const {
+    return (words[i/64].load(memory_order_relaxed) >> (i%64)) & 1;
+  }
+  void set(long i, bool value) {
+    uint64_t w = words[i/64].load(memory_order_relaxed);
+    uint64_t bit = uint64_t(1) << (i%64);
+    words[i/64].store(value ? w | bit : w & ~bit, memory_order_relaxed);
+  }
+private:
+  long num = 0;
+  long nwords = 0;
+  unique_ptr<atomic<uint64_t>[]> words;
+};
+
+struct BenchArgs {
+  int pid;
+  int nproc;
+  long num;
+  long rounds;
+  bool blocked;
+  long lost;
+};
+
+static SharedBitmap shared_bits;
+static BlockBitmap blocked_bits;
+static pthread_barrier_t barrier;
+
+//Whether point i is marked in round r, about half of the points
+static inline bool marked(long i, long r) {
+  return ((uint32_t)((i ^ (r << 12)) * 2654435761u) >> 31) != 0;
+}
+
+template<typename Bitmap>
+static long run_rounds(Bitmap& bits, BenchArgs* a, long k1, long k2) {
+  long lost = 0;
+  for( long r = 0; r < a->rounds; r++ ) {
+    for( long i = k1; i < k2; i++ ) {
+      bits.set(i, false);
+    }
+    pthread_barrier_wait(&barrier);
+    for( long i = k1; i < k2; i++ ) {
+      if( marked(i, r) ) {
+        bits.set(i, true);
+      }
+    }
+    pthread_barrier_wait(&barrier);
+    for( long i = k1; i < k2; i++ ) {
+      if( marked(i, r) && !bits[i] ) {
+        lost++;
+      }
+    }
+    pthread_barrier_wait(&barrier);
+  }
+  return lost;
+}
+
+static void* bench_thread(void* arg) {
+  BenchArgs* a = (BenchArgs*)arg;
+  long bsize = a->num/a->nproc;
+  long k1 = bsize * a->pid;
+  long k2 = k1 + bsize;
+  if( a->pid == a->nproc-1 ) {
+    k2 = a->num;
+  }
+  if( a->blocked ) {
+    auto own = blocked_bits.block(a->pid);
+    a->lost = run_rounds(own, a, k1, k2);
+  } else {
+    a->lost = run_rounds(shared_bits, a, k1, k2);
+  }
+  return NULL;
+}
+
+//Run one configuration and return the time in seconds
+static double run(long num, int nproc, long rounds, bool blocked, long* lost) {
+  shared_bits.reset(num);
+  blocked_bits.reset(num, nproc);
+  pthread_barrier_init(&barrier, NULL, nproc);
+
+  vector<pthread_t> threads(nproc);
+  vector<BenchArgs> args(nproc);
+  auto start = chrono::steady_clock::now();
+  for( int p = 0; p < nproc; p++ ) {
+    args[p] = BenchArgs{p, nproc, num, rounds, blocked, 0};
+    pthread_create(&threads[p], NULL, bench_thread, &args[p]);
+  }
+  *lost = 0;
+  for( int p = 0; p < nproc; p++ ) {
+    pthread_join(threads[p], NULL);
+    *lost += args[p].lost;
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  pthread_barrier_destroy(&barrier);
+  return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+  long num = argc > 1 ? atol(argv[1]) : 4096;
+  int maxproc = argc > 2 ? atoi(argv[2]) : 64;
+  long rounds = argc > 3 ? atol(argv[3]) : 2000;
+  if( num < 1 || maxproc < 1 || rounds < 1 ) {
+    fmt::print(stderr, "usage: {} [points] [max threads] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  fmt::print("points: {}, rounds: {}\n", num, rounds);
+  fmt::print("{:>8} {:>12} {:>10} {:>12} {:>10} {:>8}\n",
+             "threads", "shared Mb/s", "lost", "blocked Mb/s", "lost", "speedup");
+  for( int nproc = 1; nproc <= maxproc; nproc *= 2 ) {
+    long lost_shared, lost_blocked;
+    double t_shared = run(num, nproc, rounds, false, &lost_shared);
+    double t_blocked = run(num, nproc, rounds, true, &lost_blocked);
+    double bits = (double)num * rounds / 1e6;
+    fmt::print("{:>8} {:>12.1f} {:>10} {:>12.1f} {:>10} {:>7.2f}x\n",
+               nproc, bits / t_shared, lost_shared, bits / t_blocked, lost_blocked,
+               t_shared / t_blocked);
+    if( nproc < maxproc && nproc * 2 > maxproc ) {
+      nproc = maxproc / 2;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,142 @@
+// Distance engine for streamcluster
+//
+// Coordinates are stored row by row in a 64-byte aligned buffer. Each row is
+// padded with zeros to a stride that is a multiple of DIST_ALIGN floats, so
+// the vector kernels can always process whole registers and never need a
+// remainder loop. The padding does not change any distance.
+//
+// dist_batch(c, pts, stride, n, dim, out) computes the squared Euclidean
+// distance between the point c and the n rows starting at pts, stride floats
+// apart. Both c and the rows must be padded to dist_stride(dim) floats.
+// The kernel is picked at startup by dist_engine_init() based on the CPU;
+// the environment variable SC_SIMD (scalar, avx2 or avx512) caps the choice.
+
+#ifndef __DISTANCE_HPP_
+#define __DISTANCE_HPP_ 1
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENABLE_SIMD_DISTANCE
+#include <immintrin.h>
+#endif
+
+//Row stride granularity in floats, 64 bytes
+constexpr int DIST_ALIGN = 16;
+
+//Number of distances computed per batch by the callers (fits in L1)
+constexpr long DIST_BLOCK = 256;
+
+//Padded row length for points of dimension dim
+inline int dist_stride(int dim) {
+  return (dim + DIST_ALIGN - 1) / DIST_ALIGN * DIST_ALIGN;
+}
+
+//Zero-initialized, 64-byte aligned storage for n rows of the given stride.
+//Release with free().
+inline float* alloc_coords(long n, int stride) {
+  size_t bytes = (size_t)n * stride * sizeof(float);
+  bytes = (bytes + 63) / 64 * 64;
+  if( bytes == 0 ) {
+    bytes = 64;
+  }
+  auto coords = static_cast<float*>(aligned_alloc(64, bytes));
+  if( coords != nullptr ) {
+    memset(coords, 0, bytes);
+  }
+  return coords;
+}
+
+using dist_batch_fn = void (*)(const float* c, const float* pts, long stride,
+                               long n, int dim, float* out);
+
+//Reference kernel, same operation order as the original dist()
+inline void dist_batch_scalar(const float* c, const float* pts, long stride,
+                              long n, int dim, float* out) {
+  for( long j = 0; j < n; j++ ) {
+    const float* p = pts + j*stride;
+    float result = 0.0;
+    for( int i = 0; i < dim; i++ ) {
+      result += (c[i] - p[i])*(c[i] - p[i]);
+    }
+    out[j] = result;
+  }
+}
+
+#ifdef ENABLE_SIMD_DISTANCE
+__attribute__((target("avx2,fma")))
+inline void dist_batch_avx2(const float* c, const float* pts, long stride,
+                            long n, int dim, float* out) {
+  long len = dist_stride(dim);
+  for( long j = 0; j < n; j++ ) {
+    const float* p = pts + j*stride;
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for( long i = 0; i < len; i += 16 ) {
+      __m256 d0 = _mm256_sub_ps(_mm256_load_ps(c + i), _mm256_load_ps(p + i));
+      __m256 d1 = _mm256_sub_ps(_mm256_load_ps(c + i + 8), _mm256_load_ps(p + i + 8));
+      acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+      acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    out[j] = _mm_cvtss_f32(s);
+  }
+}
+
+//the AVX-512 intrinsics of GCC 12 trip -Wmaybe-uninitialized on their own
+//placeholder operands
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+inline void dist_batch_avx512(const float* c, const float* pts, long stride,
+                              long n, int dim, float* out) {
+  long len = dist_stride(dim);
+  for( long j = 0; j < n; j++ ) {
+    const float* p = pts + j*stride;
+    __m512 acc = _mm512_setzero_ps();
+    for( long i = 0; i < len; i += 16 ) {
+      __m512 d = _mm512_sub_ps(_mm512_load_ps(c + i), _mm512_load_ps(p + i));
+      acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    out[j] = _mm512_reduce_add_ps(acc);
+  }
+}
+
+#pragma GCC diagnostic pop
+#endif //ENABLE_SIMD_DISTANCE
+
+inline dist_batch_fn dist_batch = dist_batch_scalar;
+inline const char* dist_engine_name = "scalar";
+
+//Select the widest kernel supported by the CPU
+inline void dist_engine_init() {
+#ifdef ENABLE_SIMD_DISTANCE
+  const char* cap = getenv("SC_SIMD");
+  int level = 2;
+  if( cap != nullptr ) {
+    std::string s(cap);
+    if( s == "scalar" ) {
+      level = 0;
+    } else if( s == "avx2" ) {
+      level = 1;
+    }
+  }
+
+  __builtin_cpu_init();
+  if( level >= 2 && __builtin_cpu_supports("avx512f") ) {
+    dist_batch = dist_batch_avx512;
+    dist_engine_name = "avx512";
+  } else if( level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ) {
+    dist_batch = dist_batch_avx2;
+    dist_engine_name = "avx2";
+  }
+#endif //ENABLE_SIMD_DISTANCE
+}
+
+#endif //__DISTANCE_HPP_
@@ -0,0 +1,135 @@
+// Partitioned membership bitmap for streamcluster
+//
+// pgain and pspeedy split the points into nproc contiguous blocks [k1, k2)
+// with k1 = pid * (num / nproc), the last block taking the remainder. A
+// BlockBitmap uses the same partition and gives every block its own run of
+// 64-bit words starting on a cache line. A thread that only writes the bits
+// of its own block therefore never shares a word, or a cache line, with
+// another thread: there is neither a lost update between neighbouring
+// blocks, as with a shared vector<bool>, nor false sharing.
+//
+// Reading any bit is always allowed. Writing a bit outside the own block is
+// only safe while the other threads wait at a barrier. Loops over the own
+// block should go through block(pid), which avoids locating the block of
+// every point.
+
+#ifndef __MEMBERSHIP_HPP_
+#define __MEMBERSHIP_HPP_ 1
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+class BlockBitmap {
+public:
+  //The bits of one block, indexed with the point number
+  class Block {
+  public:
+    bool operator[](long i) const {
+      long local = i - first;
+      return (words[local / WORD_BITS] >> (local % WORD_BITS)) & 1;
+    }
+    void set(long i, bool value) {
+      long local = i - first;
+      uint64_t bit = uint64_t(1) << (local % WORD_BITS);
+      if( value ) {
+        words[local / WORD_BITS] |= bit;
+      } else {
+        words[local / WORD_BITS] &= ~bit;
+      }
+    }
+  private:
+    friend class BlockBitmap;
+    Block(uint64_t* w, long f) : words(w), first(f) {}
+    uint64_t* words;
+    long first;
+  };
+
+  BlockBitmap() : num(0), bsize(0), nparts(1), words(nullptr), capacity(0) {}
+  ~BlockBitmap() { free(words); }
+  BlockBitmap(const BlockBitmap&) = delete;
+  BlockBitmap& operator=(const BlockBitmap&) = delete;
+
+  //Partition num bits into nparts blocks and clear all of them
+  void reset(long n, int parts) {
+    num = n;
+    nparts = parts;
+    bsize = num / nparts;
+    offset.resize(nparts + 1);
+    long total = 0;
+    for( int p = 0; p < nparts; p++ ) {
+      offset[p] = total;
+      total += (block_end(p) - block_begin(p) + WORD_BITS - 1) / WORD_BITS;
+      total = (total + LINE_WORDS - 1) / LINE_WORDS * LINE_WORDS;
+    }
+    offset[nparts] = total;
+    if( total > capacity || words == nullptr ) {
+      free(words);
+      capacity = total > 0 ? total : LINE_WORDS;
+      words = static_cast<uint64_t*>(aligned_alloc(64, capacity * sizeof(uint64_t)));
+      if( words == nullptr ) {
+        fprintf(stderr, "BlockBitmap: cannot allocate %ld words\n", capacity);
+        exit(1);
+      }
+    }
+    memset(words, 0, capacity * sizeof(uint64_t));
+  }
+
+  long size() const { return num; }
+
+  //First and one-past-last bit of block part, same as k1 and k2
+  long block_begin(int part) const { return bsize * part; }
+  long block_end(int part) const {
+    return part == nparts - 1 ? num : bsize * (part + 1);
+  }
+
+  //View of block part for the thread that owns it
+  Block block(int part) { return Block(words + offset[part], block_begin(part)); }
+
+  bool operator[](long i) const {
+    long w, b;
+    locate(i, &w, &b);
+    return (words[w] >> b) & 1;
+  }
+
+  void set(long i, bool value) {
+    long w, b;
+    locate(i, &w, &b);
+    if( value ) {
+      words[w] |= uint64_t(1) << b;
+    } else {
+      words[w] &= ~(uint64_t(1) << b);
+    }
+  }
+
+  //Clear all bits of block part; touches only words owned by that block
+  void clear_block(int part) {
+    memset(words + offset[part], 0,
+           (offset[part + 1] - offset[part]) * sizeof(uint64_t));
+  }
+
+private:
+  static constexpr long WORD_BITS = 64;
+  static constexpr long LINE_WORDS = 64 / sizeof(uint64_t);
+
+  void locate(long i, long* w, long* b) const {
+    int part = nparts - 1;
+    if( bsize > 0 && i / bsize < part ) {
+      part = i / bsize;
+    }
+    long local = i - block_begin(part);
+    *w = offset[part] + local / WORD_BITS;
+    *b = local % WORD_BITS;
+  }
+
+  long num;
+  long bsize;
+  int nparts;
+  std::vector<long> offset; //first word of each block, cache line aligned
+  uint64_t* words;
+  long capacity;            //allocated words
+};
+
+#endif //__MEMBERSHIP_HPP_
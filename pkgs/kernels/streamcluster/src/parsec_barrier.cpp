@@ -22,6 +22,7 @@
 #include <pthread.h>
 #include <cerrno>
 #include <cassert>
+#include <sched.h>
 #define FMT_HEADER_ONLY
 #include <fmt/format.h>
 
@@ -244,6 +245,61 @@ int parsec_barrier_wait(parsec_barrier_t *barrier) {
 
 
 
+//Spin barrier initialization & destruction
+int parsec_spin_barrier_init(parsec_spin_barrier_t *barrier, unsigned count) {
+  if(barrier==nullptr || count==0){
+    return EINVAL;
+  }
+  barrier->max = count;
+  barrier->n.store(count, std::memory_order_relaxed);
+  barrier->sense.store(0, std::memory_order_relaxed);
+  barrier->crossings.store(0, std::memory_order_relaxed);
+  return 0;
+}
+
+int parsec_spin_barrier_destroy(parsec_spin_barrier_t *barrier) {
+  if(barrier==nullptr){
+    return EINVAL;
+  }
+  if(barrier->n.load(std::memory_order_acquire) != barrier->max){
+    return EBUSY;
+  }
+  return 0;
+}
+
+//Polls of the sense flag before a waiting thread starts to yield
+static const unsigned long long SPIN_POLLS_MAX=4096;
+
+//Spin barrier usage
+int parsec_spin_barrier_wait(parsec_spin_barrier_t *barrier) {
+  if(barrier==nullptr){
+    return EINVAL;
+  }
+  //The flag cannot flip again before this thread arrives, so the value it
+  //will take at the end of this crossing is the opposite of the current one
+  int sense = 1 - barrier->sense.load(std::memory_order_relaxed);
+  if(barrier->n.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    //last thread to arrive, reset the barrier and release the others
+    barrier->n.store(barrier->max, std::memory_order_relaxed);
+    barrier->crossings.fetch_add(1, std::memory_order_relaxed);
+    barrier->sense.store(sense, std::memory_order_release);
+    return PARSEC_BARRIER_SERIAL_THREAD;
+  }
+  unsigned long long polls = 0;
+  while(barrier->sense.load(std::memory_order_acquire) != sense) {
+    if(++polls > SPIN_POLLS_MAX) {
+      sched_yield();
+    }
+  }
+  return 0;
+}
+
+unsigned long long parsec_spin_barrier_crossings(const parsec_spin_barrier_t *barrier) {
+  return barrier->crossings.load(std::memory_order_relaxed);
+}
+
+
+
 //Uncomment this macro to add a small program for debugging purposes
 //#define ENABLE_BARRIER_CHECKER
 
@@ -8,6 +8,7 @@
 
 #include <pthread.h>
 #include <cerrno>
+#include <atomic>
 
 
 
@@ -97,4 +98,28 @@ int parsec_barrierattr_setpshared(parsec_barrierattr_t *attr, int pshared);
 //Barrier usage
 int parsec_barrier_wait(parsec_barrier_t *barrier);
 
+
+
+//Sense-reversing spin barrier. Arriving threads decrement a counter, the
+//last one resets it and flips the sense flag the others are polling. There
+//is no mutex, so a crossing costs one atomic operation per thread. Waiting
+//threads start to yield the processor after a while, which keeps the
+//barrier usable with more threads than processors. The barrier also counts
+//how many times it has been crossed.
+struct parsec_spin_barrier_t{
+  alignas(64) std::atomic<unsigned> n;  //threads that still have to arrive
+  alignas(64) std::atomic<int> sense;   //flipped by the last thread to arrive
+  unsigned max;
+  std::atomic<unsigned long long> crossings;
+};
+
+int parsec_spin_barrier_init(parsec_spin_barrier_t *barrier, unsigned count);
+int parsec_spin_barrier_destroy(parsec_spin_barrier_t *barrier);
+
+//Returns PARSEC_BARRIER_SERIAL_THREAD in the last thread to arrive, 0 otherwise
+int parsec_spin_barrier_wait(parsec_spin_barrier_t *barrier);
+
+//Number of completed crossings since initialization
+unsigned long long parsec_spin_barrier_crossings(const parsec_spin_barrier_t *barrier);
+
 #endif //__PARSEC_BARRIER_H_
@@ -18,6 +18,15 @@
 #define FMT_HEADER_ONLY
 #include <fmt/format.h>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <numeric>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "distance.hpp"
+#include "membership.hpp"
 
 #ifdef ENABLE_THREADS
 #include <pthread.h>
@@ -58,20 +67,24 @@ using namespace std;
 /* these will be passed around to avoid copying coordinates */
 struct Point{
   float weight;
-  vector<float>::iterator coord;
+  float* coord; /* row of the coordinate block, padded to dist_stride(dim) */
   long assign;  /* number of point where this one is assigned */
   float cost;  /* cost of that assignment, weight*distance */
 };
 
 /* this is the array of points */
+/* p[i].coord is always the i-th row of one coordinate block, stride floats */
+/* apart, so that consecutive points can be handed to dist_batch at once */
 struct Points{
   long num; /* number of points; may not be N if this is a sample */
   int dim;  /* dimensionality */
+  int stride; /* distance between coordinate rows, dist_stride(dim) */
   vector<Point> p; /* the array itself */
+  vector<long> row; /* chunk row loaded into p[i], see loadChunk; may be empty */
 };
 
-static vector<bool> switch_membership; //whether to switch membership in pgain
-static vector<bool> is_center; //whether a point is a center
+static BlockBitmap switch_membership; //whether to switch membership in pgain
+static BlockBitmap is_center; //whether a point is a center
 static vector<int> center_table; //index table of centers
 
 static int nproc; //# of threads
@@ -86,7 +99,7 @@ tbb::cache_aligned_allocator<bool> memoryBool;
 #endif
 
 
-float dist(Point p1, Point p2, long dim);
+float dist(const Point& p1, const Point& p2, long dim);
 
 
 #ifdef TBB_VERSION
@@ -595,13 +608,19 @@ public:
 
 
 /* shuffle points into random order */
+/* coordinates are moved along so that the block stays in point order, */
+/* row records the permutation for the next chunk */
 void shuffle(Points *points)
 {
   for (long i=0;i<points->num-1;i++) {
     long j=(lrand48()%(points->num - i)) + i;
-    Point temp = points->p[i];
-    points->p[i] = points->p[j];
-    points->p[j] = temp;
+    swap(points->p[i].weight, points->p[j].weight);
+    swap(points->p[i].assign, points->p[j].assign);
+    swap(points->p[i].cost, points->p[j].cost);
+    swap_ranges(points->p[i].coord, points->p[i].coord + points->dim, points->p[j].coord);
+    if( !points->row.empty() ) {
+      swap(points->row[i], points->row[j]);
+    }
   }
 }
 
@@ -617,12 +636,10 @@ void intshuffle(vector<long> intarray, long length)
 }
 
 /* compute Euclidean distance squared between two points */
-float dist(Point p1, Point p2, long dim)
+float dist(const Point& p1, const Point& p2, long dim)
 {
-  float result=0.0;
-  for (int i=0;i<dim;i++){
-    result += (p1.coord[i] - p2.coord[i])*(p1.coord[i] - p2.coord[i]);
-  }
+  float result;
+  dist_batch(p1.coord, p2.coord, 0, 1, (int)dim, &result);
   return(result);
 }
 
@@ -696,11 +713,17 @@ double pspeedy(Points *points, double z, long *kcenter, int pid, [[maybe_unused]
   static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 #endif
 
+  float dists[DIST_BLOCK];
+
   /* create center at first point, send it to itself */
-  for( long k = k1; k < k2; k++ )    {
-    float distance = dist(points->p[k],points->p[0],points->dim);
-    points->p[k].cost = distance * points->p[k].weight;
-    points->p[k].assign=0;
+  for( long kb = k1; kb < k2; kb += DIST_BLOCK ) {
+    long nb = min(DIST_BLOCK, k2 - kb);
+    dist_batch(points->p[0].coord, points->p[kb].coord, points->stride, nb, points->dim, dists);
+    for( long k = kb; k < kb + nb; k++ )    {
+      float distance = dists[k - kb];
+      points->p[k].cost = distance * points->p[k].weight;
+      points->p[k].assign=0;
+    }
   }
 
   if( pid==0 )   {
@@ -722,15 +745,19 @@ double pspeedy(Points *points, double z, long *kcenter, int pid, [[maybe_unused]
       if( i >= points->num ){
         break;
       } 
-      for( long k = k1; k < k2; k++ )
-	{
-	  float distance = dist(points->p[i],points->p[k],points->dim);
-	  if( distance*points->p[k].weight < points->p[k].cost )
-	    {
-	      points->p[k].cost = distance * points->p[k].weight;
-	      points->p[k].assign=i;
-	    }
-	}
+      for( long kb = k1; kb < k2; kb += DIST_BLOCK ) {
+        long nb = min(DIST_BLOCK, k2 - kb);
+        dist_batch(points->p[i].coord, points->p[kb].coord, points->stride, nb, points->dim, dists);
+        for( long k = kb; k < kb + nb; k++ )
+	  {
+	    float distance = dists[k - kb];
+	    if( distance*points->p[k].weight < points->p[k].cost )
+	      {
+	        points->p[k].cost = distance * points->p[k].weight;
+	        points->p[k].assign=i;
+	      }
+	  }
+      }
 #ifdef ENABLE_THREADS
       pthread_barrier_wait(barrier);
       pthread_barrier_wait(barrier);
@@ -750,11 +777,15 @@ double pspeedy(Points *points, double z, long *kcenter, int pid, [[maybe_unused]
 	pthread_mutex_unlock(&mutex);
 	pthread_cond_broadcast(&cond);
 #endif
-	for( long k = k1; k < k2; k++ )  {
-	  float distance = dist(points->p[i],points->p[k],points->dim);
-	  if( distance*points->p[k].weight < points->p[k].cost )  {
-	    points->p[k].cost = distance * points->p[k].weight;
-	    points->p[k].assign=i;
+	for( long kb = k1; kb < k2; kb += DIST_BLOCK ) {
+	  long nb = min(DIST_BLOCK, k2 - kb);
+	  dist_batch(points->p[i].coord, points->p[kb].coord, points->stride, nb, points->dim, dists);
+	  for( long k = kb; k < kb + nb; k++ )  {
+	    float distance = dists[k - kb];
+	    if( distance*points->p[k].weight < points->p[k].cost )  {
+	      points->p[k].cost = distance * points->p[k].weight;
+	      points->p[k].assign=i;
+	    }
 	  }
 	}
 #ifdef ENABLE_THREADS
@@ -924,13 +955,48 @@ double pgain(long x, Points *points, double z, long int *numcenters)
 #else //!TBB_VERSION
 
 
-double pgain(long x, Points *points, double z, long int *numcenters, int pid, [[maybe_unused]] pthread_barrier_t* barrier)
+/* partial results of one thread in pgain, one cache line per thread */
+struct alignas(64) GainSlot {
+  int centers; //number of centers in the block of the thread
+  int close;   //centers the thread would close if x was opened
+  double cost; //cost of opening x as seen by the thread
+};
+
+static vector<GainSlot> gain_slots; //resized by localSearch
+static long gain_candidates; //pgain calls in the current localSearch
+
+#ifdef ENABLE_THREADS
+static parsec_spin_barrier_t gain_barrier; //phases of pgain
+static unsigned long long gain_crossings; //crossings of gain_barrier in the last localSearch
+#endif
+
+static inline void gain_barrier_wait()
 {
-  //  printf("pgain pthread %d begin\n",pid);
 #ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
+  parsec_spin_barrier_wait(&gain_barrier);
 #endif
+}
+
+/* pairwise sum of the slots [lo, hi); every thread evaluates the same tree */
+/* and gets bit-identical totals without a reduction step on thread 0 */
+static double gain_cost_sum(int lo, int hi)
+{
+  if( hi - lo == 1 ) {
+    return gain_slots[lo].cost;
+  }
+  int mid = lo + (hi - lo)/2;
+  return gain_cost_sum(lo, mid) + gain_cost_sum(mid, hi);
+}
 
+/* pgain is called by all threads for the same candidate x. Every thread
+   works on its block k1..k2 and the phases are separated by gain_barrier.
+   A candidate that is not opened needs two barrier crossings, one that is
+   opened three more: one before the centers change hands and two to
+   rebuild center_table on the next call. *rebuild is private to the
+   calling thread and must be true on the first call after is_center was
+   changed outside of pgain. */
+double pgain(long x, Points *points, double z, long int *numcenters, int pid, bool *rebuild)
+{
   //my block
   long bsize = points->num/nproc;
   long k1 = bsize * pid;
@@ -938,13 +1004,12 @@ double pgain(long x, Points *points, double z, long int *numcenters, int pid, [[
   if( pid == nproc-1 ){
     k2 = points->num;
   } 
-
-  
-  int number_of_centers_to_close = 0;
+  //membership bits of my block, in words no other thread writes
+  auto my_center = is_center.block(pid);
+  auto my_switch = switch_membership.block(pid);
 
   static vector<double> work_mem;
-  static double gl_cost_of_opening_x;
-  static int gl_number_of_centers_to_close;
+  static vector<float> x_dist; //distance of every point to x
 
   //each thread takes a block of working_mem.
   long stride = *numcenters+2;
@@ -953,110 +1018,96 @@ double pgain(long x, Points *points, double z, long int *numcenters, int pid, [[
   if( stride % cl != 0 ) { 
     stride = cl * ( stride / cl + 1);
   }
-  long K = stride -2 ; // K==*numcenters
-  
-  //my own cost of opening x
-  double cost_of_opening_x = 0;
 
-  if( pid==0 )    { 
-    work_mem.resize(stride*(nproc+1));
-    gl_cost_of_opening_x = 0;
-    gl_number_of_centers_to_close = 0;
+  if( pid == 0 ) {
+    gain_candidates++;
   }
 
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
   /*For each center, we have a *lower* field that indicates 
     how much we will save by closing the center. 
     Each thread has its own copy of the *lower* fields as an array.
     We first build a table to index the positions of the *lower* fields. 
+    The table only changes when a center is opened, so it is kept
+    between calls until then.
   */
-
-  int count = 0;
-  for( long i = k1; i < k2; i++ ) {
-    if( is_center[i] ) {
-      center_table[i] = count++;
+  if( *rebuild ) {
+    int count = 0;
+    for( long i = k1; i < k2; i++ ) {
+      if( my_center[i] ) {
+        center_table[i] = count++;
+      }
     }
-  }
-  work_mem[pid*stride] = count;
-
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
-
-  if( pid == 0 ) {
-    int accum = 0;
-    for( int p = 0; p < nproc; p++ ) {
-      int tmp = (int)work_mem[p*stride];
-      work_mem[p*stride] = accum;
-      accum += tmp;
+    gain_slots[pid].centers = count;
+    if( pid == 0 ) {
+      work_mem.resize(stride*(nproc+1));
+      x_dist.resize(points->num);
     }
-  }
+    gain_barrier_wait();
 
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
-
-  for(long i = k1; i < k2; i++ ) {
-    if( is_center[i] ) {
-      center_table[i] += (int)work_mem[pid*stride];
+    //exclusive prefix sum of the center counts, each thread sums its own
+    int offset = 0;
+    for( int p = 0; p < pid; p++ ) {
+      offset += gain_slots[p].centers;
+    }
+    for( long i = k1; i < k2; i++ ) {
+      if( my_center[i] ) {
+        center_table[i] += offset;
+      }
     }
+    gain_barrier_wait();
+    *rebuild = false;
   }
 
-  //now we finish building the table. clear the working memory.
-  fill(switch_membership.begin()+k1, switch_membership.end(), false);
-  fill(work_mem.begin()+pid*stride, work_mem.end(), 0);
-  if( pid== 0 ){
-    fill(work_mem.begin()+nproc*stride, work_mem.end(), 0);
-  } 
-
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
-  
   //my *lower* fields
   auto lower = work_mem.begin() + pid*stride;
   //global *lower* fields
   auto gl_lower = work_mem.begin() + nproc*stride;
 
-  for (long i = k1; i < k2; i++ ) {
-    float x_cost = dist(points->p[i], points->p[x], points->dim) 
-      * points->p[i].weight;
-    float current_cost = points->p[i].cost;
+  fill(lower, lower + stride, 0);
+  switch_membership.clear_block(pid);
+
+  //my own cost of opening x
+  double cost_of_opening_x = 0;
+  int number_of_centers_to_close = 0;
+
+  for (long ib = k1; ib < k2; ib += DIST_BLOCK ) {
+    long nb = min(DIST_BLOCK, k2 - ib);
+    dist_batch(points->p[x].coord, points->p[ib].coord, points->stride, nb, points->dim, &x_dist[ib]);
+    for (long i = ib; i < ib + nb; i++ ) {
+      float x_cost = x_dist[i] * points->p[i].weight;
+      float current_cost = points->p[i].cost;
 
-    if ( x_cost < current_cost ) {
+      if ( x_cost < current_cost ) {
 
-      // point i would save cost just by switching to x
-      // (note that i cannot be a median, 
-      // or else dist(p[i], p[x]) would be 0)
+        // point i would save cost just by switching to x
+        // (note that i cannot be a median, 
+        // or else dist(p[i], p[x]) would be 0)
       
-      switch_membership[i] = true;
-      cost_of_opening_x += x_cost - current_cost;
+        my_switch.set(i, true);
+        cost_of_opening_x += x_cost - current_cost;
 
-    } else {
+      } else {
 
-      // cost of assigning i to x is at least current assignment cost of i
+        // cost of assigning i to x is at least current assignment cost of i
 
-      // consider the savings that i's **current** median would realize
-      // if we reassigned that median and all its members to x;
-      // note we've already accounted for the fact that the median
-      // would save z by closing; now we have to subtract from the savings
-      // the extra cost of reassigning that median and its members 
-      long assign = points->p[i].assign;
-      lower[center_table[assign]] += current_cost - x_cost;
+        // consider the savings that i's **current** median would realize
+        // if we reassigned that median and all its members to x;
+        // note we've already accounted for the fact that the median
+        // would save z by closing; now we have to subtract from the savings
+        // the extra cost of reassigning that median and its members 
+        long assign = points->p[i].assign;
+        lower[center_table[assign]] += current_cost - x_cost;
+      }
     }
   }
 
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
+  gain_barrier_wait();
 
   // at this time, we can calculate the cost of opening a center
   // at x; if it is negative, we'll go through with opening it
 
   for ( long i = k1; i < k2; i++ ) {
-    if( is_center[i] ) {
+    if( my_center[i] ) {
       double low = z;
       //aggregate from all threads
       for( int p = 0; p < nproc; p++ ) {
@@ -1073,26 +1124,18 @@ double pgain(long x, Points *points, double z, long int *numcenters, int pid, [[
       }
     }
   }
-  //use the rest of working memory to store the following
-  work_mem[pid*stride + K] = number_of_centers_to_close;
-  work_mem[pid*stride + K+1] = cost_of_opening_x;
+  gain_slots[pid].close = number_of_centers_to_close;
+  gain_slots[pid].cost = cost_of_opening_x;
 
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
-  //  printf("thread %d cost complete\n",pid); 
+  gain_barrier_wait();
 
-  if( pid==0 ) {
-    gl_cost_of_opening_x = z;
-    //aggregate
-    for( int p = 0; p < nproc; p++ ) {
-      gl_number_of_centers_to_close += (int)work_mem[p*stride + K];
-      gl_cost_of_opening_x += work_mem[p*stride+K+1];
-    }
+  //every thread reduces the partial results itself
+  double gl_cost_of_opening_x = z + gain_cost_sum(0, nproc);
+  int gl_number_of_centers_to_close = 0;
+  for( int p = 0; p < nproc; p++ ) {
+    gl_number_of_centers_to_close += gain_slots[p].close;
   }
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
+
   // Now, check whether opening x would save cost; if so, do it, and
   // otherwise do nothing
 
@@ -1100,35 +1143,32 @@ double pgain(long x, Points *points, double z, long int *numcenters, int pid, [[
     //  we'd save money by opening x; we'll do it
     for ( long i = k1; i < k2; i++ ) {
       bool close_center = gl_lower[center_table[points->p[i].assign]] > 0 ;
-      if ( switch_membership[i] || close_center ) {
+      if ( my_switch[i] || close_center ) {
 	// Either i's median (which may be i itself) is closing,
 	// or i is closer to x than to its current median
-	points->p[i].cost = points->p[i].weight *
-	  dist(points->p[i], points->p[x], points->dim);
+	points->p[i].cost = points->p[i].weight * x_dist[i];
 	points->p[i].assign = x;
       }
     }
     for( long i = k1; i < k2; i++ ) {
-      if( is_center[i] && gl_lower[center_table[i]] > 0 ) {
-	is_center[i] = false;
+      if( my_center[i] && gl_lower[center_table[i]] > 0 ) {
+	my_center.set(i, false);
       }
     }
     if( x >= k1 && x < k2 ) {
-      is_center[x] = true;
+      my_center.set(x, true);
     }
 
     if( pid==0 ) {
       *numcenters = *numcenters + 1 - gl_number_of_centers_to_close;
     }
+    *rebuild = true;
+
+    gain_barrier_wait();
   }
   else {
-    if( pid==0 ){
-      gl_cost_of_opening_x = 0;  // the value we'll return
-    }
+    gl_cost_of_opening_x = 0;  // the value we'll return
   }
-#ifdef ENABLE_THREADS
-  pthread_barrier_wait(barrier);
-#endif
 
   return -gl_cost_of_opening_x;
 }
@@ -1177,9 +1217,9 @@ float pFL(Points *points, int *feasible, int numfeasible,
 
 
 #else //!TBB_VERSION
- double pFL(Points *points, vector<long> feasible, long numfeasible,
+ double pFL(Points *points, vector<long>& feasible, long numfeasible,
 	  double z, long *k, double cost, long iter, float e, 
-	  int pid, pthread_barrier_t* barrier)
+	  int pid, [[maybe_unused]] pthread_barrier_t* barrier)
 {
 #ifdef ENABLE_THREADS
   pthread_barrier_wait(barrier);
@@ -1187,6 +1227,7 @@ float pFL(Points *points, int *feasible, int numfeasible,
  
 
   double change = cost;
+  bool rebuild = true; //pgain has to build center_table first
   /* continue until we run iter iterations without improvement */
   /* stop instead if improvement is less than e */
   while (change/cost > 1.0*e) {
@@ -1202,7 +1243,7 @@ float pFL(Points *points, int *feasible, int numfeasible,
 #endif
     for (long i=0;i<iter;i++) {
       long x = i%numfeasible;
-      change += pgain(feasible[x], points, z, k, pid, barrier);
+      change += pgain(feasible[x], points, z, k, pid, &rebuild);
     }
     cost -= change;
 #ifdef ENABLE_THREADS
@@ -1464,9 +1505,13 @@ double pkmedian(Points *points, long kmin, long kmax, long* kfinal,
 #endif
 
   double myhiz = 0;
-  for (long kk=k1;kk < k2; kk++ ) {
-    myhiz += dist(points->p[kk], points->p[0],
-		      ptDimension)*points->p[kk].weight;
+  float dists[DIST_BLOCK];
+  for (long kb=k1;kb < k2; kb += DIST_BLOCK ) {
+    long nb = min(DIST_BLOCK, k2 - kb);
+    dist_batch(points->p[0].coord, points->p[kb].coord, points->stride, nb, ptDimension, dists);
+    for (long kk=kb;kk < kb + nb; kk++ ) {
+      myhiz += dists[kk - kb]*points->p[kk].weight;
+    }
   }
   hizs[pid] = myhiz;
 
@@ -1533,7 +1578,7 @@ double pkmedian(Points *points, long kmin, long kmax, long* kfinal,
     {
       numfeasible = selectfeasible_fast(points,&feasible,kmin,pid,barrier);
       for( int i = 0; i< points->num; i++ ) {
-	is_center[points->p[i].assign]= true;
+	is_center.set(points->p[i].assign, true);
       }
     }
 
@@ -1616,7 +1661,7 @@ int contcenters(Points *points)
 }
 
 /* copy centers from points to centers */
-void copycenters(Points *points, Points* centers, vector<long> centerIDs, long offset)
+void copycenters(Points *points, Points* centers, vector<long>& centerIDs, long offset)
 {
 
   vector<bool> is_a_median (points->num, false);
@@ -1679,7 +1724,10 @@ void localSearch( Points* points, long kmin, long kmax, long* kfinal ) {
 
 #ifdef ENABLE_THREADS
     pthread_barrier_init(&barrier,NULL,nproc);
+    parsec_spin_barrier_init(&gain_barrier,nproc);
 #endif
+    gain_slots.resize(nproc);
+    gain_candidates = 0;
     for( int i = 0; i < nproc; i++ ) {
       arg[i].points = points;
       arg[i].kmin = kmin;
@@ -1702,17 +1750,40 @@ void localSearch( Points* points, long kmin, long kmax, long* kfinal ) {
 #endif
 
 #ifdef ENABLE_THREADS
+    gain_crossings = parsec_spin_barrier_crossings(&gain_barrier);
     pthread_barrier_destroy(&barrier);
+    parsec_spin_barrier_destroy(&gain_barrier);
 #endif
 }
 #endif // TBB_VERSION
 
 
+/* position of a stream, enough to continue reading from there */
+struct StreamPos {
+  long long remaining;     /* SimStream: points left to generate */
+  unsigned short xsubi[3]; /* SimStream: generator state */
+  long long offset;        /* FileStream: bytes consumed */
+};
+
+/* identity of the input of a stream, a checkpoint only resumes on the same */
+enum { STREAM_SIM = 1, STREAM_FILE = 2 };
+struct StreamId {
+  int kind;                /* STREAM_SIM or STREAM_FILE */
+  long long size;          /* SimStream: points, FileStream: bytes */
+  long long seed;          /* SimStream: generator seed */
+  char name[256];          /* FileStream: file name, null-terminated, truncated */
+};
+
 class PStream {
 public:
-  virtual size_t read( float* dest, int dim, int num ) = 0;
+  /* read up to num points into dest, one row every stride floats; */
+  /* the padding after the first dim floats of a row is left zero */
+  virtual size_t read( float* dest, int dim, int stride, int num ) = 0;
   virtual int ferror() = 0;
   virtual int feof() = 0;
+  virtual StreamPos tell() = 0;
+  virtual void seek( const StreamPos& pos ) = 0;
+  virtual StreamId id() = 0;
   virtual ~PStream() = default;
   PStream() = default;
   PStream(const PStream& other) = default;
@@ -1722,16 +1793,23 @@ public:
 };
 
 //synthetic stream
+//uses its own generator so that it can run concurrently with the clustering
 class SimStream : public PStream {
 public:
-  SimStream(long n_ ) {
+  SimStream(long n_, long seed_ ) {
     n = n_;
-  }
-  size_t read( float* dest, int dim, int num ) override{
+    total = n_;
+    seed = seed_;
+    //same initial state as srand48(seed)
+    xsubi[0] = 0x330E;
+    xsubi[1] = (unsigned short)(seed & 0xFFFF);
+    xsubi[2] = (unsigned short)((seed >> 16) & 0xFFFF);
+  }
+  size_t read( float* dest, int dim, int stride, int num ) override{
     size_t count = 0;
     for( int i = 0; i < num && n > 0; i++ ) {
       for( int k = 0; k < dim; k++ ) {
-	dest[i*dim + k] = (float)lrand48()/(float)INT_MAX;
+	dest[(long)i*stride + k] = (float)nrand48(xsubi)/(float)INT_MAX;
       }
       n--;
       count++;
@@ -1744,6 +1822,23 @@ public:
   int feof() override{
     return static_cast<int> (n <= 0);
   }
+  StreamPos tell() override{
+    StreamPos pos {};
+    pos.remaining = n;
+    copy(xsubi, xsubi + 3, pos.xsubi);
+    return pos;
+  }
+  void seek( const StreamPos& pos ) override{
+    n = pos.remaining;
+    copy(pos.xsubi, pos.xsubi + 3, xsubi);
+  }
+  StreamId id() override{
+    StreamId i {};
+    i.kind = STREAM_SIM;
+    i.size = total;
+    i.seed = seed;
+    return i;
+  }
   ~SimStream() = default;
   SimStream(const SimStream& other) = default;
   SimStream& operator=(const SimStream& other) = default;
@@ -1752,39 +1847,249 @@ public:
   
 private:
   long n;
+  long total;
+  long seed;
+  unsigned short xsubi[3];
 };
 
+//points stored as raw floats, read with stdio or, if map is set, copied
+//straight from a read-only mapping of the file into the rows
 class FileStream : public PStream {
 public:
-  FileStream(const string & filename ) :
-    fp{fopen(filename.c_str(), "rb"), fclose}
+  FileStream(const string & filename, bool map ) :
+    fp{fopen(filename.c_str(), "rb"), fclose}, name(filename)
     {
       if( fp.get() == nullptr ) {
         fmt::print(stderr,"error opening file {}\n.",filename);
         exit(1);
       }
+      struct stat st;
+      if( fstat(fileno(fp.get()), &st) == 0 ) {
+        filesize = st.st_size;
+      }
+      if( map && filesize > 0 ) {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp.get()), 0);
+        if( addr != MAP_FAILED ) {
+          madvise(addr, st.st_size, MADV_SEQUENTIAL);
+          base = static_cast<const char*>(addr);
+          size = st.st_size;
+        } else {
+          fmt::print(stderr,"cannot map {}, reading it instead\n",filename);
+        }
+      }
+    }
+  size_t read( float* dest, int dim, int stride, int num ) override{
+    if( base != nullptr ) {
+      size_t row = sizeof(float)*dim;
+      size_t count = min((size_t)num, (size - pos)/row);
+      for( size_t i = 0; i < count; i++ ) {
+        memcpy(dest + i*stride, base + pos, row);
+        pos += row;
+      }
+      //like fread, hitting the end of the file sets the end-of-file flag
+      if( count < (size_t)num ) {
+        at_end = true;
+      }
+      return count;
+    }
+
+    size_t count = std::fread(dest, sizeof(float)*dim, num, fp.get()); 
+    // fread delivers packed rows; spread them to the padded stride,
+    // last row first so that no row is overwritten before it is moved
+    if( stride != dim ) {
+      for( long i = (long)count - 1; i >= 0; i-- ) {
+        memmove(dest + i*stride, dest + i*dim, dim*sizeof(float));
+        fill(dest + i*stride + dim, dest + (i+1)*stride, 0.0f);
+      }
     }
-  size_t read( float* dest, int dim, int num ) override{
-    return std::fread(dest, sizeof(float)*dim, num, fp.get()); 
+    return count;
   }
   int ferror() override{
-    return std::ferror(fp.get());
+    return base != nullptr ? 0 : std::ferror(fp.get());
   }
   int feof() override{
-    return std::feof(fp.get());
+    return base != nullptr ? static_cast<int>(at_end) : std::feof(fp.get());
+  }
+  StreamPos tell() override{
+    StreamPos p {};
+    p.offset = base != nullptr ? (long long)pos : (long long)ftello(fp.get());
+    return p;
+  }
+  void seek( const StreamPos& p ) override{
+    if( base != nullptr ) {
+      pos = min((size_t)p.offset, size);
+    } else if( fseeko(fp.get(), (off_t)p.offset, SEEK_SET) != 0 ) {
+      fmt::print(stderr,"cannot seek to offset {} of the input\n",p.offset);
+      exit(1);
+    }
+  }
+  StreamId id() override{
+    StreamId i {};
+    i.kind = STREAM_FILE;
+    i.size = filesize;
+    name.copy(i.name, sizeof(i.name) - 1);
+    return i;
   }
   ~FileStream() {
+    if( base != nullptr ) {
+      munmap(const_cast<char*>(base), size);
+    }
     fmt::print(stderr,"closing file stream\n");
   }
-  FileStream(const FileStream& other) = default;
-  FileStream& operator=(const FileStream& other) = default;
-  FileStream(FileStream&& other) = default;
-  FileStream& operator=(FileStream&& other) = default;
+  FileStream(const FileStream& other) = delete;
+  FileStream& operator=(const FileStream& other) = delete;
+  FileStream(FileStream&& other) = delete;
+  FileStream& operator=(FileStream&& other) = delete;
 private:
   unique_ptr<FILE, int(*)(FILE*)> fp;
+  string name;
+  long long filesize = 0;
+  const char* base = nullptr; /* mapping of the file, if any */
+  size_t size = 0;
+  size_t pos = 0;
+  bool at_end = false;
+};
+
+/* one chunk of points filled by ChunkReader */
+struct Chunk {
+  unique_ptr<float, decltype(&free)> block {nullptr, free};
+  size_t num = 0;     /* points read */
+  bool error = false; /* read failed */
+  bool eof = false;   /* last chunk of the stream */
+  StreamPos pos {};   /* stream position after this chunk */
 };
 
-void outcenterIDs( Points* centers, vector<long> centerIDs, const string &outfile ) {
+/* number of chunk buffers; two let the stream fill the next chunk while */
+/* the current one is clustered, a third one absorbs uneven read times */
+#define READ_BUFFERS 2
+
+/* Reads the stream ahead of the clustering. With threads enabled a
+   background thread fills free buffers while the caller works on the
+   chunk it got from next(); the buffers travel between the two threads
+   through a bounded queue. Without threads next() reads synchronously. */
+class ChunkReader {
+public:
+  ChunkReader(PStream* stream_, int dim_, int stride_, long chunksize_) :
+    stream(stream_), dim(dim_), stride(stride_), chunksize(chunksize_)
+  {
+#ifdef ENABLE_THREADS
+    chunks.resize(READ_BUFFERS);
+#else
+    chunks.resize(1);
+#endif
+    for( auto& c : chunks ) {
+      c.block.reset(alloc_coords(chunksize, stride));
+      if( c.block == nullptr ) {
+        fmt::print(stderr,"not enough memory for a chunk!\n");
+        exit(1);
+      }
+      free_chunks.push_back(&c);
+    }
+#ifdef ENABLE_THREADS
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+    pthread_create(&thread, NULL, run, this);
+#endif
+  }
+
+  ~ChunkReader() {
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+#endif
+  }
+
+  ChunkReader(const ChunkReader& other) = delete;
+  ChunkReader& operator=(const ChunkReader& other) = delete;
+
+  /* wait for the next chunk; do not call again after a chunk with eof or error */
+  Chunk* next() {
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&mutex);
+    while( ready_chunks.empty() ) {
+      pthread_cond_wait(&cond, &mutex);
+    }
+    Chunk* c = ready_chunks.front();
+    ready_chunks.pop_front();
+    pthread_mutex_unlock(&mutex);
+#else
+    Chunk* c = free_chunks.front();
+    free_chunks.pop_front();
+    fill(c);
+#endif
+    return c;
+  }
+
+  /* hand a chunk back once its points are no longer needed */
+  void release(Chunk* c) {
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&mutex);
+    free_chunks.push_back(c);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+#else
+    free_chunks.push_back(c);
+#endif
+  }
+
+private:
+  void fill(Chunk* c) {
+    c->num = stream->read(c->block.get(), dim, stride, (int)chunksize);
+    c->error = stream->ferror() != 0 || (c->num < (size_t)chunksize && stream->feof() == 0);
+    c->eof = stream->feof() != 0;
+    c->pos = stream->tell();
+  }
+
+#ifdef ENABLE_THREADS
+  static void* run(void* arg) {
+    auto reader = static_cast<ChunkReader*>(arg);
+    while(true) {
+      pthread_mutex_lock(&reader->mutex);
+      while( reader->free_chunks.empty() && !reader->stop ) {
+        pthread_cond_wait(&reader->cond, &reader->mutex);
+      }
+      if( reader->stop ) {
+        pthread_mutex_unlock(&reader->mutex);
+        break;
+      }
+      Chunk* c = reader->free_chunks.front();
+      reader->free_chunks.pop_front();
+      pthread_mutex_unlock(&reader->mutex);
+
+      reader->fill(c);
+
+      pthread_mutex_lock(&reader->mutex);
+      reader->ready_chunks.push_back(c);
+      pthread_cond_broadcast(&reader->cond);
+      pthread_mutex_unlock(&reader->mutex);
+      if( c->eof || c->error ) {
+        break;
+      }
+    }
+    return nullptr;
+  }
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool stop = false;
+  deque<Chunk*> ready_chunks;
+#endif
+
+  PStream* stream;
+  int dim;
+  int stride;
+  long chunksize;
+  vector<Chunk> chunks;
+  deque<Chunk*> free_chunks;
+};
+
+void outcenterIDs( Points* centers, const vector<long>& centerIDs, const string &outfile ) {
   unique_ptr<FILE, int(*)(FILE*)> fp {fopen(outfile.c_str(), "w"), fclose};
   if( fp.get()==nullptr ) {
     fmt::print(stderr, "error opening {}\n",outfile);
@@ -1807,99 +2112,280 @@ void outcenterIDs( Points* centers, vector<long> centerIDs, const string &outfil
   } 
 }
 
+/* Copy the num points of a chunk into the point block. Point i gets chunk */
+/* row points->row[i], the permutation the last shuffle left behind, so a */
+/* chunk is clustered in the same order as when every point kept the */
+/* coordinate row it was shuffled to. In a short last chunk the rows at or */
+/* past num are moved to the back, keeping the order of the others. */
+static void loadChunk(Points* points, const float* src, long num)
+{
+  stable_partition(points->row.begin(), points->row.end(), [num](long r) { return r < num; });
+  for( long i = 0; i < num; i++ ) {
+    copy_n(src + points->row[i]*points->stride, points->dim, points->p[i].coord);
+  }
+  points->num = num;
+}
+
+#define CKPT_MAGIC "SCCKPT03"
+
+/* Checkpoint of streamCluster after a completed chunk. The header is
+   followed by the weights (float), the coordinates (dim floats each) and
+   the IDs (long long) of the intermediate centers, then by the chunk row
+   order of the points (chunksize long longs, see loadChunk). Values are
+   stored in host byte order. */
+struct CheckpointHeader {
+  char magic[8];          /* CKPT_MAGIC, not null-terminated */
+  int dim;
+  int done;               /* stream exhausted, only the final clustering is left */
+  long long kmin;
+  long long kmax;
+  long long chunksize;
+  long long centersize;
+  long long chunks;       /* completed chunks */
+  long long IDoffset;     /* points consumed */
+  long long numcenters;
+  unsigned short rng[3];  /* lrand48 state */
+  StreamPos pos;          /* stream position after the last chunk */
+  StreamId input;         /* stream the chunks were read from */
+};
+
+/* current lrand48 state, left unchanged */
+static void getRandState(unsigned short state[3])
+{
+  unsigned short tmp[3] = {0, 0, 0};
+  unsigned short* cur = seed48(tmp);
+  copy(cur, cur + 3, state);
+  seed48(state);
+}
+
+/* write the checkpoint to a temporary file and rename it over the old one, */
+/* so that a crash while writing leaves the previous checkpoint intact */
+static bool writeCheckpoint(const string& file, const CheckpointHeader& hdr,
+                            const Points& centers, const vector<long>& centerIDs,
+                            const vector<long>& row)
+{
+  string tmp = file + ".tmp";
+  unique_ptr<FILE, int(*)(FILE*)> fp {fopen(tmp.c_str(), "wb"), fclose};
+  if( fp.get() == nullptr ) {
+    return false;
+  }
+  bool ok = fwrite(&hdr, sizeof(hdr), 1, fp.get()) == 1;
+  for( long i = 0; ok && i < centers.num; i++ ) {
+    ok = fwrite(&centers.p[i].weight, sizeof(float), 1, fp.get()) == 1;
+  }
+  for( long i = 0; ok && i < centers.num; i++ ) {
+    ok = fwrite(centers.p[i].coord, sizeof(float), centers.dim, fp.get()) == (size_t)centers.dim;
+  }
+  for( long i = 0; ok && i < centers.num; i++ ) {
+    long long id = centerIDs[i];
+    ok = fwrite(&id, sizeof(id), 1, fp.get()) == 1;
+  }
+  for( size_t i = 0; ok && i < row.size(); i++ ) {
+    long long r = row[i];
+    ok = fwrite(&r, sizeof(r), 1, fp.get()) == 1;
+  }
+  ok = ok && fflush(fp.get()) == 0 && fsync(fileno(fp.get())) == 0;
+  ok = fclose(fp.release()) == 0 && ok;
+  return ok && rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+/* load a checkpoint written by writeCheckpoint, centers must have room for */
+/* hdr->centersize points; row is only filled in if it holds hdr->chunksize */
+/* entries, the caller rejects other chunk sizes */
+static bool readCheckpoint(const string& file, CheckpointHeader* hdr,
+                           Points* centers, vector<long>& centerIDs,
+                           vector<long>& row)
+{
+  unique_ptr<FILE, int(*)(FILE*)> fp {fopen(file.c_str(), "rb"), fclose};
+  if( fp.get() == nullptr ||
+      fread(hdr, sizeof(*hdr), 1, fp.get()) != 1 ||
+      memcmp(hdr->magic, CKPT_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->numcenters < 0 || hdr->numcenters > (long long)centers->p.size() ) {
+    return false;
+  }
+  centers->num = hdr->numcenters;
+  for( long i = 0; i < centers->num; i++ ) {
+    if( fread(&centers->p[i].weight, sizeof(float), 1, fp.get()) != 1 ) {
+      return false;
+    }
+  }
+  for( long i = 0; i < centers->num; i++ ) {
+    if( fread(centers->p[i].coord, sizeof(float), centers->dim, fp.get()) != (size_t)centers->dim ) {
+      return false;
+    }
+  }
+  for( long i = 0; i < centers->num; i++ ) {
+    long long id;
+    if( fread(&id, sizeof(id), 1, fp.get()) != 1 ) {
+      return false;
+    }
+    centerIDs[i] = id;
+  }
+  for( size_t i = 0; hdr->chunksize == (long long)row.size() && i < row.size(); i++ ) {
+    long long r;
+    if( fread(&r, sizeof(r), 1, fp.get()) != 1 || r < 0 || r >= (long long)row.size() ) {
+      return false;
+    }
+    row[i] = r;
+  }
+  return true;
+}
+
 void streamCluster( PStream* stream, 
 		    long kmin, long kmax, int dim,
-		    long chunksize, long centersize, const string & outfile )
+		    long chunksize, long centersize, const string & outfile,
+		    long ckptEvery, bool resume )
 {
 
-#ifdef TBB_VERSION
-  vector<float> block (chunksize*dim, 0.0);
-  vector<float> centerBlock(centersize*dim, 0.0);
+  int stride = dist_stride(dim);
+  unique_ptr<float, decltype(&free)> centerBlock {alloc_coords(centersize, stride), free};
   vector<long> centerIDs (centersize*dim, 0);
-#else
-  vector<float> block (chunksize*dim, 0.0);
-  vector<float> centerBlock(centersize*dim, 0.0);
-  vector<long> centerIDs (centersize*dim, 0);
-#endif
 
-  if( block.empty() ) { 
+  if( centerBlock == nullptr ) { 
     fmt::print(stderr,"not enough memory for a chunk!\n");
     exit(1);
   }
 
   Points points;
   points.dim = dim;
+  points.stride = stride;
   points.num = chunksize;
   points.p.resize(chunksize);
+  points.row.resize(chunksize);
+  iota(points.row.begin(), points.row.end(), 0);
 
+  unique_ptr<float, decltype(&free)> block {alloc_coords(chunksize, stride), free};
+  if( block == nullptr ) {
+    fmt::print(stderr,"not enough memory for a chunk!\n");
+    exit(1);
+  }
   for( int i = 0; i < chunksize; i++ ) {
-    points.p[i].coord = block.begin()+(i*dim);
+    points.p[i].coord = block.get()+(i*stride);
   }
 
   Points centers;
   centers.dim = dim;
+  centers.stride = stride;
   centers.p.resize(centersize);
   centers.num = 0;
 
   for( int i = 0; i< centersize; i++ ) {
-    centers.p[i].coord = centerBlock.begin()+(i*dim);
+    centers.p[i].coord = centerBlock.get()+(i*stride);
     centers.p[i].weight = 1.0;
   }
 
   long IDoffset = 0;
   long kfinal = 0;
-  while(true) {
-
-    float* aux_block = &block[0];
-    size_t numRead  = stream->read(aux_block, dim, (int)chunksize ); 
-    fmt::print(stderr,"read {} points\n",numRead);
-
-    if( stream->ferror() != 0 || numRead < (unsigned int)chunksize && stream->feof() == 0 ) {
-      fmt::print(stderr, "error reading data!\n");
+  long chunks = 0;
+  bool done = false;
+
+  //checkpoints go next to the output file
+  string ckptfile = outfile + ".ckpt";
+  CheckpointHeader hdr {};
+  if( resume ) {
+    if( !readCheckpoint(ckptfile, &hdr, &centers, centerIDs, points.row) ) {
+      fmt::print(stderr,"cannot resume from {}\n",ckptfile);
       exit(1);
     }
-
-    points.num = numRead;
-    for( int i = 0; i < points.num; i++ ) {
-      points.p[i].weight = 1.0;
+    if( hdr.dim != dim || hdr.kmin != kmin || hdr.kmax != kmax ||
+        hdr.chunksize != chunksize || hdr.centersize != centersize ) {
+      fmt::print(stderr,"{} was written with different parameters\n",ckptfile);
+      exit(1);
+    }
+    StreamId input = stream->id();
+    hdr.input.name[sizeof(hdr.input.name) - 1] = '\0';
+    if( hdr.input.kind != input.kind || hdr.input.size != input.size ||
+        hdr.input.seed != input.seed || strcmp(hdr.input.name, input.name) != 0 ) {
+      fmt::print(stderr,"{} was written for a different input\n",ckptfile);
+      exit(1);
     }
+    chunks = hdr.chunks;
+    IDoffset = hdr.IDoffset;
+    done = hdr.done != 0;
+    seed48(hdr.rng);
+    stream->seek(hdr.pos);
+    fmt::print(stderr,"resuming after chunk {} ({} points, {} centers)\n",chunks,IDoffset,centers.num);
+  }
+
+  if( !done ) {
+    ChunkReader reader(stream, dim, stride, chunksize);
+    while(true) {
+
+      Chunk* chunk = reader.next();
+      size_t numRead = chunk->num;
+      fmt::print(stderr,"read {} points\n",numRead);
+
+      if( chunk->error ) {
+        fmt::print(stderr, "error reading data!\n");
+        exit(1);
+      }
+
+      loadChunk(&points, chunk->block.get(), numRead);
+      for( int i = 0; i < points.num; i++ ) {
+        points.p[i].weight = 1.0;
+      }
+      bool last = chunk->eof;
+      StreamPos pos = chunk->pos;
+      reader.release(chunk);
 
 #ifdef TBB_VERSION
-    switch_membership = (bool*)memoryBool.allocate(points.num*sizeof(bool), NULL);
-    is_center = (bool*)calloc(points.num,sizeof(bool));
-    center_table = (int*)memoryInt.allocate(points.num*sizeof(int));
+      switch_membership = (bool*)memoryBool.allocate(points.num*sizeof(bool), NULL);
+      is_center = (bool*)calloc(points.num,sizeof(bool));
+      center_table = (int*)memoryInt.allocate(points.num*sizeof(int));
 #else
-    switch_membership.resize(points.num); 
-    is_center.resize(points.num);
-    fill(is_center.begin(), is_center.end(), false);
-    center_table.resize(points.num);
+      switch_membership.reset(points.num, nproc);
+      is_center.reset(points.num, nproc);
+      center_table.resize(points.num);
 #endif
 
 
-    //fprintf(stderr,"center_table = 0x%08x\n",(int)center_table);
-    //fprintf(stderr,"is_center = 0x%08x\n",(int)is_center);
+      //fprintf(stderr,"center_table = 0x%08x\n",(int)center_table);
+      //fprintf(stderr,"is_center = 0x%08x\n",(int)is_center);
 
-    localSearch(&points,kmin, kmax,&kfinal); // parallel
+      localSearch(&points,kmin, kmax,&kfinal); // parallel
+#ifdef ENABLE_THREADS
+      fmt::print(stderr,"pgain: {} candidates, {} barrier crossings\n",gain_candidates,gain_crossings);
+#endif
 
-    //fprintf(stderr,"finish local search\n");
-    contcenters(&points); /* sequential */
-    if( kfinal + centers.num > centersize ) {
-      //here we don't handle the situation where # of centers gets too large. 
-      fmt::print(stderr,"oops! no more space for centers\n");
-      exit(1);
-    }
+      //fprintf(stderr,"finish local search\n");
+      contcenters(&points); /* sequential */
+      if( kfinal + centers.num > centersize ) {
+        //here we don't handle the situation where # of centers gets too large. 
+        fmt::print(stderr,"oops! no more space for centers\n");
+        exit(1);
+      }
 
-    copycenters(&points, &centers, centerIDs, IDoffset); /* sequential */
-    IDoffset += numRead;
+      copycenters(&points, &centers, centerIDs, IDoffset); /* sequential */
+      IDoffset += numRead;
 
 #ifdef TBB_VERSION
-    memoryBool.deallocate(switch_membership, sizeof(bool));
-    free(is_center);
-    memoryInt.deallocate(center_table, sizeof(int));
+      memoryBool.deallocate(switch_membership, sizeof(bool));
+      free(is_center);
+      memoryInt.deallocate(center_table, sizeof(int));
 #endif
 
-    if( stream->feof() != 0) {
-      break;
+      chunks++;
+      if( ckptEvery > 0 && (chunks % ckptEvery == 0 || last) ) {
+        memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+        hdr.dim = dim;
+        hdr.done = last;
+        hdr.kmin = kmin;
+        hdr.kmax = kmax;
+        hdr.chunksize = chunksize;
+        hdr.centersize = centersize;
+        hdr.chunks = chunks;
+        hdr.IDoffset = IDoffset;
+        hdr.numcenters = centers.num;
+        getRandState(hdr.rng);
+        hdr.pos = pos;
+        hdr.input = stream->id();
+        if( !writeCheckpoint(ckptfile, hdr, centers, centerIDs, points.row) ) {
+          fmt::print(stderr,"warning: cannot write checkpoint {}\n",ckptfile);
+        }
+      }
+      if( last ) {
+        break;
+      }
     }
   }
 
@@ -1909,15 +2395,20 @@ void streamCluster( PStream* stream,
   is_center.resize(centers.num); 
   center_table.resize(centers.num); 
 #else
-  switch_membership.resize(centers.num);
-  is_center.resize(centers.num);
-  fill(is_center.begin(), is_center.end(), false);
+  switch_membership.reset(centers.num, nproc);
+  is_center.reset(centers.num, nproc);
   center_table.resize(centers.num);
 #endif
 
   localSearch( &centers, kmin, kmax ,&kfinal ); // parallel
+#ifdef ENABLE_THREADS
+  fmt::print(stderr,"pgain: {} candidates, {} barrier crossings\n",gain_candidates,gain_crossings);
+#endif
   contcenters(&centers);
   outcenterIDs( &centers, centerIDs, outfile);
+  if( ckptEvery > 0 || resume ) {
+    remove(ckptfile.c_str());
+  }
 
 // Added to solve memory leaks, from here 
 #ifdef TBB_VERSION
@@ -1951,7 +2442,7 @@ int main(int argc, char **argv)
   
   vector<string> argv_vec (argv, argv+argc);
   if (argc<min_argc) {
-    fmt::print(stderr,"usage: {} k1 k2 d n chunksize clustersize infile outfile nproc\n",
+    fmt::print(stderr,"usage: {} k1 k2 d n chunksize clustersize infile outfile nproc [--checkpoint c] [--resume]\n",
 	    argv_vec[0]);
     fmt::print(stderr,"  k1:          Min. number of centers allowed\n");
     fmt::print(stderr,"  k2:          Max. number of centers allowed\n");
@@ -1962,6 +2453,8 @@ int main(int argc, char **argv)
     fmt::print(stderr,"  infile:      Input file (if n<=0)\n");
     fmt::print(stderr,"  outfile:     Output file\n");
     fmt::print(stderr,"  nproc:       Number of threads to use\n");
+    fmt::print(stderr,"  --checkpoint c: Save the intermediate centers to outfile.ckpt every c chunks\n");
+    fmt::print(stderr,"  --resume:    Continue after the last chunk saved in outfile.ckpt\n");
     fmt::print(stderr,"\n");
     fmt::print(stderr, "if n > 0, points will be randomly generated instead of reading from infile.\n");
     exit(1);
@@ -1979,6 +2472,19 @@ int main(int argc, char **argv)
   string outfilename = argv_vec[argv_index++];
   nproc = atoi(argv_vec[argv_index++].c_str());
 
+  long ckptEvery = 0;
+  bool resume = false;
+  while( argv_index < argc ) {
+    string opt = argv_vec[argv_index++];
+    if( opt == "--checkpoint" && argv_index < argc ) {
+      ckptEvery = atol(argv_vec[argv_index++].c_str());
+    } else if( opt == "--resume" ) {
+      resume = true;
+    } else {
+      fmt::print(stderr,"unknown option {}\n",opt);
+      exit(1);
+    }
+  }
 
 #ifdef TBB_VERSION
   fprintf(stderr,"TBB version. Number of divisions: %d\n",NUM_DIVISIONS);
@@ -1986,13 +2492,18 @@ int main(int argc, char **argv)
 #endif
 
 
+  dist_engine_init();
+  fmt::print(stderr,"Distance kernel: {}\n",dist_engine_name);
+
   srand48(SEED);
   unique_ptr<PStream> stream;
   if( n > 0 ) {
-    stream = make_unique <SimStream> (n);
+    stream = make_unique <SimStream> (n, SEED);
   }
   else {
-    stream = make_unique <FileStream> (infilename); 
+    //SC_MMAP=1 maps the input file instead of reading it
+    const char* map = getenv("SC_MMAP");
+    stream = make_unique <FileStream> (infilename, map != nullptr && strcmp(map, "0") != 0); 
   }
 
 
@@ -2000,7 +2511,7 @@ int main(int argc, char **argv)
   __parsec_roi_begin();
 #endif
 
-  streamCluster(stream.get(), kmin, kmax, dim, chunksize, clustersize, outfilename );
+  streamCluster(stream.get(), kmin, kmax, dim, chunksize, clustersize, outfilename, ckptEvery, resume );
 
 #ifdef ENABLE_PARSEC_HOOKS
   __parsec_roi_end();